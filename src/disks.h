@@ -33,8 +33,19 @@
 
 #define DISKS_MAX 128     /* total number of disks we display */
 #define DISKS_MAXSIZE 256 /* GiB, largest disk we display */
+#define DISKS_QUEUE 8     /* maximum number of writes in flight */
+#define DISKS_QUEUEMEM (64*1024*1024) /* try to keep the write queue under this much memory */
+#define DISKS_WINDOWMEM (32*1024*1024) /* maximum amount of not yet written data in the page cache */
+#define DISKS_ALIGN 4096  /* buffer, offset and size alignment for direct I/O */
 
-extern int disks_all, disks_serial, disks_maxsize, disks_targets[DISKS_MAX];
+/* disks_mode, how writes are made durable */
+#define DISKS_SYNC 0      /* O_SYNC, every write waits for the device */
+#define DISKS_DIRECT 1    /* O_DIRECT, bypass the page cache */
+#define DISKS_WINDOW 2    /* buffered, with a bounded window of dirty pages */
+
+/* disks_skipzero, the target reads back zeros already (new or just discarded), zeros aren't written at all */
+/* disks_readback, verify with a separate pass reading everything back from the device after it's written */
+extern int disks_all, disks_serial, disks_maxsize, disks_mode, disks_skipzero, disks_readback, disks_targets[DISKS_MAX];
 extern uint64_t disks_capacity[DISKS_MAX];
 
 /* some defines if not defined in limit.h */
@@ -60,6 +71,19 @@ char *disks_getlang(void);
  */
 void disks_refreshlist(void);
 
+#ifndef WINVER
+/**
+ * Start listening to the kernel's hotplug events, after this disks_refreshlist() doesn't rescan the devices
+ * returns a file descriptor which becomes readable when there are events, or -1 if that's not possible here
+ */
+int disks_hotplugstart(void);
+
+/**
+ * Process the pending hotplug events, returns 1 if the target list has to be refreshed
+ */
+int disks_hotplug(void);
+#endif
+
 /**
  * Return mount points and bookmarks file
  */
@@ -76,3 +100,51 @@ void *disks_open(int targetId, uint64_t size);
  * Receives FD or HANDLE
  */
 void disks_close(void *ctx);
+
+#ifndef WINVER
+/**
+ * Read from the target disk at the given offset
+ * waits for queued writes to that area first
+ */
+int disks_read(void *ctx, uint64_t offs, char *buffer, int size);
+
+/**
+ * Queue writing to the target disk at the given offset
+ * buffer can be reused as soon as this returns, returns size or -1 on error
+ */
+int disks_write(void *ctx, uint64_t offs, char *buffer, int size);
+
+/**
+ * Copy size bytes from the file src at srcoffs straight to the target disk at offs
+ * returns size, 0 if this isn't possible here (nothing copied, use disks_write) or -1 on error
+ */
+int disks_copy(void *ctx, uint64_t offs, int src, uint64_t srcoffs, int size);
+
+/**
+ * Zero out size bytes on the target disk at offs without sending the zeros (or skip them with disks_skipzero)
+ * returns 1 if done, 0 if this isn't possible here (nothing changed, write zeros instead) or -1 on error
+ */
+int disks_zero(void *ctx, uint64_t offs, uint64_t size);
+
+/**
+ * Wait for all queued writes to finish, returns 0 on success
+ */
+int disks_flush(void *ctx);
+
+/**
+ * Return the number of bytes queued but not yet confirmed by the target disk
+ */
+uint64_t disks_pending(void *ctx);
+
+/**
+ * Queue reading size bytes at offs back from the target disk, bypassing the page cache (after disks_flush)
+ * returns 1 if queued, 0 if the queue is full (call disks_readwait first) or -1 on error
+ */
+int disks_readq(void *ctx, uint64_t offs, int size);
+
+/**
+ * Wait for the oldest read queued by disks_readq, the data is returned in buffer, which remains
+ * valid until the next disks_readq or disks_readwait call. Returns the number of bytes read or -1 on error
+ */
+int disks_readwait(void *ctx, char **buffer);
+#endif
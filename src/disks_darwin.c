@@ -56,7 +56,7 @@
 #import "main.h"
 #import "disks.h"
 
-int disks_all = 0, disks_serial = 0, disks_maxsize = DISKS_MAXSIZE, disks_targets[DISKS_MAX], currTarget = 0;
+int disks_all = 0, disks_serial = 0, disks_maxsize = DISKS_MAXSIZE, disks_mode = DISKS_SYNC, disks_skipzero = 0, disks_readback = 0, disks_targets[DISKS_MAX], currTarget = 0;
 uint64_t disks_capacity[DISKS_MAX];
 char disks_serials[DISKS_MAX][64];
 
@@ -287,6 +287,19 @@ void disks_refreshlist(void)
     [pool release];
 }
 
+/**
+ * Hotplug events aren't implemented here, the list is rescanned on every refresh
+ */
+int disks_hotplugstart(void)
+{
+    return -1;
+}
+
+int disks_hotplug(void)
+{
+    return 0;
+}
+
 /**
  * Return mount points and bookmarks file
  */
@@ -514,15 +527,23 @@ sererr:         main_getErrorMessage();
     [pool release];
 
     errno = 0;
-    ret = open(deviceName, O_RDWR | O_SYNC | O_EXCL);
+    ret = open(deviceName, O_RDWR | O_EXCL | (disks_mode != DISKS_WINDOW ? O_SYNC : 0));
     if(verbose) printf("  fd=%d errno=%d err=%s\r\n", ret, errno, strerror(errno));
     if(ret < 0 || errno) {
         main_getErrorMessage();
         return NULL;
     }
+    /* there's no O_DIRECT on MacOSX, but caching can be turned off. F_NOCACHE doesn't evict pages which
+     * are already cached, so for read-back it must be set before the first write, otherwise we'd verify the cache */
+    if(disks_mode == DISKS_DIRECT || disks_readback) fcntl(ret, F_NOCACHE, 1);
     return (void*)((long int)ret);
 }
 
+/* read-back, there's no queue here, the one queued read is made by disks_readwait */
+static char *rbuf = NULL;
+static uint64_t roffs;
+static int rsize = 0;
+
 /**
  * Close the target disk
  */
@@ -533,6 +554,8 @@ void disks_close(void *data)
 
     close(fd);
     sync();
+    if(rbuf) { free(rbuf); rbuf = NULL; }
+    rsize = 0;
     if(verbose) printf("disks_close(%d)\r\n", fd);
 #if DISKS_TEST
     if(currTarget == 999) return;
@@ -559,3 +582,101 @@ void disks_close(void *data)
 
     [pool release];
 }
+
+/**
+ * Read from the target disk at the given offset
+ */
+int disks_read(void *ctx, uint64_t offs, char *buffer, int size)
+{
+    int fd = (int)((long int)ctx);
+    ssize_t r = pread(fd, buffer, size, offs);
+    /* serial lines have no offsets */
+    if(r < 0 && errno == ESPIPE) r = read(fd, buffer, size);
+    return (int)r;
+}
+
+/**
+ * Queue writing to the target disk at the given offset
+ */
+int disks_write(void *ctx, uint64_t offs, char *buffer, int size)
+{
+    int fd = (int)((long int)ctx), ret = 0;
+    ssize_t r;
+
+    while(ret < size) {
+        r = pwrite(fd, buffer + ret, size - ret, offs + ret);
+        if(r < 0 && errno == ESPIPE) r = write(fd, buffer + ret, size - ret);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return -1;
+        ret += (int)r;
+    }
+    return ret;
+}
+
+/**
+ * Copy straight from a file to the target disk, not supported here
+ */
+int disks_copy(void *ctx, uint64_t offs, int src, uint64_t srcoffs, int size)
+{
+    (void)ctx; (void)offs; (void)src; (void)srcoffs; (void)size;
+    return 0;
+}
+
+/**
+ * Zero out a range on the target disk, only possible if it's known to be zeros already
+ */
+int disks_zero(void *ctx, uint64_t offs, uint64_t size)
+{
+    (void)ctx; (void)offs; (void)size;
+    return disks_skipzero;
+}
+
+/**
+ * Wait for all queued writes to finish
+ */
+int disks_flush(void *ctx)
+{
+    (void)ctx;
+    return 0;
+}
+
+/**
+ * Return the number of bytes queued but not yet confirmed by the target disk
+ */
+uint64_t disks_pending(void *ctx)
+{
+    (void)ctx;
+    return 0;
+}
+
+/**
+ * Queue reading back from the target disk at the given offset, with the cache turned off
+ */
+int disks_readq(void *ctx, uint64_t offs, int size)
+{
+    int fd = (int)((long int)ctx);
+
+    if(rsize) return 0;
+    if(size < 1 || size > buffer_size) { errno = EINVAL; return -1; }
+    if(!rbuf) {
+        /* written pages weren't cached (see disks_open), just make sure they've reached the media */
+        fcntl(fd, F_FULLFSYNC);
+        if(!(rbuf = (char*)malloc(buffer_size))) return -1;
+    }
+    roffs = offs;
+    rsize = size;
+    return 1;
+}
+
+/**
+ * Wait for the queued read
+ */
+int disks_readwait(void *ctx, char **buffer)
+{
+    int size = rsize;
+
+    rsize = 0;
+    if(!rbuf || !size) { errno = EINVAL; return -1; }
+    *buffer = rbuf;
+    return disks_read(ctx, roffs, rbuf, size);
+}
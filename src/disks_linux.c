@@ -27,6 +27,7 @@
  *
  */
 
+#define _GNU_SOURCE     /* for pread, pwrite and syscall */
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -36,11 +37,31 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <time.h>
+#include <inttypes.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <linux/netlink.h>
+#include <pthread.h>
+#ifdef __NR_io_uring_setup
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#endif
 #include "lang.h"
 #include "main.h"
 #include "disks.h"
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12,119)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12,127)
+#endif
 
 #if USE_UDISKS2
 #include <udisks/udisks.h>
@@ -48,19 +69,29 @@
 extern char *main_errorMessage;
 #endif
 
-extern int fdatasync(int);
-int usleep(unsigned long int);
-
 /* disks_targets:
  * -1: invalid
  * 'a': device name in disks_devs[] (used to be "sd(target)")
  * 'T': special sdT "device", saves to test.bin
  * 1024+: serial devices
  */
-int disks_all = 0, disks_serial = 0, disks_maxsize = DISKS_MAXSIZE, disks_targets[DISKS_MAX];
+int disks_all = 0, disks_serial = 0, disks_maxsize = DISKS_MAXSIZE, disks_mode = DISKS_SYNC, disks_skipzero = 0, disks_readback = 0, disks_targets[DISKS_MAX];
 uint64_t disks_capacity[DISKS_MAX];
 char *serials[DISKS_MAX], *skip[DISKS_MAX], disks_devs[DISKS_MAX][32];
 int serialdrivers = 0;
+static char *disks_modes[] = { "sync", "direct", "window" };
+
+/**
+ * Open flags for the selected durability mode
+ */
+static int disks_flags(void)
+{
+    switch(disks_mode) {
+        case DISKS_DIRECT: return O_DIRECT;
+        case DISKS_WINDOW: return 0;
+        default: return O_SYNC;
+    }
+}
 
 /* helper to read a string from a file */
 void filegetcontent(char *fn, char *buf, int maxlen)
@@ -87,27 +118,102 @@ void filegetcontent(char *fn, char *buf, int maxlen)
     }
 }
 
+/* block devices from /sys/block with their attributes, once the hotplug listener is running, this
+ * table is kept up to date by the kernel's uevents instead of rescanning everything on every refresh */
+typedef struct {
+    char name[32], vendor[128], model[128];
+    uint64_t size;
+    int ro;
+} disks_dev_t;
+static disks_dev_t *devs = NULL;
+static int numDevs = 0, hotplugfd = -1, mountfd = -1, numSysdisks = 0;
+static char sysdisks[8][32];
+
 /**
- * Refresh target device list in the combobox
+ * Read a block device's attributes from sysfs
  */
-void disks_refreshlist(void)
+static void disks_devread(disks_dev_t *d)
+{
+    char path[512], tmp[32];
+
+    sprintf(path, "/sys/block/%s/ro", d->name);
+    filegetcontent(path, tmp, 2);
+    d->ro = tmp[0] != '0';
+    sprintf(path, "/sys/block/%s/size", d->name);
+    filegetcontent(path, tmp, sizeof(tmp));
+    d->size = (uint64_t)atoll(tmp) * 512UL;
+    sprintf(path, "/sys/block/%s/device/vendor", d->name);
+    filegetcontent(path, d->vendor, sizeof(d->vendor));
+    sprintf(path, "/sys/block/%s/device/model", d->name);
+    filegetcontent(path, d->model, sizeof(d->model));
+}
+
+/**
+ * Add a block device to the table, or re-read it if it's already there
+ */
+static void disks_devadd(const char *name)
+{
+    disks_dev_t *tmp;
+    int i;
+
+    if(strlen(name) > 31) return;
+    for(i = 0; i < numDevs && strcmp(devs[i].name, name); i++);
+    if(i == numDevs) {
+        if(!(tmp = (disks_dev_t*)realloc(devs, (numDevs + 1) * sizeof(disks_dev_t)))) return;
+        devs = tmp;
+        memset(&devs[numDevs], 0, sizeof(disks_dev_t));
+        strcpy(devs[numDevs++].name, name);
+    }
+    disks_devread(&devs[i]);
+}
+
+/**
+ * Remove a block device from the table
+ */
+static void disks_devdel(const char *name)
+{
+    int i;
+
+    for(i = 0; i < numDevs && strcmp(devs[i].name, name); i++);
+    if(i == numDevs) return;
+    memmove(&devs[i], &devs[i + 1], (numDevs - i - 1) * sizeof(disks_dev_t));
+    numDevs--;
+}
+
+/**
+ * Rebuild the table from /sys/block
+ */
+static void disks_devscan(void)
 {
     DIR *dir;
     struct dirent *de;
-    char str[1024], vendorName[128], productName[128], path[512], *skip[8];
-    uint64_t size;
-    int i = 0, j = 0, k, sizeInGbTimes10;
-    char *unit, *c, *p, *d;
+
+    numDevs = 0;
+    dir = opendir("/sys/block");
+    if(dir) {
+        while((de = readdir(dir)))
+            if(de->d_name[0] != '.') disks_devadd(de->d_name);
+        closedir(dir);
+    }
+}
+
+/**
+ * Get the list of system disks from the mount points, but only if the mounts have changed since
+ * the last time (the kernel flags /proc/self/mountinfo with POLLPRI when that happens)
+ */
+static void disks_sysdisks(void)
+{
+    struct pollfd pfd;
+    char str[1024], *c, *p, *d;
+    int k;
     FILE *f;
 
-    memset(disks_targets, 0xff, sizeof(disks_targets));
-    memset(disks_capacity, 0, sizeof(disks_capacity));
-#if DISKS_TEST
-    disks_targets[i++] = 'T';
-    main_addToCombobox("sdT ./test.bin");
-#endif
-    memset(disks_devs, 0, sizeof(disks_devs));
-    /* get list of system disks */
+    if(mountfd >= 0) {
+        pfd.fd = mountfd; pfd.events = POLLPRI; pfd.revents = 0;
+        if(poll(&pfd, 1, 0) < 1 || !(pfd.revents & (POLLPRI | POLLERR))) return;
+    } else
+        mountfd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+    numSysdisks = 0;
     f = fopen("/proc/self/mountinfo", "r");
     if(f) {
         if(verbose > 1)
@@ -129,14 +235,10 @@ void disks_refreshlist(void)
                         else
                             for(c = d + 5; *c && (*c < '0' || *c > '9'); c++);
                         *c = 0;
-                        skip[j] = malloc(c - d - 5 + 1);
-                        if(skip[j]) {
-                            memcpy(skip[j], d + 5, c - d - 5 + 1);
-                            if(verbose > 1)
-                                printf(" %s", skip[j]);
-                            j++;
-                            if(j >= 8) break;
-                        } else break;
+                        strncpy(sysdisks[numSysdisks], d + 5, 31);
+                        if(verbose > 1)
+                            printf(" %s", sysdisks[numSysdisks]);
+                        if(++numSysdisks >= 8) break;
                 }
             }
         }
@@ -146,74 +248,138 @@ void disks_refreshlist(void)
     } else
     if(verbose > 1)
         printf("unable to get mount points???\n");
+}
 
-    dir = opendir("/sys/block");
-    if(dir) {
-        while((de = readdir(dir))) {
-            if(de->d_name[0] == '.') continue;
-            if(verbose > 1) printf("%s: ", de->d_name);
-            if(!disks_all) {
-                /* by default without the `-a` flag, only list USB sticks and SD cards */
-                if((de->d_name[0] != 's' || de->d_name[1] != 'd') &&
-                    (de->d_name[0] != 'm' || de->d_name[1] != 'm')) {
-                        if(verbose > 1) printf("SKIP\n");
-                        continue;
-                }
-                for(k = 0; k < j && strcmp(de->d_name, skip[k]); k++);
-                if(k != j) {
-                    if(verbose > 1) printf("SKIP sysdisk\n");
-                    continue;
-                }
-                /* some mmc card driver do not set this... */
-                /* and some SATA to USB converters either, see issue #19. Better not to check at all */
-                /*
-                sprintf(path, "/sys/block/%s/removable", de->d_name);
-                filegetcontent(path, vendorName, 2);
-                if(vendorName[0] != '1') {
-                    if(verbose > 1) printf("SKIP non-removable\n");
-                    continue;
-                }
-                */
-                sprintf(path, "/sys/block/%s/ro", de->d_name);
-                filegetcontent(path, vendorName, 2);
-                if(vendorName[0] != '0') {
-                    if(verbose > 1) printf("SKIP read-only\n");
+/**
+ * Start listening to the kernel's hotplug events
+ */
+int disks_hotplugstart(void)
+{
+    struct sockaddr_nl nl;
+
+    if(hotplugfd >= 0) return hotplugfd;
+    hotplugfd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if(hotplugfd < 0) return -1;
+    memset(&nl, 0, sizeof(nl));
+    nl.nl_family = AF_NETLINK;
+    nl.nl_groups = 1;                   /* the kernel's own events, not udev's rebroadcast */
+    if(bind(hotplugfd, (struct sockaddr*)&nl, sizeof(nl))) {
+        close(hotplugfd);
+        hotplugfd = -1;
+        return -1;
+    }
+    /* from now on the events keep the table up to date */
+    disks_devscan();
+    if(verbose) printf("disks_hotplugstart() listening to uevents, %d block devices\r\n", numDevs);
+    return hotplugfd;
+}
+
+/**
+ * Process the pending hotplug events
+ */
+int disks_hotplug(void)
+{
+    struct sockaddr_nl nl;
+    socklen_t nllen;
+    char buf[8192], *s, *action, *subsys, *devtype, *devname;
+    int n, changed = 0;
+
+    if(hotplugfd < 0) return 0;
+    while(1) {
+        nllen = sizeof(nl);
+        if((n = recvfrom(hotplugfd, buf, sizeof(buf) - 1, 0, (struct sockaddr*)&nl, &nllen)) < 0) {
+            /* events were lost, so the table can't be trusted any more */
+            if(errno == ENOBUFS) { disks_devscan(); changed = 1; continue; }
+            break;
+        }
+        /* only believe the kernel */
+        if(nllen != sizeof(nl) || nl.nl_pid) continue;
+        buf[n] = 0;
+        action = subsys = devtype = devname = NULL;
+        /* "action@devpath" followed by KEY=value strings */
+        for(s = buf; s < buf + n; s += strlen(s) + 1) {
+            if(!memcmp(s, "ACTION=", 7)) action = s + 7; else
+            if(!memcmp(s, "SUBSYSTEM=", 10)) subsys = s + 10; else
+            if(!memcmp(s, "DEVTYPE=", 8)) devtype = s + 8; else
+            if(!memcmp(s, "DEVNAME=", 8)) devname = s + 8;
+        }
+        if(!action || !subsys || !devtype || !devname || strcmp(subsys, "block") || strcmp(devtype, "disk")) continue;
+        if(!memcmp(devname, "/dev/", 5)) devname += 5;
+        if(verbose) printf("disks_hotplug() %s %s\r\n", action, devname);
+        /* change is sent when a card is put into a reader, for example */
+        if(!strcmp(action, "add") || !strcmp(action, "change")) { disks_devadd(devname); changed = 1; } else
+        if(!strcmp(action, "remove")) { disks_devdel(devname); changed = 1; }
+    }
+    return changed;
+}
+
+/**
+ * Refresh target device list in the combobox
+ */
+void disks_refreshlist(void)
+{
+    DIR *dir;
+    struct dirent *de;
+    char str[1024];
+    uint64_t size;
+    int i = 0, k, l, sizeInGbTimes10;
+    char *unit, *c, *p;
+    disks_dev_t *d;
+    FILE *f;
+
+    memset(disks_targets, 0xff, sizeof(disks_targets));
+    memset(disks_capacity, 0, sizeof(disks_capacity));
+#if DISKS_TEST
+    disks_targets[i++] = 'T';
+    main_addToCombobox("sdT ./test.bin");
+#endif
+    memset(disks_devs, 0, sizeof(disks_devs));
+    disks_sysdisks();
+    /* without hotplug events, the only way to know what's there is to look */
+    if(hotplugfd < 0) disks_devscan();
+    for(l = 0; l < numDevs && i < DISKS_MAX; l++) {
+        d = &devs[l];
+        if(verbose > 1) printf("%s: ", d->name);
+        if(!disks_all) {
+            /* by default without the `-a` flag, only list USB sticks and SD cards */
+            if((d->name[0] != 's' || d->name[1] != 'd') &&
+                (d->name[0] != 'm' || d->name[1] != 'm')) {
+                    if(verbose > 1) printf("SKIP\n");
                     continue;
-                }
             }
-            size = 0;
-            sprintf(path, "/sys/block/%s/size", de->d_name);
-            filegetcontent(path, vendorName, sizeof(vendorName));
-            size = (uint64_t)atoll(vendorName) * 512UL;
-            if(!disks_all && disks_maxsize > 0 && size/1024L > (uint64_t)disks_maxsize*1024L*1024L) {
-                if(verbose > 1) printf("SKIP too big\n");
+            for(k = 0; k < numSysdisks && strcmp(d->name, sysdisks[k]); k++);
+            if(k != numSysdisks) {
+                if(verbose > 1) printf("SKIP sysdisk\n");
+                continue;
+            }
+            /* some mmc card driver do not set removable... */
+            /* and some SATA to USB converters either, see issue #19. Better not to check at all */
+            if(d->ro) {
+                if(verbose > 1) printf("SKIP read-only\n");
                 continue;
             }
-            if(verbose > 1) printf("OK size %s", vendorName);
-            memset(vendorName, 0, sizeof(vendorName));
-            sprintf(path, "/sys/block/%s/device/vendor", de->d_name);
-            filegetcontent(path, vendorName, sizeof(vendorName));
-            sprintf(path, "/sys/block/%s/device/model", de->d_name);
-            filegetcontent(path, productName, sizeof(productName));
-            str[0] = 0;
-            if(size) {
-                sizeInGbTimes10 = (int)((uint64_t)(10 * size) >> 30L);
-                if(sizeInGbTimes10 < 10) { unit = lang[L_MIB]; sizeInGbTimes10 = (int)((uint64_t)(10 * (size + 1024L*1024L-1L)) >> 20L); }
-                else unit = lang[L_GIB];
-                snprintf(str, sizeof(str)-1, "%s [%d.%d %s] %s %s", de->d_name,
-                    sizeInGbTimes10 / 10, sizeInGbTimes10 % 10, unit, vendorName, productName);
-            } else
-                snprintf(str, sizeof(str)-1, "%s %s %s", de->d_name, vendorName, productName);
-            str[128] = 0;
-            disks_capacity[i] = size;
-            memcpy(disks_devs[i], de->d_name, 31);
-            disks_targets[i++] = 'a';
-            main_addToCombobox(str);
-            if(i >= DISKS_MAX) break;
         }
-        closedir(dir);
+        size = d->size;
+        if(!disks_all && disks_maxsize > 0 && size/1024L > (uint64_t)disks_maxsize*1024L*1024L) {
+            if(verbose > 1) printf("SKIP too big\n");
+            continue;
+        }
+        if(verbose > 1) printf("OK size %" PRIu64 "\n", size / 512);
+        str[0] = 0;
+        if(size) {
+            sizeInGbTimes10 = (int)((uint64_t)(10 * size) >> 30L);
+            if(sizeInGbTimes10 < 10) { unit = lang[L_MIB]; sizeInGbTimes10 = (int)((uint64_t)(10 * (size + 1024L*1024L-1L)) >> 20L); }
+            else unit = lang[L_GIB];
+            snprintf(str, sizeof(str)-1, "%s [%d.%d %s] %s %s", d->name,
+                sizeInGbTimes10 / 10, sizeInGbTimes10 % 10, unit, d->vendor, d->model);
+        } else
+            snprintf(str, sizeof(str)-1, "%s %s %s", d->name, d->vendor, d->model);
+        str[128] = 0;
+        disks_capacity[i] = size;
+        memcpy(disks_devs[i], d->name, 31);
+        disks_targets[i++] = 'a';
+        main_addToCombobox(str);
     }
-    for(k = 0; k < j; k++) free(skip[k]);
     if(disks_serial) {
         if(!serialdrivers) {
             f = fopen("/proc/tty/drivers", "r");
@@ -466,7 +632,13 @@ sererr:         main_getErrorMessage();
         sprintf(deviceName, "./test.bin");
         unlink(deviceName);
         errno = 0;
-        ret = open(deviceName, O_RDWR | O_EXCL | O_CREAT, 0644);
+        ret = open(deviceName, O_RDWR | O_EXCL | O_CREAT | disks_flags(), 0644);
+        /* not all file systems support direct I/O (tmpfs for example) */
+        if(ret < 0 && errno == EINVAL && disks_mode == DISKS_DIRECT) {
+            if(verbose) printf("  no direct I/O, falling back to sync\r\n");
+            errno = 0;
+            ret = open(deviceName, O_RDWR | O_EXCL | O_CREAT | O_SYNC, 0644);
+        }
         if(verbose)
             printf("disks_open(%s)\r\n  fd=%d errno=%d err=%s\r\n",
                 deviceName, ret, errno, strerror(errno));
@@ -554,7 +726,7 @@ sererr:         main_getErrorMessage();
     }
 
     errno = 0;
-    ret = open(deviceName, O_RDWR | O_SYNC | O_EXCL);
+    ret = open(deviceName, O_RDWR | O_EXCL | disks_flags());
     if(verbose) printf("  fd=%d errno=%d err=%s\r\n", ret, errno, strerror(errno));
     if(ret < 0 || errno) {
 #if USE_UDISKS2
@@ -568,7 +740,7 @@ sererr:         main_getErrorMessage();
             }
             error = NULL; main_errorMessage = NULL;
             g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
-            g_variant_builder_add(&builder, "{sv}", "flags", g_variant_new_int32(O_SYNC | O_EXCL));
+            g_variant_builder_add(&builder, "{sv}", "flags", g_variant_new_int32(O_EXCL | disks_flags()));
             options = g_variant_builder_end(&builder);
             g_variant_ref_sink(options);
             fdlist = g_unix_fd_list_new();
@@ -595,13 +767,697 @@ sererr:         main_getErrorMessage();
     return (void*)((long int)ret);
 }
 
+/* write engine, keeps several writes in flight at explicit offsets with io_uring, or writes
+ * synchronously with pwrite if that's not available (or there's only memory for one buffer).
+ * In window mode finished writes are still in the page cache, they are only counted as done
+ * once sync_file_range confirms them. After the last write, the same slots are used to read
+ * the disk back through a second, O_DIRECT descriptor (rfd), in order from rhead to rtail */
+typedef struct {
+    int fd, num, seq, ring, err, nocopy, nozero, mode, pipe[2];
+    char *buf[DISKS_QUEUE];
+    struct iovec iov[DISKS_QUEUE];
+    uint64_t offs[DISKS_QUEUE];
+    int busy[DISKS_QUEUE];
+    uint64_t pending, dirty, dlo, dhi, total;
+    uint64_t wzmax, dgran;              /* from sysfs, how the device can zero out blocks */
+    int zinfo, dzd;
+    int rfd, rhead, rtail, rheld;       /* read-back, rheld is set while the caller has the slot at rhead */
+    int rerr[DISKS_QUEUE];
+    char *rbuf;                         /* the only read-back slot without io_uring */
+    struct timespec start;
+#ifdef __NR_io_uring_setup
+    unsigned int *sqhead, *sqtail, *sqmask, *sqarray, *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqptr, *cqptr;
+    size_t sqlen, cqlen, sqeslen;
+#endif
+} disks_engine_t;
+static disks_engine_t *engines[DISKS_MAX];
+/* the duplicator writes several targets at once, each from its own thread */
+static pthread_mutex_t engines_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Direct I/O needs the buffer, offset and size to be aligned. If they aren't, turn O_DIRECT off
+ * for this one transfer, returns the original flags or -1 if nothing changed
+ */
+static int disks_unaligned(int fd, uint64_t offs, char *buffer, int size)
+{
+    int fl;
+
+    if(disks_mode != DISKS_DIRECT || !((offs | (uint64_t)size | (uint64_t)(uintptr_t)buffer) & (DISKS_ALIGN - 1)))
+        return -1;
+    fl = fcntl(fd, F_GETFL);
+    if(fl == -1 || !(fl & O_DIRECT) || fcntl(fd, F_SETFL, fl & ~O_DIRECT) == -1) return -1;
+    return fl;
+}
+
+/**
+ * Wait until everything in the window is written out to the device
+ */
+static int disks_settle(disks_engine_t *e)
+{
+    if(e->dirty) {
+        if(sync_file_range(e->fd, e->dlo, e->dhi - e->dlo, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+            SYNC_FILE_RANGE_WAIT_AFTER) && !e->err) e->err = errno;
+        e->pending -= e->dirty;
+        e->dirty = 0;
+    }
+    return e->err;
+}
+
+/**
+ * Account for a finished write. In window mode start writing it out, and if there's too much
+ * data waiting in the page cache, wait for the device to catch up
+ */
+static void disks_done(disks_engine_t *e, uint64_t offs, uint64_t len)
+{
+    e->total += len;
+    if(e->mode != DISKS_WINDOW) {
+        e->pending -= len;
+        return;
+    }
+    sync_file_range(e->fd, offs, len, SYNC_FILE_RANGE_WRITE);
+    if(!e->dirty || offs < e->dlo) e->dlo = offs;
+    if(!e->dirty || offs + len > e->dhi) e->dhi = offs + len;
+    e->dirty += len;
+    if(e->dirty >= DISKS_WINDOWMEM) disks_settle(e);
+}
+
+#ifdef __NR_io_uring_setup
+/**
+ * Set up an io_uring with room for a write and a cancel request per slot
+ */
+static int disks_uringinit(disks_engine_t *e)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    e->ring = (int)syscall(__NR_io_uring_setup, 2 * DISKS_QUEUE, &p);
+    if(e->ring < 0) {
+        if(verbose) printf("  io_uring_setup errno=%d err=%s\r\n", errno, strerror(errno));
+        return e->ring = 0;
+    }
+    e->sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    e->cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(e->cqlen > e->sqlen) e->sqlen = e->cqlen;
+        e->cqlen = 0;
+    }
+    e->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+    e->sqptr = mmap(NULL, e->sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, e->ring, IORING_OFF_SQ_RING);
+    e->cqptr = e->cqlen ? mmap(NULL, e->cqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, e->ring,
+        IORING_OFF_CQ_RING) : e->sqptr;
+    e->sqes = (struct io_uring_sqe*)mmap(NULL, e->sqeslen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, e->ring,
+        IORING_OFF_SQES);
+    if(e->sqptr == MAP_FAILED || e->cqptr == MAP_FAILED || e->sqes == MAP_FAILED) {
+        if(e->sqes != MAP_FAILED) munmap(e->sqes, e->sqeslen);
+        if(e->cqlen && e->cqptr != MAP_FAILED) munmap(e->cqptr, e->cqlen);
+        if(e->sqptr != MAP_FAILED) munmap(e->sqptr, e->sqlen);
+        close(e->ring);
+        return e->ring = 0;
+    }
+    e->sqhead = (unsigned int*)((char*)e->sqptr + p.sq_off.head);
+    e->sqtail = (unsigned int*)((char*)e->sqptr + p.sq_off.tail);
+    e->sqmask = (unsigned int*)((char*)e->sqptr + p.sq_off.ring_mask);
+    e->sqarray = (unsigned int*)((char*)e->sqptr + p.sq_off.array);
+    e->cqhead = (unsigned int*)((char*)e->cqptr + p.cq_off.head);
+    e->cqtail = (unsigned int*)((char*)e->cqptr + p.cq_off.tail);
+    e->cqmask = (unsigned int*)((char*)e->cqptr + p.cq_off.ring_mask);
+    e->cqes = (struct io_uring_cqe*)((char*)e->cqptr + p.cq_off.cqes);
+    return 1;
+}
+
+/**
+ * Free the io_uring
+ */
+static void disks_uringfree(disks_engine_t *e)
+{
+    munmap(e->sqes, e->sqeslen);
+    if(e->cqlen) munmap(e->cqptr, e->cqlen);
+    munmap(e->sqptr, e->sqlen);
+    close(e->ring);
+    e->ring = 0;
+}
+
+/**
+ * Queue a request. For reads and writes, data is the slot, for cancels it is the slot to be cancelled
+ */
+static int disks_uringsubmit(disks_engine_t *e, int op, int slot)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail, idx;
+
+    tail = *e->sqtail;
+    idx = tail & *e->sqmask;
+    sqe = &e->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = op;
+    sqe->fd = op == IORING_OP_READV ? e->rfd : e->fd;
+    if(op != IORING_OP_ASYNC_CANCEL) {
+        sqe->addr = (uint64_t)(uintptr_t)&e->iov[slot];
+        sqe->len = 1;
+        sqe->off = e->offs[slot];
+        sqe->user_data = slot;
+    } else {
+        sqe->addr = slot;
+        sqe->user_data = DISKS_QUEUE + slot;
+    }
+    e->sqarray[idx] = idx;
+    __atomic_store_n(e->sqtail, tail + 1, __ATOMIC_RELEASE);
+    while(syscall(__NR_io_uring_enter, e->ring, 1, 0, 0, NULL, 0) < 0)
+        if(errno != EINTR && errno != EAGAIN) return -1;
+    return 0;
+}
+
+/**
+ * Process completions, if wait is set, block until at least one request finishes
+ */
+static int disks_uringreap(disks_engine_t *e, int wait)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+    int slot, res, got = 0;
+
+    while(1) {
+        head = *e->cqhead;
+        if(head == __atomic_load_n(e->cqtail, __ATOMIC_ACQUIRE)) {
+            if(!wait || got) return 0;
+            if(syscall(__NR_io_uring_enter, e->ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                errno != EINTR && errno != EAGAIN) return -1;
+            continue;
+        }
+        cqe = &e->cqes[head & *e->cqmask];
+        slot = (int)cqe->user_data;
+        res = cqe->res;
+        __atomic_store_n(e->cqhead, head + 1, __ATOMIC_RELEASE);
+        if(slot >= DISKS_QUEUE || !e->busy[slot]) continue;
+        if(e->rfd) {
+            if(res > 0 && (size_t)res < e->iov[slot].iov_len) {
+                /* partial read, queue the rest */
+                e->offs[slot] += res;
+                e->iov[slot].iov_base = (char*)e->iov[slot].iov_base + res;
+                e->iov[slot].iov_len -= res;
+                if(!disks_uringsubmit(e, IORING_OP_READV, slot)) continue;
+                res = -errno;
+            }
+            e->rerr[slot] = res > 0 ? 0 : (res ? -res : EIO);
+            if(e->rerr[slot] && verbose > 1) printf("  io_uring read at %" PRIu64 " errno=%d\r\n", e->offs[slot], e->rerr[slot]);
+            e->busy[slot] = 0;
+            got = 1;
+            continue;
+        }
+        if(res > 0 && (size_t)res < e->iov[slot].iov_len) {
+            /* partial write, queue the rest */
+            disks_done(e, e->offs[slot], res);
+            e->offs[slot] += res;
+            e->iov[slot].iov_base = (char*)e->iov[slot].iov_base + res;
+            e->iov[slot].iov_len -= res;
+            if(!disks_uringsubmit(e, IORING_OP_WRITEV, slot)) continue;
+            res = -errno;
+        }
+        if(res <= 0) {
+            if(!e->err) e->err = res ? -res : EIO;
+            if(verbose > 1) printf("  io_uring write at %" PRIu64 " errno=%d\r\n", e->offs[slot], e->err);
+            e->pending -= e->iov[slot].iov_len;
+        } else
+            disks_done(e, e->offs[slot], e->iov[slot].iov_len);
+        e->busy[slot] = 0;
+        got = 1;
+    }
+}
+#endif
+
+/**
+ * Get the engine for a file descriptor, create it if it doesn't exist yet
+ */
+static disks_engine_t *disks_engine(int fd, int create)
+{
+    disks_engine_t *e;
+    struct stat st;
+    int i, j;
+
+    pthread_mutex_lock(&engines_mutex);
+    for(i = 0; i < DISKS_MAX && (!engines[i] || engines[i]->fd != fd); i++);
+    if(i < DISKS_MAX || !create) {
+        e = i < DISKS_MAX ? engines[i] : NULL;
+        pthread_mutex_unlock(&engines_mutex);
+        return e;
+    }
+    for(i = 0; i < DISKS_MAX && engines[i]; i++);
+    if(i >= DISKS_MAX || !(e = (disks_engine_t*)malloc(sizeof(disks_engine_t)))) {
+        pthread_mutex_unlock(&engines_mutex);
+        return NULL;
+    }
+    memset(e, 0, sizeof(disks_engine_t));
+    e->fd = fd;
+    e->pipe[0] = e->pipe[1] = -1;
+    clock_gettime(CLOCK_MONOTONIC, &e->start);
+    /* serial lines have no offsets */
+    e->seq = !fstat(fd, &st) && S_ISCHR(st.st_mode);
+    /* the mode in effect on this descriptor, disks_open might not have got direct I/O */
+    e->mode = e->seq ? DISKS_SYNC : disks_mode;
+    if(e->mode == DISKS_DIRECT && !(fcntl(fd, F_GETFL) & O_DIRECT)) e->mode = DISKS_SYNC;
+    e->num = DISKS_QUEUEMEM / buffer_size;
+    if(e->num > DISKS_QUEUE) e->num = DISKS_QUEUE;
+#ifdef __NR_io_uring_setup
+    if(!e->seq && e->num > 1 && disks_uringinit(e)) {
+        for(j = 0; j < e->num && !posix_memalign((void**)&e->buf[j], DISKS_ALIGN, buffer_size); j++);
+        if(j < 2) {
+            while(j--) free(e->buf[j]);
+            disks_uringfree(e);
+        }
+        e->num = j;
+    }
+#else
+    (void)j;
+#endif
+    if(!e->ring) e->num = 0;
+    if(verbose) printf("disks_write(%d) %s queue depth %d, %s mode\r\n", fd, e->ring ? "io_uring" :
+        (e->seq ? "serial" : "pwrite"), e->ring ? e->num : 1, disks_modes[e->mode]);
+    engines[i] = e;
+    pthread_mutex_unlock(&engines_mutex);
+    return e;
+}
+
+/**
+ * Read from the target disk at the given offset
+ */
+int disks_read(void *ctx, uint64_t offs, char *buffer, int size)
+{
+    int fd = (int)((long int)ctx), i, fl, ret = 0;
+    disks_engine_t *e = disks_engine(fd, 0);
+    ssize_t r = 0;
+
+    if(e) {
+        if(e->seq) return (int)read(fd, buffer, size);
+        for(i = 0; i < e->num; i++)
+            if(e->busy[i] && e->offs[i] < offs + size && offs < e->offs[i] + e->iov[i].iov_len) {
+                if(disks_flush(ctx)) return -1;
+                break;
+            }
+    }
+    fl = disks_unaligned(fd, offs, buffer, size);
+    while(ret < size) {
+        r = pread(fd, buffer + ret, size - ret, offs + ret);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) break;
+        ret += (int)r;
+    }
+    if(fl != -1) fcntl(fd, F_SETFL, fl);
+    return ret ? ret : (int)r;
+}
+
+/**
+ * Queue writing to the target disk at the given offset
+ */
+int disks_write(void *ctx, uint64_t offs, char *buffer, int size)
+{
+    int fd = (int)((long int)ctx), i, fl, ret = 0;
+    disks_engine_t *e = disks_engine(fd, 1);
+    ssize_t r;
+
+    if(!e) return -1;
+    if(e->err) { errno = e->err; return -1; }
+#ifdef __NR_io_uring_setup
+    if(e->ring && (e->mode != DISKS_DIRECT || !((offs | (uint64_t)size) & (DISKS_ALIGN - 1)))) {
+        /* get a free slot, waiting for a write to finish if there's none */
+        while(1) {
+            for(i = 0; i < e->num && e->busy[i]; i++);
+            if(i < e->num) break;
+            if(disks_uringreap(e, 1) && !e->err) e->err = errno;
+            if(e->err) { errno = e->err; return -1; }
+        }
+        memcpy(e->buf[i], buffer, size);
+        e->iov[i].iov_base = e->buf[i];
+        e->iov[i].iov_len = size;
+        e->offs[i] = offs;
+        e->busy[i] = 1;
+        e->pending += size;
+        if(disks_uringsubmit(e, IORING_OP_WRITEV, i)) {
+            e->busy[i] = 0;
+            e->pending -= size;
+            e->err = errno;
+            return -1;
+        }
+        disks_uringreap(e, 0);
+        return size;
+    }
+    /* unaligned tail in direct mode, let the queue drain before changing the flags */
+    if(e->ring && disks_flush(ctx)) return -1;
+#endif
+    fl = disks_unaligned(fd, offs, buffer, size);
+    e->pending += size;
+    while(ret < size) {
+        r = e->seq ? write(fd, buffer + ret, size - ret) : pwrite(fd, buffer + ret, size - ret, offs + ret);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) { if(!e->err) e->err = r ? errno : EIO; break; }
+        ret += (int)r;
+    }
+    if(fl != -1) {
+        /* this went through the page cache, get it on the device like the rest */
+        if(ret && sync_file_range(fd, offs, ret, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+            SYNC_FILE_RANGE_WAIT_AFTER) && !e->err) e->err = errno;
+        fcntl(fd, F_SETFL, fl);
+    }
+    e->pending -= size - ret;
+    if(ret) disks_done(e, offs, ret);
+    if(e->err) { errno = e->err; return -1; }
+    return ret;
+}
+
+/**
+ * Copy straight from a file to the target disk, without the data passing through user space.
+ * Uses copy_file_range, or splice through a pipe if the kernel can't copy between these two
+ */
+int disks_copy(void *ctx, uint64_t offs, int src, uint64_t srcoffs, int size)
+{
+    int fd = (int)((long int)ctx), ret = 0;
+    disks_engine_t *e = disks_engine(fd, 1);
+    loff_t in, out;
+    ssize_t r = -1, w;
+
+    if(!e || e->seq || e->nocopy) return 0;
+    if(e->err) { errno = e->err; return -1; }
+    if(e->mode == DISKS_DIRECT && ((offs | srcoffs | (uint64_t)size) & (DISKS_ALIGN - 1))) return 0;
+    /* keep the order of writes, let the queue drain first */
+#ifdef __NR_io_uring_setup
+    if(e->ring && disks_flush(ctx)) return -1;
+#endif
+    e->pending += size;
+#ifdef __NR_copy_file_range
+    while(ret < size) {
+        in = (loff_t)(srcoffs + ret); out = (loff_t)(offs + ret);
+        r = syscall(__NR_copy_file_range, src, &in, fd, &out, (size_t)(size - ret), 0);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) break;
+        ret += (int)r;
+    }
+    if(r < 0 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF))
+#endif
+    {
+        /* file -> pipe -> disk, one pipe full at a time */
+        if(e->pipe[0] == -1 && !pipe(e->pipe)) {
+#ifdef F_SETPIPE_SZ
+            fcntl(e->pipe[1], F_SETPIPE_SZ, buffer_size);
+#endif
+        }
+        r = e->pipe[0] == -1 ? -1 : 0;
+        while(r >= 0 && ret < size) {
+            in = (loff_t)(srcoffs + ret);
+            r = splice(src, &in, e->pipe[1], NULL, size - ret, SPLICE_F_MOVE);
+            if(r < 0 && errno == EINTR) { r = 0; continue; }
+            if(r <= 0) break;
+            out = (loff_t)(offs + ret);
+            while(r > 0) {
+                w = splice(e->pipe[0], NULL, fd, &out, r, SPLICE_F_MOVE);
+                if(w < 0 && errno == EINTR) continue;
+                if(w <= 0) { r = -1; break; }
+                r -= w; ret += (int)w;
+            }
+        }
+        if(!ret && r < 0) {
+            /* neither works here, the caller has to read and write the data */
+            if(verbose) printf("disks_copy(%d) not supported: %s\r\n", fd, strerror(errno));
+            e->nocopy = 1;
+            e->pending -= size;
+            return 0;
+        }
+    }
+    if(ret < size && !e->err) e->err = r ? errno : EIO;
+    if(ret && (e->mode != DISKS_WINDOW) && sync_file_range(fd, offs, ret, SYNC_FILE_RANGE_WAIT_BEFORE |
+        SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) && !e->err) e->err = errno;
+    e->pending -= size - ret;
+    if(ret) disks_done(e, offs, ret);
+    if(e->err) { errno = e->err; return -1; }
+    return ret;
+}
+
+/**
+ * Find out from sysfs if the device can zero out blocks by itself, or if discarded blocks read back as zeros
+ */
+static void disks_zeroinfo(disks_engine_t *e, struct stat *st)
+{
+    char path[128], tmp[32];
+
+    e->zinfo = 1;
+    sprintf(path, "/sys/dev/block/%u:%u/queue/write_zeroes_max_bytes", major(st->st_rdev), minor(st->st_rdev));
+    filegetcontent(path, tmp, sizeof(tmp));
+    e->wzmax = (uint64_t)atoll(tmp);
+    sprintf(path, "/sys/dev/block/%u:%u/queue/discard_zeroes_data", major(st->st_rdev), minor(st->st_rdev));
+    filegetcontent(path, tmp, sizeof(tmp));
+    e->dzd = atoi(tmp);
+    sprintf(path, "/sys/dev/block/%u:%u/queue/discard_granularity", major(st->st_rdev), minor(st->st_rdev));
+    filegetcontent(path, tmp, sizeof(tmp));
+    e->dgran = (uint64_t)atoll(tmp);
+    if(verbose) printf("disks_zero(%d) write_zeroes_max_bytes %" PRIu64 " discard_zeroes_data %d discard_granularity %"
+        PRIu64 "\r\n", e->fd, e->wzmax, e->dzd, e->dgran);
+}
+
+/**
+ * Zero out a range on the target disk without sending the zeros. Block devices that can write zeroes get
+ * BLKZEROOUT, ones that read back discarded blocks as zeros get BLKDISCARD, and for the rest the caller
+ * has to write the zeros (the kernel would do just that too). In image files the file system allocates
+ * zeroed blocks
+ */
+int disks_zero(void *ctx, uint64_t offs, uint64_t size)
+{
+    int fd = (int)((long int)ctx), r = -1;
+    disks_engine_t *e = disks_engine(fd, 1);
+    uint64_t range[2];
+    struct stat st;
+
+    if(!e || e->seq || !size) return 0;
+    if(e->err) { errno = e->err; return -1; }
+    if(disks_skipzero) return 1;
+    if(e->nozero || fstat(fd, &st)) return 0;
+    if(S_ISBLK(st.st_mode)) {
+        if(!e->zinfo) disks_zeroinfo(e, &st);
+        if((offs | size) & 511) return 0;
+        range[0] = offs; range[1] = size;
+        if(e->wzmax)
+            r = ioctl(fd, BLKZEROOUT, &range);
+        else
+        /* only kernels before 4.12 may report discard_zeroes_data, since then it's always 0, so on those the
+         * zeros are written unless -z says the disk is zeroed already */
+        if(e->dzd && e->dgran && !(offs % e->dgran) && !(size % e->dgran))
+            r = ioctl(fd, BLKDISCARD, &range);
+        else
+            return 0;
+    } else
+    if(S_ISREG(st.st_mode))
+        r = fallocate(fd, FALLOC_FL_ZERO_RANGE, (off_t)offs, (off_t)size);
+    else
+        errno = EOPNOTSUPP;
+    if(r) {
+        if(errno == EOPNOTSUPP || errno == ENOTTY || errno == EINVAL || errno == ENOSYS) {
+            if(verbose) printf("disks_zero(%d) not supported: %s\r\n", fd, strerror(errno));
+            e->nozero = 1;
+            return 0;
+        }
+        e->err = errno;
+        return -1;
+    }
+    e->total += size;
+    return 1;
+}
+
+/**
+ * Wait for all queued writes to finish
+ */
+int disks_flush(void *ctx)
+{
+    disks_engine_t *e = disks_engine((int)((long int)ctx), 0);
+#ifdef __NR_io_uring_setup
+    int i;
+
+    if(e && e->ring)
+        while(!e->err) {
+            for(i = 0; i < e->num && !e->busy[i]; i++);
+            if(i >= e->num) break;
+            if(disks_uringreap(e, 1)) e->err = errno;
+        }
+#endif
+    if(e && disks_settle(e)) { errno = e->err; return -1; }
+    return 0;
+}
+
+/**
+ * Return the number of bytes queued but not yet confirmed by the target disk
+ */
+uint64_t disks_pending(void *ctx)
+{
+    disks_engine_t *e = disks_engine((int)((long int)ctx), 0);
+#ifdef __NR_io_uring_setup
+    if(e && e->ring) disks_uringreap(e, 0);
+#endif
+    return e ? e->pending : 0;
+}
+
+/**
+ * Start reading back. Make sure everything is on the device, and open it once more with O_DIRECT
+ * so that the data comes from the device and not from the page cache. If that's not possible (no
+ * permission to open the device node or no direct I/O on the file system), read through the
+ * original descriptor with the cached pages dropped
+ */
+static int disks_readopen(disks_engine_t *e)
+{
+    char path[32];
+
+    if(fdatasync(e->fd) && errno != EINVAL) return -1;
+    posix_fadvise(e->fd, 0, 0, POSIX_FADV_DONTNEED);
+    sprintf(path, "/proc/self/fd/%d", e->fd);
+    e->rfd = open(path, O_RDONLY | O_DIRECT);
+    if(e->rfd < 0) e->rfd = e->fd;
+    if(!e->ring && !e->rbuf && posix_memalign((void**)&e->rbuf, DISKS_ALIGN, buffer_size)) {
+        e->rbuf = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+    if(verbose) printf("disks_readq(%d) reading back through fd %d, %s\r\n", e->fd, e->rfd,
+        e->ring ? "io_uring" : "pread");
+    return 0;
+}
+
+/**
+ * Read a slot synchronously. Direct I/O needs alignment, unaligned reads go through the original
+ * descriptor (whose cached pages were dropped), just like unaligned writes
+ */
+static void disks_readsync(disks_engine_t *e, int slot)
+{
+    char *buf = (char*)e->iov[slot].iov_base;
+    int fd = e->rfd, fl = -1, size = (int)e->iov[slot].iov_len, ret = 0;
+    ssize_t r = 0;
+
+    if((e->offs[slot] | (uint64_t)size) & (DISKS_ALIGN - 1)) {
+        fd = e->fd;
+        fl = disks_unaligned(fd, e->offs[slot], buf, size);
+    }
+    while(ret < size) {
+        r = pread(fd, buf + ret, size - ret, e->offs[slot] + ret);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) break;
+        ret += (int)r;
+    }
+    if(fl != -1) fcntl(fd, F_SETFL, fl);
+    e->rerr[slot] = ret == size ? 0 : (r < 0 ? errno : EIO);
+}
+
+/**
+ * Queue reading back from the target disk at the given offset
+ */
+int disks_readq(void *ctx, uint64_t offs, int size)
+{
+    int fd = (int)((long int)ctx), slot, depth;
+    disks_engine_t *e = disks_engine(fd, 1);
+
+    if(!e) return -1;
+    if(e->seq || size < 1 || size > buffer_size) { errno = EINVAL; return -1; }
+    if(!e->rfd && disks_readopen(e)) return -1;
+    if(e->rheld) { e->rhead++; e->rheld = 0; }
+    depth = e->ring ? e->num : 1;
+    if(e->rtail - e->rhead >= depth) return 0;
+    slot = e->rtail % depth;
+    e->offs[slot] = offs;
+    e->iov[slot].iov_base = e->ring ? e->buf[slot] : e->rbuf;
+    e->iov[slot].iov_len = size;
+#ifdef __NR_io_uring_setup
+    if(e->ring) {
+        if(!((offs | (uint64_t)size) & (DISKS_ALIGN - 1))) {
+            e->busy[slot] = 1;
+            if(disks_uringsubmit(e, IORING_OP_READV, slot)) { e->busy[slot] = 0; return -1; }
+            e->rtail++;
+            return 1;
+        }
+        /* unaligned, that must wait until nothing else is in flight */
+        if(e->rtail != e->rhead) return 0;
+    }
+#endif
+    disks_readsync(e, slot);
+    e->rtail++;
+    return 1;
+}
+
+/**
+ * Wait for the oldest queued read
+ */
+int disks_readwait(void *ctx, char **buffer)
+{
+    disks_engine_t *e = disks_engine((int)((long int)ctx), 0);
+    int slot;
+
+    if(!e || !e->rfd) { errno = EINVAL; return -1; }
+    if(e->rheld) { e->rhead++; e->rheld = 0; }
+    if(e->rhead == e->rtail) { errno = EINVAL; return -1; }
+    slot = e->rhead % (e->ring ? e->num : 1);
+#ifdef __NR_io_uring_setup
+    while(e->busy[slot])
+        if(disks_uringreap(e, 1)) return -1;
+#endif
+    e->rheld = 1;
+    if(e->rerr[slot]) { errno = e->rerr[slot]; return -1; }
+    *buffer = e->ring ? e->buf[slot] : e->rbuf;
+    return (int)((char*)e->iov[slot].iov_base + e->iov[slot].iov_len - *buffer);
+}
+
+/**
+ * Cancel whatever is still in flight and free the engine
+ */
+static void disks_enginefree(int fd)
+{
+    disks_engine_t *e;
+    int i;
+
+    pthread_mutex_lock(&engines_mutex);
+    for(i = 0; i < DISKS_MAX && (!engines[i] || engines[i]->fd != fd); i++);
+    if(i >= DISKS_MAX) { pthread_mutex_unlock(&engines_mutex); return; }
+    e = engines[i];
+    engines[i] = NULL;
+    pthread_mutex_unlock(&engines_mutex);
+#ifdef __NR_io_uring_setup
+    if(e->ring) {
+        if(e->pending && verbose) printf("disks_close(%d) cancelling %" PRIu64 " bytes\r\n", fd, e->pending);
+        for(i = 0; i < e->num; i++)
+            if(e->busy[i]) disks_uringsubmit(e, IORING_OP_ASYNC_CANCEL, i);
+        while(1) {
+            for(i = 0; i < e->num && !e->busy[i]; i++);
+            if(i >= e->num || disks_uringreap(e, 1)) break;
+        }
+        disks_uringfree(e);
+    }
+#endif
+    for(i = 0; i < e->num; i++)
+        if(e->buf[i]) free(e->buf[i]);
+    if(e->rbuf) free(e->rbuf);
+    if(e->rfd > 0 && e->rfd != e->fd) close(e->rfd);
+    if(e->pipe[0] != -1) { close(e->pipe[0]); close(e->pipe[1]); }
+    free(e);
+}
+
 /**
  * Close the target disk
  */
 void disks_close(void *data)
 {
     int fd = (int)((long int)data);
+    disks_engine_t *e = disks_engine(fd, 0);
+    struct timespec start, end;
+    uint64_t total = 0, msec;
+    int mode = disks_mode;
+
+    if(e) { total = e->total; start = e->start; mode = e->mode; }
+    disks_enginefree(fd);
     fdatasync(fd);
     close(fd);
-    if(verbose) printf("disks_close(%d)\r\n", fd);
+    if(verbose) {
+        printf("disks_close(%d)\r\n", fd);
+        /* time spent from the first write until everything is on the device, to compare modes */
+        if(total) {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            msec = (uint64_t)(end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+            if(!msec) msec = 1;
+            printf("  %s mode wrote %" PRIu64 " bytes in %" PRIu64 ".%03u sec, %" PRIu64 " KiB/s\r\n",
+                disks_modes[mode], total, msec / 1000, (unsigned int)(msec % 1000), total * 1000 / 1024 / msec);
+        }
+    }
 }
@@ -40,7 +40,7 @@ int disks_phy = 1;
 #else
 int disks_phy = 0;
 #endif
-int disks_all = 0, disks_serial = 0, disks_maxsize = DISKS_MAXSIZE, disks_targets[DISKS_MAX], cdrive = 0, nLocks = 0;
+int disks_all = 0, disks_serial = 0, disks_maxsize = DISKS_MAXSIZE, disks_mode = DISKS_SYNC, disks_skipzero = 0, disks_readback = 0, disks_targets[DISKS_MAX], cdrive = 0, nLocks = 0;
 uint64_t disks_capacity[DISKS_MAX];
 
 HANDLE hLocks[32];
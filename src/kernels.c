@@ -0,0 +1,795 @@
+/*
+ * usbimager/kernels.c
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Vectorized buffer scanning and hashing kernels, selected at runtime
+ *
+ * Buffers are checked in blocks, so that a difference or a non-zero byte stops the scan early,
+ * but inside a block there are no branches. Build the micro-benchmark with "make bench".
+ */
+
+#ifdef KERNELS_BENCH
+#define _POSIX_C_SOURCE 199309L         /* for clock_gettime */
+#endif
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "main.h"
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#include <cpuid.h>
+#define KERNELS_X86
+#elif defined(__aarch64__) || (defined(__arm__) && defined(__ARM_NEON))
+#include <arm_neon.h>
+#define KERNELS_HAVE_NEON
+#if defined(__linux__) && defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+/* the SHA-256 instructions need the crypto extension, either from the compiler flags or just for that function */
+#if defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO)
+#define KERNELS_ARMSHA
+#elif defined(__aarch64__) && defined(__GNUC__) && !defined(__clang__)
+#define KERNELS_ARMSHA __attribute__((target("+crypto")))
+#endif
+/* same for the CRC32 instructions */
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define KERNELS_ARMCRC_ATTR
+#elif defined(__aarch64__) && defined(__GNUC__) && !defined(__clang__)
+#include <arm_acle.h>
+#define KERNELS_ARMCRC_ATTR __attribute__((target("+crc")))
+#endif
+#endif
+
+#define KERNELS_BLOCK 256               /* bytes checked between early exits */
+
+enum { KERNELS_SCALAR, KERNELS_SSE2, KERNELS_AVX2, KERNELS_AVX512, KERNELS_NEON, KERNELS_SHANI, KERNELS_ARMV8,
+    KERNELS_PCLMUL, KERNELS_ARMCRC };
+
+/* one set of kernels */
+typedef struct {
+    const char *name;
+    int isa;
+    int (*iszero)(const void *buf, size_t size);
+    int (*equal)(const void *a, const void *b, size_t size);
+} kernels_t;
+
+/* one SHA-256 block function */
+typedef struct {
+    const char *name;
+    int isa;
+    void (*sha256)(uint32_t *state, const uint8_t *data, size_t blocks);
+} kernels_sha_t;
+
+/* one set of CRC functions */
+typedef struct {
+    const char *name;
+    int isa;
+    uint32_t (*crc32)(uint32_t crc, const void *buf, size_t len);
+    uint32_t (*crc32c)(uint32_t crc, const void *buf, size_t len);
+    uint64_t (*crc64)(uint64_t crc, const void *buf, size_t len);
+} kernels_crc_t;
+
+/* a reflected CRC of up to 64 bits */
+typedef struct {
+    uint64_t poly;
+    int bits;
+    uint64_t tbl[8][256];               /* slicing by 8 tables */
+    uint64_t fold[4];                   /* constants to fold 512 and 128 bits ahead */
+} kernels_crcdef_t;
+static kernels_crcdef_t crc32_def = { 0xEDB88320, 32, { { 0 } }, { 0 } };          /* gzip, zip and xz */
+static kernels_crcdef_t crc32c_def = { 0x82F63B78, 32, { { 0 } }, { 0 } };         /* Castagnoli */
+static kernels_crcdef_t crc64_def = { 0xC96C5795D7870F42ULL, 64, { { 0 } }, { 0 } }; /* ECMA-182, xz */
+
+/**
+ * Portable versions, also used for the tails shorter than a block
+ */
+static int kernels_iszero_c(const void *buf, size_t size)
+{
+    const uint8_t *p = (const uint8_t*)buf;
+    uint64_t w, acc;
+    size_t i;
+
+    for(; size >= KERNELS_BLOCK; p += KERNELS_BLOCK, size -= KERNELS_BLOCK) {
+        for(acc = 0, i = 0; i < KERNELS_BLOCK; i += 8) { memcpy(&w, p + i, 8); acc |= w; }
+        if(acc) return 0;
+    }
+    for(acc = 0; size; size--) acc |= *p++;
+    return !acc;
+}
+
+static int kernels_equal_c(const void *a, const void *b, size_t size)
+{
+    const uint8_t *p = (const uint8_t*)a, *q = (const uint8_t*)b;
+    uint64_t v, w, acc;
+    size_t i;
+
+    for(; size >= KERNELS_BLOCK; p += KERNELS_BLOCK, q += KERNELS_BLOCK, size -= KERNELS_BLOCK) {
+        for(acc = 0, i = 0; i < KERNELS_BLOCK; i += 8) { memcpy(&v, p + i, 8); memcpy(&w, q + i, 8); acc |= v ^ w; }
+        if(acc) return 0;
+    }
+    for(acc = 0; size; size--) acc |= *p++ ^ *q++;
+    return !acc;
+}
+
+#ifdef KERNELS_X86
+/**
+ * SSE2, 16 bytes at a time
+ */
+__attribute__((target("sse2"))) static int kernels_iszero_sse2(const void *buf, size_t size)
+{
+    const uint8_t *p = (const uint8_t*)buf;
+    __m128i acc;
+    size_t i;
+
+    for(; size >= KERNELS_BLOCK; p += KERNELS_BLOCK, size -= KERNELS_BLOCK) {
+        for(acc = _mm_setzero_si128(), i = 0; i < KERNELS_BLOCK; i += 16)
+            acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i*)(p + i)));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF) return 0;
+    }
+    return kernels_iszero_c(p, size);
+}
+
+__attribute__((target("sse2"))) static int kernels_equal_sse2(const void *a, const void *b, size_t size)
+{
+    const uint8_t *p = (const uint8_t*)a, *q = (const uint8_t*)b;
+    __m128i acc;
+    size_t i;
+
+    for(; size >= KERNELS_BLOCK; p += KERNELS_BLOCK, q += KERNELS_BLOCK, size -= KERNELS_BLOCK) {
+        for(acc = _mm_setzero_si128(), i = 0; i < KERNELS_BLOCK; i += 16)
+            acc = _mm_or_si128(acc, _mm_xor_si128(_mm_loadu_si128((const __m128i*)(p + i)),
+                _mm_loadu_si128((const __m128i*)(q + i))));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF) return 0;
+    }
+    return kernels_equal_c(p, q, size);
+}
+
+/**
+ * AVX2, 32 bytes at a time
+ */
+__attribute__((target("avx2"))) static int kernels_iszero_avx2(const void *buf, size_t size)
+{
+    const uint8_t *p = (const uint8_t*)buf;
+    __m256i acc;
+    size_t i;
+
+    for(; size >= KERNELS_BLOCK; p += KERNELS_BLOCK, size -= KERNELS_BLOCK) {
+        for(acc = _mm256_setzero_si256(), i = 0; i < KERNELS_BLOCK; i += 32)
+            acc = _mm256_or_si256(acc, _mm256_loadu_si256((const __m256i*)(p + i)));
+        if(!_mm256_testz_si256(acc, acc)) return 0;
+    }
+    return kernels_iszero_c(p, size);
+}
+
+__attribute__((target("avx2"))) static int kernels_equal_avx2(const void *a, const void *b, size_t size)
+{
+    const uint8_t *p = (const uint8_t*)a, *q = (const uint8_t*)b;
+    __m256i acc;
+    size_t i;
+
+    for(; size >= KERNELS_BLOCK; p += KERNELS_BLOCK, q += KERNELS_BLOCK, size -= KERNELS_BLOCK) {
+        for(acc = _mm256_setzero_si256(), i = 0; i < KERNELS_BLOCK; i += 32)
+            acc = _mm256_or_si256(acc, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p + i)),
+                _mm256_loadu_si256((const __m256i*)(q + i))));
+        if(!_mm256_testz_si256(acc, acc)) return 0;
+    }
+    return kernels_equal_c(p, q, size);
+}
+
+/**
+ * AVX-512, 64 bytes at a time
+ */
+__attribute__((target("avx512f"))) static int kernels_iszero_avx512(const void *buf, size_t size)
+{
+    const uint8_t *p = (const uint8_t*)buf;
+    __m512i acc;
+    size_t i;
+
+    for(; size >= KERNELS_BLOCK; p += KERNELS_BLOCK, size -= KERNELS_BLOCK) {
+        for(acc = _mm512_setzero_si512(), i = 0; i < KERNELS_BLOCK; i += 64)
+            acc = _mm512_or_si512(acc, _mm512_loadu_si512((const void*)(p + i)));
+        if(_mm512_test_epi64_mask(acc, acc)) return 0;
+    }
+    return kernels_iszero_c(p, size);
+}
+
+__attribute__((target("avx512f"))) static int kernels_equal_avx512(const void *a, const void *b, size_t size)
+{
+    const uint8_t *p = (const uint8_t*)a, *q = (const uint8_t*)b;
+    __m512i acc;
+    size_t i;
+
+    for(; size >= KERNELS_BLOCK; p += KERNELS_BLOCK, q += KERNELS_BLOCK, size -= KERNELS_BLOCK) {
+        for(acc = _mm512_setzero_si512(), i = 0; i < KERNELS_BLOCK; i += 64)
+            acc = _mm512_or_si512(acc, _mm512_xor_si512(_mm512_loadu_si512((const void*)(p + i)),
+                _mm512_loadu_si512((const void*)(q + i))));
+        if(_mm512_test_epi64_mask(acc, acc)) return 0;
+    }
+    return kernels_equal_c(p, q, size);
+}
+#endif
+
+#ifdef KERNELS_HAVE_NEON
+/**
+ * NEON (ASIMD), 16 bytes at a time
+ */
+static int kernels_neonzero(uint8x16_t acc)
+{
+    return !vget_lane_u64(vreinterpret_u64_u8(vorr_u8(vget_low_u8(acc), vget_high_u8(acc))), 0);
+}
+
+static int kernels_iszero_neon(const void *buf, size_t size)
+{
+    const uint8_t *p = (const uint8_t*)buf;
+    uint8x16_t acc;
+    size_t i;
+
+    for(; size >= KERNELS_BLOCK; p += KERNELS_BLOCK, size -= KERNELS_BLOCK) {
+        for(acc = vdupq_n_u8(0), i = 0; i < KERNELS_BLOCK; i += 16)
+            acc = vorrq_u8(acc, vld1q_u8(p + i));
+        if(!kernels_neonzero(acc)) return 0;
+    }
+    return kernels_iszero_c(p, size);
+}
+
+static int kernels_equal_neon(const void *a, const void *b, size_t size)
+{
+    const uint8_t *p = (const uint8_t*)a, *q = (const uint8_t*)b;
+    uint8x16_t acc;
+    size_t i;
+
+    for(; size >= KERNELS_BLOCK; p += KERNELS_BLOCK, q += KERNELS_BLOCK, size -= KERNELS_BLOCK) {
+        for(acc = vdupq_n_u8(0), i = 0; i < KERNELS_BLOCK; i += 16)
+            acc = vorrq_u8(acc, veorq_u8(vld1q_u8(p + i), vld1q_u8(q + i)));
+        if(!kernels_neonzero(acc)) return 0;
+    }
+    return kernels_equal_c(p, q, size);
+}
+#endif
+
+/**
+ * SHA-256 block function, portable version
+ */
+#define SHA_ROTR(a,b) (((a)>>(b))|((a)<<(32-(b))))
+#define SHA_CH(x,y,z) (((x)&(y))^(~(x)&(z)))
+#define SHA_MAJ(x,y,z) (((x)&(y))^((x)&(z))^((y)&(z)))
+#define SHA_EP0(x) (SHA_ROTR(x,2)^SHA_ROTR(x,13)^SHA_ROTR(x,22))
+#define SHA_EP1(x) (SHA_ROTR(x,6)^SHA_ROTR(x,11)^SHA_ROTR(x,25))
+#define SHA_SIG0(x) (SHA_ROTR(x,7)^SHA_ROTR(x,18)^((x)>>3))
+#define SHA_SIG1(x) (SHA_ROTR(x,17)^SHA_ROTR(x,19)^((x)>>10))
+static const uint32_t sha256_k[64]={
+   0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+   0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+   0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+   0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+   0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+   0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+   0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+   0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+};
+static void kernels_sha256_c(uint32_t *s, const uint8_t *p, size_t blocks)
+{
+   uint32_t a,b,c,d,e,f,g,h,i,j,t1,t2,m[64];
+   for(;blocks--;p+=64) {
+       for(i=0,j=0;i<16;i++,j+=4) m[i]=((uint32_t)p[j]<<24)|(p[j+1]<<16)|(p[j+2]<<8)|(p[j+3]);
+       for(;i<64;i++) m[i]=SHA_SIG1(m[i-2])+m[i-7]+SHA_SIG0(m[i-15])+m[i-16];
+       a=s[0];b=s[1];c=s[2];d=s[3];
+       e=s[4];f=s[5];g=s[6];h=s[7];
+       for(i=0;i<64;i++) {
+           t1=h+SHA_EP1(e)+SHA_CH(e,f,g)+sha256_k[i]+m[i];
+           t2=SHA_EP0(a)+SHA_MAJ(a,b,c);h=g;g=f;f=e;e=d+t1;d=c;c=b;b=a;a=t1+t2;
+       }
+       s[0]+=a;s[1]+=b;s[2]+=c;s[3]+=d;
+       s[4]+=e;s[5]+=f;s[6]+=g;s[7]+=h;
+   }
+}
+
+#ifdef KERNELS_X86
+/**
+ * SHA-256 with the SHA extensions (SHA-NI). The state is kept as ABEF and CDGH, each group of
+ * four rounds extends the message schedule by four words
+ */
+__attribute__((target("sha,sse4.1"))) static void kernels_sha256_shani(uint32_t *s, const uint8_t *d, size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i st0, st1, save0, save1, msg[4], wk, tmp;
+    int i;
+
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&s[0]), 0xB1);
+    st1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&s[4]), 0x1B);
+    st0 = _mm_alignr_epi8(tmp, st1, 8);
+    st1 = _mm_blend_epi16(st1, tmp, 0xF0);
+    for(; blocks--; d += 64) {
+        save0 = st0; save1 = st1;
+        for(i = 0; i < 16; i++) {
+            if(i < 4)
+                msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(d + i * 16)), mask);
+            else
+                msg[i & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(msg[i & 3], msg[(i + 1) & 3]),
+                    _mm_alignr_epi8(msg[(i + 3) & 3], msg[(i + 2) & 3], 4)), msg[(i + 3) & 3]);
+            wk = _mm_add_epi32(msg[i & 3], _mm_loadu_si128((const __m128i*)&sha256_k[i * 4]));
+            st1 = _mm_sha256rnds2_epu32(st1, st0, wk);
+            st0 = _mm_sha256rnds2_epu32(st0, st1, _mm_shuffle_epi32(wk, 0x0E));
+        }
+        st0 = _mm_add_epi32(st0, save0);
+        st1 = _mm_add_epi32(st1, save1);
+    }
+    tmp = _mm_shuffle_epi32(st0, 0x1B);
+    st1 = _mm_shuffle_epi32(st1, 0xB1);
+    _mm_storeu_si128((__m128i*)&s[0], _mm_blend_epi16(tmp, st1, 0xF0));
+    _mm_storeu_si128((__m128i*)&s[4], _mm_alignr_epi8(st1, tmp, 8));
+}
+#endif
+
+#ifdef KERNELS_ARMSHA
+/**
+ * SHA-256 with the ARMv8 cryptography extensions
+ */
+KERNELS_ARMSHA static void kernels_sha256_armv8(uint32_t *s, const uint8_t *d, size_t blocks)
+{
+    uint32x4_t st0, st1, save0, save1, msg[4], wk, tmp;
+    int i;
+
+    st0 = vld1q_u32(&s[0]);
+    st1 = vld1q_u32(&s[4]);
+    for(; blocks--; d += 64) {
+        save0 = st0; save1 = st1;
+        for(i = 0; i < 16; i++) {
+            if(i < 4)
+                msg[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(d + i * 16)));
+            else
+                msg[i & 3] = vsha256su1q_u32(vsha256su0q_u32(msg[i & 3], msg[(i + 1) & 3]), msg[(i + 2) & 3],
+                    msg[(i + 3) & 3]);
+            wk = vaddq_u32(msg[i & 3], vld1q_u32(&sha256_k[i * 4]));
+            tmp = st0;
+            st0 = vsha256hq_u32(st0, st1, wk);
+            st1 = vsha256h2q_u32(st1, tmp, wk);
+        }
+        st0 = vaddq_u32(st0, save0);
+        st1 = vaddq_u32(st1, save1);
+    }
+    vst1q_u32(&s[0], st0);
+    vst1q_u32(&s[4], st1);
+}
+#endif
+
+/**
+ * CRCs, portable version, slicing by 8 with the tables built by kernels_init(). This works on the raw
+ * register, without the inversions before and after
+ */
+static uint64_t kernels_crcraw(const kernels_crcdef_t *d, uint64_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t v;
+    int i;
+
+    for(; len >= 8; p += 8, len -= 8) {
+        for(v = 0, i = 7; i >= 0; i--) v = (v << 8) | p[i];
+        v ^= crc;
+        crc = d->tbl[7][v & 0xff] ^ d->tbl[6][(v >> 8) & 0xff] ^ d->tbl[5][(v >> 16) & 0xff] ^
+            d->tbl[4][(v >> 24) & 0xff] ^ d->tbl[3][(v >> 32) & 0xff] ^ d->tbl[2][(v >> 40) & 0xff] ^
+            d->tbl[1][(v >> 48) & 0xff] ^ d->tbl[0][v >> 56];
+    }
+    for(; len; len--) crc = d->tbl[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+static uint32_t kernels_crc32_c(uint32_t crc, const void *buf, size_t len)
+{
+    return ~(uint32_t)kernels_crcraw(&crc32_def, (uint32_t)~crc, (const uint8_t*)buf, len);
+}
+
+static uint32_t kernels_crc32c_c(uint32_t crc, const void *buf, size_t len)
+{
+    return ~(uint32_t)kernels_crcraw(&crc32c_def, (uint32_t)~crc, (const uint8_t*)buf, len);
+}
+
+static uint64_t kernels_crc64_c(uint64_t crc, const void *buf, size_t len)
+{
+    return ~kernels_crcraw(&crc64_def, ~crc, (const uint8_t*)buf, len);
+}
+
+/**
+ * x^e modulo the polynomial, in the reflected bit order, aligned to the top of 64 bits
+ */
+static uint64_t kernels_crcxpow(const kernels_crcdef_t *d, int e)
+{
+    uint64_t r = 1ULL << (d->bits - 1);
+
+    while(e--) r = r & 1 ? (r >> 1) ^ d->poly : r >> 1;
+    return r << (64 - d->bits);
+}
+
+static void kernels_crctables(kernels_crcdef_t *d)
+{
+    uint64_t c;
+    int i, j;
+
+    for(i = 0; i < 256; i++) {
+        for(c = i, j = 0; j < 8; j++) c = c & 1 ? (c >> 1) ^ d->poly : c >> 1;
+        d->tbl[0][i] = c;
+    }
+    for(i = 0; i < 256; i++)
+        for(j = 1; j < 8; j++)
+            d->tbl[j][i] = (d->tbl[j - 1][i] >> 8) ^ d->tbl[0][d->tbl[j - 1][i] & 0xff];
+    /* the low half of a 128 bit lane is multiplied by x^(D+63), the high half by x^(D-1), where D is the
+     * folding distance in bits. With reflected operands the carry-less product is one bit short, that's
+     * why it's one less than x^(D+64) and x^D */
+    d->fold[0] = kernels_crcxpow(d, 512 + 63);
+    d->fold[1] = kernels_crcxpow(d, 512 - 1);
+    d->fold[2] = kernels_crcxpow(d, 128 + 63);
+    d->fold[3] = kernels_crcxpow(d, 128 - 1);
+}
+
+#ifdef KERNELS_X86
+/**
+ * CRCs with PCLMULQDQ, folding four 128 bit lanes 64 bytes ahead at a time, then into one lane. What's
+ * left in the lane has the same remainder as the data folded into it, that and the tail are finished
+ * with the tables
+ */
+#define KERNELS_FOLD(x, k) _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11))
+__attribute__((target("pclmul,sse2"))) static uint64_t kernels_crcfold(const kernels_crcdef_t *d, uint64_t crc,
+    const uint8_t *p, size_t len)
+{
+    __m128i x0, x1, x2, x3, k;
+    uint8_t lane[16];
+
+    if(len < 64) return kernels_crcraw(d, crc, p, len);
+    x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), _mm_set_epi64x(0, (long long)crc));
+    x1 = _mm_loadu_si128((const __m128i*)(p + 16));
+    x2 = _mm_loadu_si128((const __m128i*)(p + 32));
+    x3 = _mm_loadu_si128((const __m128i*)(p + 48));
+    k = _mm_set_epi64x((long long)d->fold[1], (long long)d->fold[0]);
+    for(p += 64, len -= 64; len >= 64; p += 64, len -= 64) {
+        x0 = _mm_xor_si128(KERNELS_FOLD(x0, k), _mm_loadu_si128((const __m128i*)p));
+        x1 = _mm_xor_si128(KERNELS_FOLD(x1, k), _mm_loadu_si128((const __m128i*)(p + 16)));
+        x2 = _mm_xor_si128(KERNELS_FOLD(x2, k), _mm_loadu_si128((const __m128i*)(p + 32)));
+        x3 = _mm_xor_si128(KERNELS_FOLD(x3, k), _mm_loadu_si128((const __m128i*)(p + 48)));
+    }
+    k = _mm_set_epi64x((long long)d->fold[3], (long long)d->fold[2]);
+    x0 = _mm_xor_si128(KERNELS_FOLD(x0, k), x1);
+    x0 = _mm_xor_si128(KERNELS_FOLD(x0, k), x2);
+    x0 = _mm_xor_si128(KERNELS_FOLD(x0, k), x3);
+    for(; len >= 16; p += 16, len -= 16)
+        x0 = _mm_xor_si128(KERNELS_FOLD(x0, k), _mm_loadu_si128((const __m128i*)p));
+    _mm_storeu_si128((__m128i*)lane, x0);
+    return kernels_crcraw(d, kernels_crcraw(d, 0, lane, 16), p, len);
+}
+
+static uint32_t kernels_crc32_pclmul(uint32_t crc, const void *buf, size_t len)
+{
+    return ~(uint32_t)kernels_crcfold(&crc32_def, (uint32_t)~crc, (const uint8_t*)buf, len);
+}
+
+static uint32_t kernels_crc32c_pclmul(uint32_t crc, const void *buf, size_t len)
+{
+    return ~(uint32_t)kernels_crcfold(&crc32c_def, (uint32_t)~crc, (const uint8_t*)buf, len);
+}
+
+static uint64_t kernels_crc64_pclmul(uint64_t crc, const void *buf, size_t len)
+{
+    return ~kernels_crcfold(&crc64_def, ~crc, (const uint8_t*)buf, len);
+}
+#endif
+
+#ifdef KERNELS_ARMCRC_ATTR
+/**
+ * CRC32 and CRC32C with the ARMv8 crc32 instructions, CRC64 has no instruction, that uses the tables
+ */
+KERNELS_ARMCRC_ATTR static uint32_t kernels_crc32_armv8(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t*)buf;
+    uint64_t v;
+
+    crc = ~crc;
+    for(; len >= 8; p += 8, len -= 8) { memcpy(&v, p, 8); crc = __crc32d(crc, v); }
+    for(; len; len--) crc = __crc32b(crc, *p++);
+    return ~crc;
+}
+
+KERNELS_ARMCRC_ATTR static uint32_t kernels_crc32c_armv8(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = (const uint8_t*)buf;
+    uint64_t v;
+
+    crc = ~crc;
+    for(; len >= 8; p += 8, len -= 8) { memcpy(&v, p, 8); crc = __crc32cd(crc, v); }
+    for(; len; len--) crc = __crc32cb(crc, *p++);
+    return ~crc;
+}
+#endif
+
+/* available kernels, from the slowest to the fastest */
+static const kernels_t kernels[] = {
+    { "scalar", KERNELS_SCALAR, kernels_iszero_c, kernels_equal_c },
+#ifdef KERNELS_X86
+    { "sse2", KERNELS_SSE2, kernels_iszero_sse2, kernels_equal_sse2 },
+    { "avx2", KERNELS_AVX2, kernels_iszero_avx2, kernels_equal_avx2 },
+    { "avx512", KERNELS_AVX512, kernels_iszero_avx512, kernels_equal_avx512 },
+#endif
+#ifdef KERNELS_HAVE_NEON
+    { "neon", KERNELS_NEON, kernels_iszero_neon, kernels_equal_neon },
+#endif
+};
+static const kernels_sha_t kernels_sha[] = {
+    { "scalar", KERNELS_SCALAR, kernels_sha256_c },
+#ifdef KERNELS_X86
+    { "sha-ni", KERNELS_SHANI, kernels_sha256_shani },
+#endif
+#ifdef KERNELS_ARMSHA
+    { "armv8", KERNELS_ARMV8, kernels_sha256_armv8 },
+#endif
+};
+static const kernels_crc_t kernels_crc[] = {
+    { "scalar", KERNELS_SCALAR, kernels_crc32_c, kernels_crc32c_c, kernels_crc64_c },
+#ifdef KERNELS_X86
+    { "pclmul", KERNELS_PCLMUL, kernels_crc32_pclmul, kernels_crc32c_pclmul, kernels_crc64_pclmul },
+#endif
+#ifdef KERNELS_ARMCRC_ATTR
+    { "armv8", KERNELS_ARMCRC, kernels_crc32_armv8, kernels_crc32c_armv8, kernels_crc64_c },
+#endif
+};
+
+/**
+ * Check if the CPU supports an instruction set, with CPUID on x86 and HWCAP on ARM
+ */
+static int kernels_cpu(int isa)
+{
+#ifdef KERNELS_X86
+    unsigned int a, b, c, d;
+#endif
+
+    switch(isa) {
+#ifdef KERNELS_X86
+        case KERNELS_SSE2: __builtin_cpu_init(); return __builtin_cpu_supports("sse2");
+        case KERNELS_AVX2: __builtin_cpu_init(); return __builtin_cpu_supports("avx2");
+        case KERNELS_AVX512: __builtin_cpu_init(); return __builtin_cpu_supports("avx512f");
+        case KERNELS_SHANI:
+            /* not every compiler knows "sha" for __builtin_cpu_supports, ask CPUID leaf 7 directly */
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse4.1") && __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1 << 29));
+        case KERNELS_PCLMUL: __builtin_cpu_init(); return __builtin_cpu_supports("sse2") && __get_cpuid(1, &a, &b, &c, &d) &&
+            (c & (1 << 1));
+#endif
+#ifdef KERNELS_HAVE_NEON
+        case KERNELS_NEON:
+#if defined(__linux__) && defined(__aarch64__)
+            return !!(getauxval(AT_HWCAP) & HWCAP_ASIMD);
+#else
+            return 1;
+#endif
+#endif
+#ifdef KERNELS_ARMSHA
+        case KERNELS_ARMV8:
+#if defined(__linux__) && defined(__aarch64__)
+            return !!(getauxval(AT_HWCAP) & HWCAP_SHA2);
+#else
+            return 1;
+#endif
+#endif
+#ifdef KERNELS_ARMCRC_ATTR
+        case KERNELS_ARMCRC:
+#if defined(__linux__) && defined(__aarch64__)
+            return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+#else
+            return 1;
+#endif
+#endif
+        default: return isa == KERNELS_SCALAR;
+    }
+}
+
+/* before kernels_init(), the pointers go through these */
+static int kernels_iszero_init(const void *buf, size_t size)
+{
+    kernels_init();
+    return kernels_iszero(buf, size);
+}
+
+static int kernels_equal_init(const void *a, const void *b, size_t size)
+{
+    kernels_init();
+    return kernels_equal(a, b, size);
+}
+
+int (*kernels_iszero)(const void *buf, size_t size) = kernels_iszero_init;
+static void kernels_sha256_init(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+    kernels_init();
+    kernels_sha256(state, data, blocks);
+}
+
+static uint32_t kernels_crc32_init(uint32_t crc, const void *buf, size_t len)
+{
+    kernels_init();
+    return kernels_crc32(crc, buf, len);
+}
+
+static uint32_t kernels_crc32c_init(uint32_t crc, const void *buf, size_t len)
+{
+    kernels_init();
+    return kernels_crc32c(crc, buf, len);
+}
+
+static uint64_t kernels_crc64_init(uint64_t crc, const void *buf, size_t len)
+{
+    kernels_init();
+    return kernels_crc64(crc, buf, len);
+}
+
+int (*kernels_equal)(const void *a, const void *b, size_t size) = kernels_equal_init;
+void (*kernels_sha256)(uint32_t *state, const uint8_t *data, size_t blocks) = kernels_sha256_init;
+uint32_t (*kernels_crc32)(uint32_t crc, const void *buf, size_t len) = kernels_crc32_init;
+uint32_t (*kernels_crc32c)(uint32_t crc, const void *buf, size_t len) = kernels_crc32c_init;
+uint64_t (*kernels_crc64)(uint64_t crc, const void *buf, size_t len) = kernels_crc64_init;
+
+/**
+ * Select the fastest kernels the CPU supports
+ */
+void kernels_init(void)
+{
+    int i = sizeof(kernels) / sizeof(kernels[0]) - 1, j = sizeof(kernels_sha) / sizeof(kernels_sha[0]) - 1;
+    int k = sizeof(kernels_crc) / sizeof(kernels_crc[0]) - 1;
+
+    while(i > 0 && !kernels_cpu(kernels[i].isa)) i--;
+    while(j > 0 && !kernels_cpu(kernels_sha[j].isa)) j--;
+    while(k > 0 && !kernels_cpu(kernels_crc[k].isa)) k--;
+    if(verbose && kernels_iszero == kernels_iszero_init)
+        printf("kernels_init() using %s, SHA-256 %s, CRC %s\r\n", kernels[i].name, kernels_sha[j].name,
+            kernels_crc[k].name);
+    if(!crc32_def.tbl[0][1]) {
+        kernels_crctables(&crc32_def);
+        kernels_crctables(&crc32c_def);
+        kernels_crctables(&crc64_def);
+    }
+    kernels_crc64 = kernels_crc[k].crc64;
+    kernels_crc32c = kernels_crc[k].crc32c;
+    kernels_crc32 = kernels_crc[k].crc32;
+    kernels_sha256 = kernels_sha[j].sha256;
+    kernels_equal = kernels[i].equal;
+    kernels_iszero = kernels[i].iszero;
+}
+
+#ifdef KERNELS_BENCH
+#include <stdlib.h>
+#include <time.h>
+int verbose = 0;
+
+#define BENCH_SIZE (1024*1024)          /* the default buffer_size */
+#define BENCH_ROUNDS 1024
+
+/**
+ * Micro-benchmark, reports the throughput of each supported kernel on the worst case (zeros and
+ * identical buffers, which have to be scanned entirely)
+ */
+static double bench(int (*iszero)(const void*, size_t), int (*equal)(const void*, const void*, size_t),
+    const void *a, const void *b)
+{
+    struct timespec s, e;
+    int i, r = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &s);
+    for(i = 0; i < BENCH_ROUNDS; i++) r += iszero ? iszero(a, BENCH_SIZE) : equal(a, b, BENCH_SIZE);
+    clock_gettime(CLOCK_MONOTONIC, &e);
+    if(r != BENCH_ROUNDS) { fprintf(stderr, "kernel returned a wrong result\n"); exit(1); }
+    return (double)BENCH_SIZE * BENCH_ROUNDS / ((e.tv_sec - s.tv_sec) * 1e9 + (e.tv_nsec - s.tv_nsec));
+}
+
+static double bench_sha(void (*sha256)(uint32_t*, const uint8_t*, size_t), const void *a, uint32_t *state)
+{
+    struct timespec s, e;
+    int i;
+
+    memset(state, 0, 8 * sizeof(uint32_t));
+    clock_gettime(CLOCK_MONOTONIC, &s);
+    for(i = 0; i < BENCH_ROUNDS / 16; i++) sha256(state, (const uint8_t*)a, BENCH_SIZE / 64);
+    clock_gettime(CLOCK_MONOTONIC, &e);
+    return (double)BENCH_SIZE * (BENCH_ROUNDS / 16) / ((e.tv_sec - s.tv_sec) * 1e9 + (e.tv_nsec - s.tv_nsec));
+}
+
+/* CRC32, CRC32C or CRC64 from a set of CRC kernels */
+static uint64_t bench_crcrun(const kernels_crc_t *k, int which, uint64_t crc, const void *a, size_t len)
+{
+    return which == 2 ? k->crc64(crc, a, len) : (which ? k->crc32c : k->crc32)((uint32_t)crc, a, len);
+}
+
+static double bench_crc(const kernels_crc_t *k, int which, const void *a, uint64_t *crc)
+{
+    struct timespec s, e;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &s);
+    for(*crc = 0, i = 0; i < BENCH_ROUNDS / 4; i++) *crc = bench_crcrun(k, which, *crc, a, BENCH_SIZE);
+    clock_gettime(CLOCK_MONOTONIC, &e);
+    return (double)BENCH_SIZE * (BENCH_ROUNDS / 4) / ((e.tv_sec - s.tv_sec) * 1e9 + (e.tv_nsec - s.tv_nsec));
+}
+
+static int bench_memiszero(const void *buf, size_t size)
+{
+    return !((const char*)buf)[0] && !memcmp(buf, (const char*)buf + 1, size - 1);
+}
+
+static int bench_memequal(const void *a, const void *b, size_t size)
+{
+    return !memcmp(a, b, size);
+}
+
+int main(void)
+{
+    char *a = (char*)calloc(1, BENCH_SIZE), *b = (char*)calloc(1, BENCH_SIZE);
+    uint32_t ref[8], state[8];
+    uint64_t crc, crcref[3] = { 0 }, check[3] = { 0xCBF43926, 0xE3069283, 0x995DC9BBDF1939FAULL };
+    double r;
+    size_t i, j, l;
+    int ok;
+
+    if(!a || !b) { fprintf(stderr, "not enough memory\n"); return 1; }
+    kernels_init();
+    /* fault in the pages and check the kernels against each other on a few corner cases */
+    for(i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+        if(kernels_cpu(kernels[i].isa)) {
+            a[BENCH_SIZE - 1] = 1;
+            if(kernels[i].iszero(a, BENCH_SIZE) || !kernels[i].iszero(a, BENCH_SIZE - 1) ||
+                kernels[i].equal(a, b, BENCH_SIZE) || !kernels[i].equal(a + 3, b + 3, 1000)) {
+                fprintf(stderr, "%s kernel failed\n", kernels[i].name); return 1;
+            }
+            a[BENCH_SIZE - 1] = 0;
+        }
+    printf("%-8s %10s %10s\n", "kernel", "iszero", "equal");
+    printf("%-8s %7.2f GB/s %5.2f GB/s\n", "memcmp", bench(bench_memiszero, NULL, a, b), bench(NULL, bench_memequal, a, b));
+    for(i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+        if(kernels_cpu(kernels[i].isa))
+            printf("%-8s %7.2f GB/s %5.2f GB/s\n", kernels[i].name, bench(kernels[i].iszero, NULL, a, b),
+                bench(NULL, kernels[i].equal, a, b));
+    for(i = 0; i < BENCH_SIZE; i++) b[i] = (char)(i * 7 + (i >> 11));
+    printf("\n%-8s %10s\n", "kernel", "sha256");
+    for(i = 0; i < sizeof(kernels_sha) / sizeof(kernels_sha[0]); i++)
+        if(kernels_cpu(kernels_sha[i].isa)) {
+            r = bench_sha(kernels_sha[i].sha256, b, i ? state : ref);
+            if(i && memcmp(ref, state, sizeof(ref))) { fprintf(stderr, "%s kernel failed\n", kernels_sha[i].name); return 1; }
+            printf("%-8s %7.2f GB/s\n", kernels_sha[i].name, r);
+        }
+    printf("\n%-8s %10s %10s %10s\n", "kernel", "crc32", "crc32c", "crc64");
+    for(i = 0; i < sizeof(kernels_crc) / sizeof(kernels_crc[0]); i++)
+        if(kernels_cpu(kernels_crc[i].isa)) {
+            printf("%-8s", kernels_crc[i].name);
+            for(j = 0; j < 3; j++) {
+                /* check the known values, and against the portable version with all kinds of lengths */
+                ok = bench_crcrun(&kernels_crc[i], j, 0, "123456789", 9) == check[j];
+                for(l = 0; ok && l < 300; l++)
+                    ok = bench_crcrun(&kernels_crc[i], j, l, b + l, l * 7) == bench_crcrun(&kernels_crc[0], j, l, b + l, l * 7);
+                r = bench_crc(&kernels_crc[i], j, b + 1, &crc);
+                if(!ok || (i && crc != crcref[j])) { fprintf(stderr, "\n%s kernel failed\n", kernels_crc[i].name); return 1; }
+                crcref[j] = crc;
+                printf(" %5.2f GB/s", r);
+            }
+            printf("\n");
+        }
+    free(a); free(b);
+    return 0;
+}
+#endif
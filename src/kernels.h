@@ -0,0 +1,59 @@
+/*
+ * usbimager/kernels.h
+ *
+ * Copyright (C) 2020 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Vectorized buffer scanning and hashing kernels, selected at runtime
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Returns 1 if the buffer contains only zeros
+ */
+extern int (*kernels_iszero)(const void *buf, size_t size);
+
+/**
+ * Returns 1 if the two buffers are identical
+ */
+extern int (*kernels_equal)(const void *a, const void *b, size_t size);
+
+/**
+ * Add the given number of 64 byte blocks to a SHA-256 state
+ */
+extern void (*kernels_sha256)(uint32_t *state, const uint8_t *data, size_t blocks);
+
+/**
+ * Continue a CRC with a buffer, start with 0 (like zlib's crc32). CRC32 is the one in gzip, zip and xz,
+ * CRC32C is Castagnoli's, and CRC64 is the ECMA-182 one in xz
+ */
+extern uint32_t (*kernels_crc32)(uint32_t crc, const void *buf, size_t len);
+extern uint32_t (*kernels_crc32c)(uint32_t crc, const void *buf, size_t len);
+extern uint64_t (*kernels_crc64)(uint64_t crc, const void *buf, size_t len);
+
+/**
+ * Select the fastest kernels the CPU supports (called automatically on first use)
+ */
+void kernels_init(void);
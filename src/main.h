@@ -42,6 +42,7 @@ enum {
 extern int verbose;
 extern int buffer_size;
 extern int baud;
+extern int checksum;
 extern int force;
 
 /**
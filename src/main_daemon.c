@@ -0,0 +1,907 @@
+/*
+ * usbimager/main_daemon.c
+ *
+ * Copyright (C) 2023 bzt (bztsrc@gitlab)
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use, copy,
+ * modify, merge, publish, distribute, sublicense, and/or sell copies
+ * of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @brief Headless flash station for Linux, takes write jobs over a local socket
+ *
+ */
+
+#define _XOPEN_SOURCE 700               /* for realpath, dprintf and S_ISSOCK */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <grp.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "lang.h"
+#include "stream.h"
+#include "disks.h"
+#include "kernels.h"
+
+#define DAEMON_SOCKET "/run/usbimager.sock"
+#define DAEMON_GROUP "disk"     /* group of the socket, its members can submit jobs */
+#define DAEMON_JOBS 256         /* number of jobs remembered, job id N is kept in slot N % DAEMON_JOBS */
+#define DAEMON_PERHOST 2        /* default number of disks written at once on one USB host controller */
+#define DAEMON_CACHE "/var/cache/usbimager"    /* where the arm mode keeps the decoded image */
+
+/* job states and verify modes, as they appear in the protocol */
+enum { JOB_FREE, JOB_QUEUED, JOB_RUNNING, JOB_DONE, JOB_FAILED, JOB_CANCELLED };
+static char *job_states[] = { "free", "queued", "running", "done", "failed", "cancelled" };
+enum { VERIFY_NONE, VERIFY_INLINE, VERIFY_READBACK };
+static char *verify_modes[] = { "none", "verify", "readback" };
+
+typedef struct {
+    int id, state, verify, cancel, progress;
+    int armed;                          /* queued by the arm mode */
+    char image[PATH_MAX];
+    char target[128];                   /* as given: device name, USB port path or USB serial number */
+    char dev[32], host[256];            /* the disk it was resolved to, and the host controller it's on */
+    char msg[256];
+} job_t;
+
+/* arm mode, every newly plugged in disk that matches the filter is written with the same image */
+enum { ARM_OFF, ARM_DECODING, ARM_ON };
+typedef struct {
+    int state, verify, num;
+    char vendor[128], model[128], filter[256];
+    uint64_t min, max;
+    char image[PATH_MAX];               /* as it was given */
+    char path[PATH_MAX];                /* what's written, the decoded copy in the cache or the image itself if it's raw */
+} arm_t;
+
+char **lang = NULL;
+extern char *dict[NUMLANGS][NUMTEXTS + 1];
+void filegetcontent(char *fn, char *buf, int maxlen);
+
+char *main_errorMessage = NULL;
+static char *sockpath = DAEMON_SOCKET, *sockgroup = DAEMON_GROUP, *cachedir = DAEMON_CACHE, targetList[DISKS_MAX][128];
+static int numTargetList = 0, perhost = DAEMON_PERHOST, firstId = 1, lastId = 0, quit = 0;
+static job_t jobs[DAEMON_JOBS];
+static arm_t arm;
+static char seen[DISKS_MAX][32];        /* disks that were already there, these aren't written by the arm mode */
+static int numSeen = 0;
+/* lock order: jobs_mutex before disks_mutex. The latter guards the disks_* lists, and also stream_open() and
+ * disks_open(), because they report errors in the global main_errorMessage */
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER, disks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+
+void main_addToCombobox(char *option)
+{
+    strncpy(targetList[numTargetList++], option, 127);
+}
+
+void main_getErrorMessage(void)
+{
+    main_errorMessage = errno ? strerror(errno) : NULL;
+}
+
+void main_onProgress(void *data)
+{
+    (void)data;
+}
+
+/**
+ * Refresh the target list, must be called with disks_mutex held
+ */
+static void refreshTarget(void)
+{
+    memset(targetList, 0, sizeof(targetList));
+    numTargetList = 0;
+    disks_refreshlist();
+}
+
+/**
+ * Copy the device name of a target list entry (its first word)
+ */
+static void targetName(int i, char *dev)
+{
+    int l;
+
+    for(l = 0; l < 31 && targetList[i][l] && targetList[i][l] != ' '; l++) dev[l] = targetList[i][l];
+    dev[l] = 0;
+}
+
+/**
+ * Look up where a block device is connected from its sysfs path, for example
+ *   /sys/devices/pci0000:00/0000:00:14.0/usb2/2-1/2-1.3/2-1.3:1.0/host6/target6:0:0/6:0:0:0/block/sdb
+ * port is the USB port path ("2-1.3"), serial the USB serial number, host the host controller ("0000:00:14.0").
+ * The USB 2 and USB 3 root hubs of a controller share its bandwidth, so they have the same host. Not USB
+ * disks are identified by the parent of their SCSI host, or by their own name if they have none
+ */
+static void daemon_topology(char *dev, char *port, char *serial, char *host)
+{
+    char path[PATH_MAX], real[PATH_MAX], *c, *e, *prev = NULL, *usb = NULL, *scsi = NULL;
+    int l, pl = 0, ul = 0, sl = 0;
+
+    port[0] = serial[0] = 0;
+    strcpy(host, dev);
+    sprintf(path, "/sys/block/%s", dev);
+    if(!realpath(path, real)) return;
+    for(c = real; *c; c = e) {
+        while(*c == '/') c++;
+        for(e = c; *e && *e != '/'; e++);
+        l = e - c;
+        if(l > 3 && !memcmp(c, "usb", 3) && c[3] >= '0' && c[3] <= '9' && prev && !usb) { usb = prev; ul = pl; }
+        if(l > 4 && !memcmp(c, "host", 4) && c[4] >= '0' && c[4] <= '9' && prev && !scsi) { scsi = prev; sl = pl; }
+        /* USB devices are named bus-port.port.port, their interfaces have a ':' in the name */
+        if(usb && !scsi && c[0] >= '1' && c[0] <= '9' && memchr(c, '-', l) && !memchr(c, ':', l) && l < 32) {
+            memcpy(port, c, l); port[l] = 0;
+            memcpy(path, real, e - real); strcpy(path + (e - real), "/serial");
+        }
+        prev = c; pl = l;
+    }
+    if(ul > 255) ul = 255;
+    if(sl > 255) sl = 255;
+    if(usb) { memcpy(host, usb, ul); host[ul] = 0; } else
+    if(scsi) { memcpy(host, scsi, sl); host[sl] = 0; }
+    if(port[0]) filegetcontent(path, serial, 128);
+    /* these are written in a space separated protocol */
+    for(c = serial; *c; c++) if(*c <= ' ') *c = '_';
+}
+
+/**
+ * Find the target list entry for a device name, "/dev/" name, USB port path or USB serial number
+ * must be called with disks_mutex held and an up-to-date list. Returns the index or -1
+ */
+static int daemon_resolve(char *target)
+{
+    char dev[32], port[32], serial[128], host[256];
+    int i;
+
+    if(!memcmp(target, "/dev/", 5)) target += 5;
+    for(i = 0; i < numTargetList; i++) {
+        targetName(i, dev);
+        if(!strcmp(dev, target)) return i;
+    }
+    for(i = 0; i < numTargetList; i++) {
+        targetName(i, dev);
+        daemon_topology(dev, port, serial, host);
+        if((port[0] && !strcmp(port, target)) || (serial[0] && !strcmp(serial, target))) return i;
+    }
+    return -1;
+}
+
+/**
+ * Set the job's message from a translated error and the reason, if any
+ */
+static void daemon_error(job_t *job, int msg, char *reason)
+{
+    pthread_mutex_lock(&jobs_mutex);
+    snprintf(job->msg, sizeof(job->msg), "%s%s%s", lang[msg], reason ? " " : "", reason ? reason : "");
+    pthread_mutex_unlock(&jobs_mutex);
+}
+
+/**
+ * Update the job's progress, the callback of stream_todisk(). Returns 1 if the job was cancelled in the meantime
+ */
+static int daemon_progress(void *data, stream_t *ctx)
+{
+    job_t *job = (job_t*)data;
+    char str[256];
+    int progress = stream_status(ctx, str, 0), ret;
+
+    pthread_mutex_lock(&jobs_mutex);
+    job->progress = progress;
+    strcpy(job->msg, str);
+    ret = job->cancel;
+    pthread_mutex_unlock(&jobs_mutex);
+    return ret;
+}
+
+static void daemon_schedule(void);
+
+/**
+ * Function that reads from input and writes to one disk, one thread for each running job
+ */
+static void *daemon_writer(void *data)
+{
+    job_t *job = (job_t*)data;
+    stream_t *ctx;
+    int i, dst, err = 1;
+    char str[256] = { 0 }, reason[128];
+
+    if(verbose) printf("Job %d writing '%s' to %s\r\n", job->id, job->image, job->dev);
+    ctx = (stream_t*)calloc(1, sizeof(stream_t));
+    if(!ctx) {
+        daemon_error(job, L_SRCERR, strerror(errno));
+        goto end;
+    }
+    /* the error message is copied while the lock is held, another job might overwrite it right after */
+    pthread_mutex_lock(&disks_mutex);
+    errno = 0;
+    main_errorMessage = NULL;
+    dst = stream_open(ctx, job->image, 0);
+    if(dst) {
+        strncpy(reason, main_errorMessage ? main_errorMessage : (errno ? strerror(errno) : ""), sizeof(reason) - 1);
+        reason[sizeof(reason) - 1] = 0;
+        pthread_mutex_unlock(&disks_mutex);
+        daemon_error(job, dst == 2 ? L_ENCZIPERR : (dst == 3 ? L_CMPZIPERR : (dst == 4 ? L_CMPERR : L_SRCERR)),
+            reason[0] ? reason : NULL);
+    } else {
+        refreshTarget();
+        i = daemon_resolve(job->dev);
+        main_errorMessage = NULL;
+        dst = (int)((long int)disks_open(i, ctx->fileSize));
+        strncpy(reason, main_errorMessage ? main_errorMessage : "", sizeof(reason) - 1);
+        reason[sizeof(reason) - 1] = 0;
+        pthread_mutex_unlock(&disks_mutex);
+        if(dst <= 0)
+            daemon_error(job, dst == -1 ? L_TRGERR : (dst == -2 ? L_UMOUNTERR : (dst == -4 ? L_COMMERR : L_OPENTRGERR)),
+                reason[0] ? reason : NULL);
+        else {
+            /* the verify modes are in the same order as stream_todisk() expects them */
+            if((i = stream_todisk(ctx, (void*)((long int)dst), job->verify, daemon_progress, job)) > 0)
+                daemon_error(job, i, errno ? strerror(errno) : NULL);
+            err = i != 0;
+            disks_close((void*)((long int)dst));
+        }
+        stream_close(ctx);
+    }
+    if(!err) {
+        errno = 0;
+        stream_status(ctx, str, 1);
+    }
+    free(ctx);
+
+end:
+    pthread_mutex_lock(&jobs_mutex);
+    if(job->cancel) job->state = JOB_CANCELLED; else
+    if(err) job->state = JOB_FAILED;
+    else { job->state = JOB_DONE; job->progress = 100; strcpy(job->msg, str); }
+    if(verbose) printf("Job %d %s %s\r\n", job->id, job_states[job->state], job->msg);
+    daemon_schedule();
+    pthread_cond_broadcast(&jobs_cond);
+    pthread_mutex_unlock(&jobs_mutex);
+    return NULL;
+}
+
+/**
+ * Add a job to the queue, must be called with jobs_mutex held. Returns NULL if the queue is full
+ */
+static job_t *daemon_queue(char *target, int verify, char *image)
+{
+    job_t *job = &jobs[(lastId + 1) % DAEMON_JOBS];
+
+    if(job->state == JOB_QUEUED || job->state == JOB_RUNNING) return NULL;
+    memset(job, 0, sizeof(job_t));
+    job->id = ++lastId;
+    if(lastId - firstId >= DAEMON_JOBS) firstId = lastId - DAEMON_JOBS + 1;
+    job->state = JOB_QUEUED;
+    job->verify = verify;
+    strcpy(job->target, target);
+    strcpy(job->image, image);
+    return job;
+}
+
+/**
+ * Case insensitive substring match, a '_' in the filter matches a space too (the protocol is space separated)
+ */
+static int daemon_contains(char *str, char *filter)
+{
+    int i, l = strlen(filter);
+    char a, b;
+
+    for(; l && *str; str++) {
+        for(i = 0; i < l && str[i]; i++) {
+            a = str[i]; b = filter[i];
+            if(a >= 'A' && a <= 'Z') a += 'a' - 'A';
+            if(b >= 'A' && b <= 'Z') b += 'a' - 'A';
+            if(a != b && (b != '_' || a != ' ')) break;
+        }
+        if(i == l) return 1;
+    }
+    return !l;
+}
+
+/**
+ * Check a target list entry against the arm mode's filter, the vendor, model and size that disks_refreshlist() reads
+ */
+static int daemon_match(int i)
+{
+    char path[64], dev[32], vendor[128], model[128];
+
+    targetName(i, dev);
+    sprintf(path, "/sys/block/%s/device/vendor", dev);
+    filegetcontent(path, vendor, sizeof(vendor));
+    sprintf(path, "/sys/block/%s/device/model", dev);
+    filegetcontent(path, model, sizeof(model));
+    return daemon_contains(vendor, arm.vendor) && daemon_contains(model, arm.model) &&
+        (!arm.min || disks_capacity[i] >= arm.min) && (!arm.max || disks_capacity[i] <= arm.max);
+}
+
+/**
+ * Queue a job for every disk plugged in since the last time that matches the arm mode's filter.
+ * Must be called with both mutexes held and an up-to-date list
+ */
+static void daemon_armscan(void)
+{
+    char dev[32];
+    int i, j;
+    job_t *job;
+
+    if(arm.state == ARM_OFF) return;
+    /* forget the disks that were removed, so that they're written again when they're plugged back in. A card
+     * reader without a card is there with zero size, so inserting a card counts as plugging in a disk */
+    for(j = 0; j < numSeen;) {
+        for(i = 0; i < numTargetList; i++) {
+            targetName(i, dev);
+            if(disks_capacity[i] && !strcmp(dev, seen[j])) break;
+        }
+        if(i < numTargetList) j++;
+        else memmove(seen[j], seen[j + 1], (--numSeen - j) * sizeof(seen[0]));
+    }
+    /* the ones plugged in while the image is being decoded are written once it's ready */
+    if(arm.state != ARM_ON) return;
+    for(i = 0; i < numTargetList; i++) {
+        if(!disks_capacity[i]) continue;
+        targetName(i, dev);
+        for(j = 0; j < numSeen && strcmp(dev, seen[j]); j++);
+        if(j < numSeen || numSeen >= DISKS_MAX) continue;
+        strcpy(seen[numSeen++], dev);
+        if(!daemon_match(i)) {
+            if(verbose) printf("Armed, %s does not match the filter\r\n", targetList[i]);
+            continue;
+        }
+        if((job = daemon_queue(dev, arm.verify, arm.path))) {
+            job->armed = 1;
+            if(verbose) printf("Armed, queued job %d for %s\r\n", job->id, targetList[i]);
+        }
+    }
+}
+
+/**
+ * Turn off the arm mode, cancel its jobs that haven't started yet and delete the decoded copy
+ * must be called with jobs_mutex held
+ */
+static void daemon_disarm(void)
+{
+    int i;
+
+    for(i = firstId; i <= lastId; i++)
+        if(jobs[i % DAEMON_JOBS].armed && jobs[i % DAEMON_JOBS].state == JOB_QUEUED)
+            jobs[i % DAEMON_JOBS].state = JOB_CANCELLED;
+    /* the running jobs have it open already, they can finish */
+    if(arm.path[0] && strcmp(arm.path, arm.image)) unlink(arm.path);
+    arm.state = ARM_OFF;
+    arm.path[0] = 0;
+    pthread_cond_broadcast(&jobs_cond);
+}
+
+/**
+ * Decode the image once into a raw, sparse file in the cache directory, so that the disks are written from that
+ * through the raw image fast path instead of decompressing it again and again. Raw images are used as they are.
+ * Returns 0 on success, otherwise the error is in msg
+ */
+static int daemon_decode(char *image, char *path, int num, char *msg)
+{
+    stream_t *ctx;
+    char tmp[PATH_MAX + 8];
+    int fd = -1, n, ret = -1;
+
+    if(!(ctx = (stream_t*)calloc(1, sizeof(stream_t)))) { strcpy(msg, strerror(errno)); return -1; }
+    pthread_mutex_lock(&disks_mutex);
+    errno = 0;
+    main_errorMessage = NULL;
+    if((n = stream_open(ctx, image, 0))) {
+        snprintf(msg, 256, "%s %s", lang[n == 2 ? L_ENCZIPERR : (n == 3 ? L_CMPZIPERR : (n == 4 ? L_CMPERR : L_SRCERR))],
+            main_errorMessage ? main_errorMessage : (errno ? strerror(errno) : ""));
+        pthread_mutex_unlock(&disks_mutex);
+        free(ctx);
+        return -1;
+    }
+    pthread_mutex_unlock(&disks_mutex);
+    if(ctx->type == TYPE_PLAIN && !ctx->bmap) {
+        strcpy(path, image);
+        ret = 0;
+        goto end;
+    }
+    mkdir(cachedir, 0750);
+    snprintf(path, PATH_MAX, "%s/armed-%d-%d.img", cachedir, (int)getpid(), num);
+    sprintf(tmp, "%s.tmp", path);
+    if((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0640)) < 0) {
+        snprintf(msg, 256, "%.200s: %s", tmp, strerror(errno));
+        goto end;
+    }
+    if(verbose) printf("Decoding '%s' to '%s'\r\n", image, path);
+    /* holes and runs of zeros are left as holes in the file, the disks get them zeroed out the same way */
+    while((n = stream_read(ctx)) > 0)
+        if((!ctx->zeroSize || ctx->zeroOffs + ctx->zeroSize < ctx->readSize) &&
+          pwrite(fd, ctx->buffer, n, ctx->readSize - n) != n) break;
+    if(n) {
+        snprintf(msg, 256, "%s %s", lang[n < 0 ? L_RDSRCERR : L_WRTRGERR], errno ? strerror(errno) : "");
+        goto end;
+    }
+    if(ftruncate(fd, ctx->fileSize ? ctx->fileSize : ctx->readSize) || close(fd) || rename(tmp, path)) {
+        fd = -1;
+        snprintf(msg, 256, "%.200s: %s", path, strerror(errno));
+        goto end;
+    }
+    fd = -1;
+    ret = 0;
+end:
+    if(fd >= 0) { close(fd); unlink(tmp); }
+    stream_close(ctx);
+    free(ctx);
+    return ret;
+}
+
+/**
+ * Print the arm mode's state
+ */
+static void daemon_armstatus(int fd)
+{
+    if(arm.state == ARM_OFF)
+        dprintf(fd, "disarmed\n");
+    else
+        dprintf(fd, "%s %s%s%s %s\n", arm.state == ARM_ON ? "armed" : "decoding", verify_modes[arm.verify],
+            arm.filter[0] ? " " : "", arm.filter, arm.image);
+}
+
+/**
+ * Start the queued jobs whose disk is present, in the order they were queued, but never more than perhost
+ * on the same host controller and only one on a disk. Jobs on other controllers are started even if an older
+ * one has to wait, so every controller is kept busy. Must be called with jobs_mutex held
+ */
+static void daemon_schedule(void)
+{
+    int id, i, j, n;
+    job_t *job;
+    pthread_t t;
+    char port[32], serial[128];
+
+    if(quit) return;
+    pthread_mutex_lock(&disks_mutex);
+    refreshTarget();
+    daemon_armscan();
+    for(id = firstId; id <= lastId; id++) {
+        job = &jobs[id % DAEMON_JOBS];
+        if(job->state != JOB_QUEUED) continue;
+        if((i = daemon_resolve(job->target)) < 0) {
+            strcpy(job->msg, "no such disk (yet)");
+            continue;
+        }
+        targetName(i, job->dev);
+        daemon_topology(job->dev, port, serial, job->host);
+        for(j = firstId, n = 0; j <= lastId; j++)
+            if(jobs[j % DAEMON_JOBS].state == JOB_RUNNING) {
+                if(!strcmp(jobs[j % DAEMON_JOBS].dev, job->dev)) break;
+                if(!strcmp(jobs[j % DAEMON_JOBS].host, job->host)) n++;
+            }
+        if(j <= lastId || n >= perhost) {
+            job->msg[0] = 0;
+            continue;
+        }
+        job->state = JOB_RUNNING;
+        job->msg[0] = 0;
+        if(verbose) printf("Job %d starting on %s, port %s, host %s (%d busy)\r\n", job->id, job->dev, port, job->host, n);
+        if(pthread_create(&t, NULL, daemon_writer, job)) {
+            job->state = JOB_FAILED;
+            strcpy(job->msg, strerror(errno));
+        } else
+            pthread_detach(t);
+    }
+    pthread_mutex_unlock(&disks_mutex);
+}
+
+/**
+ * Print a job's status line: id, state, target, disk, progress and message
+ */
+static void daemon_status(int fd, job_t *job)
+{
+    dprintf(fd, "%d %s %s %s %d%% %s\n", job->id, job_states[job->state], job->target,
+        job->dev[0] ? job->dev : "-", job->progress, job->msg);
+}
+
+/**
+ * Return a remembered job by id, must be called with jobs_mutex held
+ */
+static job_t *daemon_job(char *s)
+{
+    int id = atoi(s);
+
+    return id >= firstId && id <= lastId && jobs[id % DAEMON_JOBS].id == id ? &jobs[id % DAEMON_JOBS] : NULL;
+}
+
+/**
+ * Serve one connection, one command per connection:
+ *   list                               disks that can be written: name, port, serial, host, description
+ *   write (target) (none|verify|readback) (image)
+ *   status [id]
+ *   wait (id)                          returns the status once the job has finished
+ *   cancel (id)
+ *   arm [(none|verify|readback) [vendor=(str)] [model=(str)] [min=(GiB)] [max=(GiB)] (image)]
+ *   disarm
+ */
+static void *daemon_client(void *data)
+{
+    int fd = (int)((long int)data), i, l = 0, r;
+    char cmd[PATH_MAX + 256], dev[32], port[32], serial[128], host[256], msg[256], *c, *target, *mode, *image;
+    job_t *job;
+    arm_t *a;
+
+    while(l < (int)sizeof(cmd) - 1 && (r = read(fd, cmd + l, sizeof(cmd) - 1 - l)) > 0) {
+        l += r;
+        if(memchr(cmd, '\n', l)) break;
+    }
+    cmd[l] = 0;
+    for(c = cmd; *c && *c != '\r' && *c != '\n'; c++);
+    *c = 0;
+    if(verbose > 1) printf("Command '%s'\r\n", cmd);
+    if(!strcmp(cmd, "list")) {
+        pthread_mutex_lock(&disks_mutex);
+        refreshTarget();
+        for(i = 0; i < numTargetList; i++) {
+            targetName(i, dev);
+            daemon_topology(dev, port, serial, host);
+            dprintf(fd, "%s %s %s %s%s\n", dev, port[0] ? port : "-", serial[0] ? serial : "-", host,
+                targetList[i] + strlen(dev));
+        }
+        pthread_mutex_unlock(&disks_mutex);
+    } else
+    if(!memcmp(cmd, "write ", 6)) {
+        target = cmd + 6; while(*target == ' ') target++;
+        for(mode = target; *mode && *mode != ' '; mode++);
+        if(*mode) *mode++ = 0;
+        for(image = mode; *image && *image != ' '; image++);
+        if(*image) *image++ = 0;
+        for(i = 0; i < 3 && strcmp(mode, verify_modes[i]); i++);
+        if(!*target || strlen(target) > 127 || i == 3 || *image != '/' || strlen(image) >= PATH_MAX)
+            dprintf(fd, "error usage: write (target) (none|verify|readback) (absolute path of image)\n");
+        else {
+            pthread_mutex_lock(&jobs_mutex);
+            if(!(job = daemon_queue(target, i, image)))
+                dprintf(fd, "error too many jobs\n");
+            else {
+                dprintf(fd, "queued %d\n", job->id);
+                daemon_schedule();
+            }
+            pthread_mutex_unlock(&jobs_mutex);
+        }
+    } else
+    if(!strcmp(cmd, "status")) {
+        pthread_mutex_lock(&jobs_mutex);
+        for(i = firstId; i <= lastId; i++)
+            if(jobs[i % DAEMON_JOBS].state != JOB_FREE) daemon_status(fd, &jobs[i % DAEMON_JOBS]);
+        pthread_mutex_unlock(&jobs_mutex);
+    } else
+    if(!memcmp(cmd, "status ", 7) || !memcmp(cmd, "wait ", 5) || !memcmp(cmd, "cancel ", 7)) {
+        pthread_mutex_lock(&jobs_mutex);
+        if(!(job = daemon_job(strchr(cmd, ' ') + 1)))
+            dprintf(fd, "error no such job\n");
+        else
+        switch(cmd[0]) {
+            case 'w':
+                /* the slot might be reused while waiting, but not before the job has finished */
+                while(job->state == JOB_QUEUED || job->state == JOB_RUNNING)
+                    pthread_cond_wait(&jobs_cond, &jobs_mutex);
+                daemon_status(fd, job);
+            break;
+            case 'c':
+                if(job->state == JOB_QUEUED) {
+                    job->state = JOB_CANCELLED;
+                    pthread_cond_broadcast(&jobs_cond);
+                }
+                /* a running job notices this before its next chunk */
+                if(job->state == JOB_RUNNING) job->cancel = 1;
+                daemon_status(fd, job);
+            break;
+            default: daemon_status(fd, job); break;
+        }
+        pthread_mutex_unlock(&jobs_mutex);
+    } else
+    if(!strcmp(cmd, "arm")) {
+        pthread_mutex_lock(&jobs_mutex);
+        daemon_armstatus(fd);
+        pthread_mutex_unlock(&jobs_mutex);
+    } else
+    if(!memcmp(cmd, "arm ", 4)) {
+        if(!(a = (arm_t*)calloc(1, sizeof(arm_t)))) {
+            dprintf(fd, "error %s\n", strerror(errno));
+            close(fd);
+            return NULL;
+        }
+        for(mode = cmd + 4; *mode == ' '; mode++);
+        for(c = mode; *c && *c != ' '; c++);
+        if(*c) *c++ = 0;
+        for(a->verify = 0; a->verify < 3 && strcmp(mode, verify_modes[a->verify]); a->verify++);
+        /* filters until the image, which is an absolute path */
+        for(i = 0; *c && *c != '/';) {
+            for(target = c; *c && *c != ' '; c++);
+            if(*c) *c++ = 0;
+            if(!memcmp(target, "vendor=", 7) && strlen(target) < 7 + sizeof(a->vendor)) strcpy(a->vendor, target + 7); else
+            if(!memcmp(target, "model=", 6) && strlen(target) < 6 + sizeof(a->model)) strcpy(a->model, target + 6); else
+            if(!memcmp(target, "min=", 4)) a->min = (uint64_t)(strtod(target + 4, NULL) * 1073741824.0); else
+            if(!memcmp(target, "max=", 4)) a->max = (uint64_t)(strtod(target + 4, NULL) * 1073741824.0); else
+            if(*target) { i = 1; break; }
+            l = strlen(a->filter);
+            snprintf(a->filter + l, sizeof(a->filter) - l, "%s%s", l ? " " : "", target);
+        }
+        if(a->verify == 3 || i || *c != '/' || strlen(c) >= PATH_MAX)
+            dprintf(fd, "error usage: arm (none|verify|readback) [vendor=(str)] [model=(str)] [min=(GiB)] [max=(GiB)] "
+                "(absolute path of image)\n");
+        else {
+            strcpy(a->image, c);
+            pthread_mutex_lock(&jobs_mutex);
+            if(arm.state == ARM_DECODING) {
+                pthread_mutex_unlock(&jobs_mutex);
+                dprintf(fd, "error busy decoding\n");
+            } else {
+                daemon_disarm();
+                a->state = ARM_DECODING;
+                a->num = arm.num + 1;
+                memcpy(&arm, a, sizeof(arm_t));
+                /* the disks that are plugged in already aren't written */
+                pthread_mutex_lock(&disks_mutex);
+                refreshTarget();
+                for(i = numSeen = 0; i < numTargetList; i++)
+                    if(disks_capacity[i]) targetName(i, seen[numSeen++]);
+                pthread_mutex_unlock(&disks_mutex);
+                pthread_mutex_unlock(&jobs_mutex);
+                r = daemon_decode(a->image, a->path, a->num, msg);
+                pthread_mutex_lock(&jobs_mutex);
+                if(arm.state != ARM_DECODING || arm.num != a->num) {
+                    /* disarmed in the meantime */
+                    if(!r && strcmp(a->path, a->image)) unlink(a->path);
+                    dprintf(fd, "error disarmed\n");
+                } else
+                if(r) {
+                    arm.state = ARM_OFF;
+                    dprintf(fd, "error %s\n", msg);
+                } else {
+                    strcpy(arm.path, a->path);
+                    arm.state = ARM_ON;
+                    daemon_armstatus(fd);
+                    daemon_schedule();
+                }
+                pthread_mutex_unlock(&jobs_mutex);
+            }
+        }
+        free(a);
+    } else
+    if(!strcmp(cmd, "disarm")) {
+        pthread_mutex_lock(&jobs_mutex);
+        daemon_disarm();
+        daemon_armstatus(fd);
+        pthread_mutex_unlock(&jobs_mutex);
+    } else
+        dprintf(fd, "error unknown command\n");
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Connect to the socket, or return -1
+ */
+static int daemon_connect(void)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sockpath, sizeof(addr.sun_path) - 1);
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return -1;
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr))) { close(fd); return -1; }
+    return fd;
+}
+
+/**
+ * Send a command to the running daemon and print its reply. Returns the exit code: 1 if the
+ * command failed, or if the job it reports on has failed or was cancelled
+ */
+static int daemon_command(int argc, char **argv)
+{
+    char cmd[PATH_MAX + 256], image[PATH_MAX], buf[4096];
+    int fd, i, l = 0, r, ret = 0, first = 1;
+
+    /* the daemon has a different working directory, so send an absolute path */
+    if(((argc > 3 && !strcmp(argv[0], "write")) || (argc > 2 && !strcmp(argv[0], "arm"))) &&
+      realpath(argv[argc - 1], image)) argv[argc - 1] = image;
+    for(i = 0; i < argc; i++)
+        l += snprintf(cmd + l, sizeof(cmd) - 2 - l, "%s%s", i ? " " : "", argv[i]);
+    strcpy(cmd + l, "\n");
+    if((fd = daemon_connect()) < 0) {
+        fprintf(stderr, "usbimager: %s: %s\r\n", sockpath, strerror(errno));
+        return 1;
+    }
+    if(write(fd, cmd, l + 1) != l + 1) { close(fd); return 1; }
+    shutdown(fd, SHUT_WR);
+    while((r = read(fd, buf, sizeof(buf) - 1)) > 0) {
+        buf[r] = 0;
+        if(first && (!memcmp(buf, "error", 5) || strstr(buf, " failed ") || strstr(buf, " cancelled "))) ret = 1;
+        first = 0;
+        fwrite(buf, r, 1, stdout);
+    }
+    close(fd);
+    return ret;
+}
+
+static void sighandler(int signal)
+{
+    (void)signal;
+    quit = 1;
+}
+
+int main(int argc, char **argv)
+{
+    int i, j, fd, hotplugfd, cachemax = 0;
+    char *lc = getenv("LANG");
+    struct sockaddr_un addr;
+    struct pollfd pfd[2];
+    struct stat st;
+    struct group *gr;
+    pthread_t t;
+    char help[] = "USBImager " USBIMAGER_VERSION
+#ifdef USBIMAGER_BUILD
+        " (build " USBIMAGER_BUILD ")"
+#endif
+        " - MIT license, Copyright (C) 2020 bzt\r\n\r\n"
+        "./usbimager [-v|-vv|-a|-f|-d|-w|-z|-c(algo)|-1|-2|-3|-4|-5|-6|-7|-8|-9|-L(xx)|-m(x)|-j(n)|-p(socket)|-g(group)|-C(dir)|-K(GiB)] [command]\r\n\r\n"
+        "Without a command, runs as a daemon and takes the commands on the socket (" DAEMON_SOCKET "):\r\n"
+        "  list                                        list the disks: name, USB port, serial, host controller\r\n"
+        "  write (target) (none|verify|readback) (image)  queue a job, target is a name, USB port or serial\r\n"
+        "  status [id]                                 show the jobs\r\n"
+        "  wait (id)                                   wait for a job to finish\r\n"
+        "  cancel (id)                                 cancel a job\r\n"
+        "  arm (none|verify|readback) [vendor=(str)] [model=(str)] [min=(GiB)] [max=(GiB)] (image)\r\n"
+        "                                              write every newly plugged in disk that matches\r\n"
+        "  disarm                                      stop writing new disks\r\n\r\n"
+        "https://gitlab.com/bztsrc/usbimager\r\n\r\n";
+
+    for(j = 1; j < argc && argv[j] && argv[j][0] == '-'; j++) {
+        if(!strcmp(argv[j], "--version")) {
+            printf(USBIMAGER_VERSION "\n");
+            exit(0);
+        }
+        if(!strcmp(argv[j], "--help")) {
+            printf("%s", help);
+            exit(0);
+        }
+        for(i = 1; argv[j][i]; i++)
+            switch(argv[j][i]) {
+                case 'f': force++; break;
+                case 'v':
+                    verbose++;
+                    if(verbose == 1) printf("%s", help);
+                break;
+                case 'a': disks_all = 1; break;
+                case 'd': disks_mode = DISKS_DIRECT; break;
+                case 'w': disks_mode = DISKS_WINDOW; break;
+                case 'z': disks_skipzero = 1; break;
+                case 'c': i += stream_checksum(argv[j] + i + 1); break;
+                case '1': buffer_size = 2*1024*1024; break;
+                case '2': buffer_size = 4*1024*1024; break;
+                case '3': buffer_size = 8*1024*1024; break;
+                case '4': buffer_size = 16*1024*1024; break;
+                case '5': buffer_size = 32*1024*1024; break;
+                case '6': buffer_size = 64*1024*1024; break;
+                case '7': buffer_size = 128*1024*1024; break;
+                case '8': buffer_size = 256*1024*1024; break;
+                case '9': buffer_size = 512*1024*1024; break;
+                case 'L': lc = &argv[j][++i]; ++i; break;
+                case 'm': disks_maxsize = atoi(&argv[j][++i]); i = strlen(argv[j]) - 1; break;
+                case 'j': perhost = atoi(&argv[j][++i]); if(perhost < 1) perhost = 1; i = strlen(argv[j]) - 1; break;
+                case 'p': sockpath = &argv[j][++i]; i = strlen(argv[j]) - 1; break;
+                case 'g': sockgroup = &argv[j][++i]; i = strlen(argv[j]) - 1; break;
+                case 'C': cachedir = &argv[j][++i]; i = strlen(argv[j]) - 1; break;
+                case 'K': cachemax = atoi(&argv[j][++i]); if(cachemax < 1) cachemax = STREAM_CACHEMAX; i = strlen(argv[j]) - 1; break;
+            }
+    }
+
+    if(!lc) lc = "en";
+    for(i = 0; i < NUMLANGS; i++) {
+        if(!memcmp(lc, dict[i][0], strlen(dict[i][0]))) {
+            lang = &dict[i][1];
+            break;
+        }
+    }
+    if(!lang) lang = &dict[0][1];
+
+    /* the rest of the arguments is a command for the daemon */
+    if(j < argc) return daemon_command(argc - j, argv + j);
+
+    if(verbose) {
+        printf("LANG '%s', dict '%s', buffer_size %d MiB, force %d, mode %d\r\n",
+            lc, lang[-1], buffer_size/1024/1024, force, disks_mode);
+        printf("disks_maxsize %d GiB, socket '%s', %d jobs per host controller\r\n", disks_maxsize, sockpath, perhost);
+    }
+    if(cachemax) stream_cache(cachedir, cachemax);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sockpath, sizeof(addr.sun_path) - 1);
+    /* only remove the socket if it's a leftover, not if there's a daemon listening on it */
+    if(!stat(sockpath, &st)) {
+        if(!S_ISSOCK(st.st_mode) || (fd = daemon_connect()) >= 0) {
+            fprintf(stderr, "usbimager: %s: %s\r\n", sockpath, strerror(EADDRINUSE));
+            return 1;
+        }
+        unlink(sockpath);
+    }
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+      listen(fd, 16)) {
+        fprintf(stderr, "usbimager: %s: %s\r\n", sockpath, strerror(errno));
+        return 1;
+    }
+    /* whoever can write the disks (the disk group) can submit jobs */
+    if(!(gr = getgrnam(sockgroup)) || chown(sockpath, -1, gr->gr_gid))
+        fprintf(stderr, "usbimager: %s: unable to set group '%s'\r\n", sockpath, sockgroup);
+    chmod(sockpath, 0660);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+    kernels_init();
+    /* queued jobs start as soon as their disk is plugged in */
+    hotplugfd = disks_hotplugstart();
+    pfd[0].fd = fd; pfd[0].events = POLLIN;
+    pfd[1].fd = hotplugfd; pfd[1].events = POLLIN;
+    while(!quit) {
+        /* without hotplug events, look for new disks every second. The timeout also lets us notice quit */
+        if(poll(pfd, hotplugfd >= 0 ? 2 : 1, 1000) < 0) continue;
+        if(pfd[0].revents & POLLIN) {
+            if((i = accept(fd, NULL, NULL)) >= 0) {
+                if(pthread_create(&t, NULL, daemon_client, (void*)((long int)i))) close(i);
+                else pthread_detach(t);
+            }
+        }
+        if(hotplugfd >= 0) {
+            if(!(pfd[1].revents & POLLIN)) continue;
+            pthread_mutex_lock(&disks_mutex);
+            i = disks_hotplug();
+            pthread_mutex_unlock(&disks_mutex);
+            if(!i) continue;
+        } else
+        if(pfd[0].revents & POLLIN) continue;
+        pthread_mutex_lock(&jobs_mutex);
+        daemon_schedule();
+        pthread_mutex_unlock(&jobs_mutex);
+    }
+
+    /* cancel everything and wait for the running jobs to close their disks */
+    if(verbose) printf("Shutting down\r\n");
+    close(fd);
+    unlink(sockpath);
+    pthread_mutex_lock(&jobs_mutex);
+    daemon_disarm();
+    for(i = firstId; i <= lastId; i++) {
+        if(jobs[i % DAEMON_JOBS].state == JOB_QUEUED) jobs[i % DAEMON_JOBS].state = JOB_CANCELLED;
+        if(jobs[i % DAEMON_JOBS].state == JOB_RUNNING) jobs[i % DAEMON_JOBS].cancel = 1;
+    }
+    pthread_cond_broadcast(&jobs_cond);
+    while(1) {
+        for(i = firstId; i <= lastId && jobs[i % DAEMON_JOBS].state != JOB_RUNNING; i++);
+        if(i > lastId) break;
+        pthread_cond_wait(&jobs_cond, &jobs_mutex);
+    }
+    pthread_mutex_unlock(&jobs_mutex);
+    return 0;
+}
@@ -36,6 +36,7 @@
 #include "lang.h"
 #include "stream.h"
 #include "disks.h"
+#include "kernels.h"
 
 char **lang = NULL;
 extern char *dict[NUMLANGS][NUMTEXTS + 1];
@@ -142,13 +143,22 @@ void main_onThreadError(void *data)
 }
 
 
+/**
+ * Progress callback of stream_todisk(), writing is cancelled when the window is closed
+ */
+static int writerProgress(void *data, stream_t *ctx)
+{
+    (void)data;
+    main_onProgress(ctx);
+    return !mainwin;
+}
+
 /**
  * Function that reads from input and writes to disk
  */
 static void *writerRoutine(void *data)
 {
-    int dst, needVerify, numberOfBytesRead;
-    int numberOfBytesWritten, numberOfBytesVerify, needWrite, targetId = gtk_combo_box_get_active(GTK_COMBO_BOX(target));
+    int dst, needVerify, ret, readBack, targetId = gtk_combo_box_get_active(GTK_COMBO_BOX(target));
     static char lpStatus[128];
     static stream_t ctx;
     (void)data;
@@ -163,51 +173,11 @@ static void *writerRoutine(void *data)
     if(!dst) {
         dst = (int)((long int)disks_open(targetId, ctx.fileSize));
         if(dst > 0) {
-            while(mainwin) {
-                if((numberOfBytesRead = stream_read(&ctx)) >= 0) {
-                    if(numberOfBytesRead == 0) {
-                        if(!ctx.fileSize) ctx.fileSize = ctx.readSize;
-                        break;
-                    } else {
-                        errno = 0; needWrite = 1; numberOfBytesVerify = 0;
-                        if(!force) {
-                            numberOfBytesVerify = read(dst, ctx.verifyBuf, numberOfBytesRead);
-                            if(numberOfBytesVerify == numberOfBytesRead &&
-                                !memcmp(ctx.buffer, ctx.verifyBuf, numberOfBytesRead)) {
-                                if(verbose > 1) printf("  numberOfBytesVerify %d matches disk, skipping write\n", numberOfBytesRead);
-                                needWrite = 0;
-                                main_onProgress(&ctx);
-                            } else
-                                lseek(dst, -((off_t)numberOfBytesVerify), SEEK_CUR);
-                        }
-                        if(needWrite) {
-                            numberOfBytesWritten = (int)write(dst, ctx.buffer, numberOfBytesRead);
-                            if(verbose > 1) printf("write(%d) numberOfBytesWritten %d errno=%d\n",
-                                numberOfBytesRead, numberOfBytesWritten, errno);
-                            if(numberOfBytesWritten == numberOfBytesRead) {
-                                if(needVerify) {
-                                    lseek(dst, -((off_t)numberOfBytesWritten), SEEK_CUR);
-                                    numberOfBytesVerify = read(dst, ctx.verifyBuf, numberOfBytesWritten);
-                                    if(verbose > 1) printf("  numberOfBytesVerify %d\n", numberOfBytesVerify);
-                                    if(numberOfBytesVerify != numberOfBytesWritten ||
-                                        memcmp(ctx.buffer, ctx.verifyBuf, numberOfBytesWritten)) {
-                                            onThreadError(lang[L_VRFYERR]);
-                                        break;
-                                    }
-                                }
-                                main_onProgress(&ctx);
-                            } else {
-                                if(errno) main_errorMessage = strerror(errno);
-                                main_onThreadError(lang[L_WRTRGERR]);
-                                break;
-                            }
-                        }
-                        stream_hash(&ctx, numberOfBytesVerify);
-                    }
-                } else {
-                    main_onThreadError(lang[L_RDSRCERR]);
-                    break;
-                }
+            /* with read-back, chunks are only hashed here and checked all at once after the last write */
+            readBack = needVerify && disks_readback && !(targetId >= 0 && targetId < DISKS_MAX && disks_targets[targetId] >= 1024);
+            if((ret = stream_todisk(&ctx, (void*)((long int)dst), needVerify ? (readBack ? 2 : 1) : 0, writerProgress, NULL)) > 0) {
+                if(errno) main_errorMessage = strerror(errno);
+                main_onThreadError(lang[ret]);
             }
             disks_close((void*)((long int)dst));
         } else {
@@ -299,7 +269,7 @@ static void *readerRoutine(void *data)
             while(mainwin && ctx.readSize < ctx.fileSize) {
                 errno = 0;
                 size = ctx.fileSize - ctx.readSize < (uint64_t)buffer_size ? (int)(ctx.fileSize - ctx.readSize) : buffer_size;
-                numberOfBytesRead = (int)read(src, ctx.buffer, size);
+                numberOfBytesRead = disks_read((void*)((long int)src), ctx.readSize, ctx.buffer, size);
                 if(verbose > 1) printf("read(%d) numberOfBytesRead %d errno=%d\n", size, numberOfBytesRead, errno);
                 if(numberOfBytesRead == size) {
                     if(stream_write(&ctx, ctx.buffer, size)) {
@@ -454,7 +424,7 @@ int main(int argc, char **argv)
         " (build " USBIMAGER_BUILD ")"
 #endif
         " - MIT license, Copyright (C) 2020 bzt\r\n\r\n"
-        "./usbimager [-v|-vv|-a|-f|-s[baud]|-S[baud]|-1|-2|-3|-4|-5|-6|-7|-8|-9|-L(xx)|-m(x)] <backup path>\r\n\r\n"
+        "./usbimager [-v|-vv|-a|-f|-d|-w|-z|-r|-c(algo)|-K[GiB]|-s[baud]|-S[baud]|-1|-2|-3|-4|-5|-6|-7|-8|-9|-L(xx)|-m(x)] <backup path>\r\n\r\n"
         "https://gitlab.com/bztsrc/usbimager\r\n\r\n";
 
     for(j = 1; j < argc && argv[j]; j++) {
@@ -489,6 +459,15 @@ int main(int argc, char **argv)
                         }
                         break;
                     case 'a': disks_all = 1; break;
+                    case 'd': disks_mode = DISKS_DIRECT; break;
+                    case 'w': disks_mode = DISKS_WINDOW; break;
+                    case 'z': disks_skipzero = 1; break;
+                    case 'r': disks_readback = 1; break;
+                    case 'c': i += stream_checksum(argv[j] + i + 1); break;
+                    case 'K':
+                        stream_cache(NULL, atoi(argv[j] + i + 1));
+                        while(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') i++;
+                        break;
                     case '1': blksizesel = 1; buffer_size = 2*1024*1024; break;
                     case '2': blksizesel = 2; buffer_size = 4*1024*1024; break;
                     case '3': blksizesel = 3; buffer_size = 8*1024*1024; break;
@@ -518,8 +497,8 @@ int main(int argc, char **argv)
     if(!lang) lang = &dict[0][1];
 
     if(verbose) {
-        printf("LANG '%s', dict '%s', serial %d, buffer_size %d MiB, force %d\r\n",
-            lc, lang[-1], disks_serial, buffer_size/1024/1024, force);
+        printf("LANG '%s', dict '%s', serial %d, buffer_size %d MiB, force %d, mode %d\r\n",
+            lc, lang[-1], disks_serial, buffer_size/1024/1024, force, disks_mode);
         printf("disks_maxsize %d GiB\r\n", disks_maxsize);
         if(disks_serial) printf("Serial %d,8,n,1\r\n", baud);
 #if !defined(USE_WRONLY) || !USE_WRONLY
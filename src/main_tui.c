@@ -34,12 +34,14 @@
 #include <errno.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/select.h>
 #include <fcntl.h>
 #include <termios.h>
 #include <dirent.h>
 #include "lang.h"
 #include "stream.h"
 #include "disks.h"
+#include "kernels.h"
 
 #if !defined(USE_WRONLY) || !USE_WRONLY
 #define NUMFLD 6
@@ -62,10 +64,11 @@ static char *bkpdir = NULL;
 static int blksizesel = 0;
 char *main_errorMessage = NULL;
 static char source[PATH_MAX], targetList[DISKS_MAX][128], *targetPtr[DISKS_MAX], status[128];
+static char targetMark[DISKS_MAX], targetLabel[128];    /* targets marked with Space in the list are written at once */
 static char path[PATH_MAX];
 
 struct termios otio, ntio;
-int flg, needVerify = 1, needCompress = 0, progress = 0, numTargetList = 0, targetId = 0;
+int flg, needVerify = 1, needCompress = 0, progress = 0, numTargetList = 0, targetId = 0, hotplugfd = -1;
 int sorting = 0, numFiles = 0;
 filelist_t *files = NULL;
 
@@ -167,6 +170,8 @@ void setupstdin(void)
     ntio = otio;
     ntio.c_lflag &= (~ICANON & ~ECHO);
     tcsetattr(0, TCSANOW, &ntio);
+    /* no stdio buffering, so that select() on the descriptor tells if there's a key waiting */
+    setvbuf(stdin, NULL, _IONBF, 0);
 }
 
 char getcsi(void)
@@ -262,7 +267,7 @@ void drawtext(char *s, int w)
     for(; i < w; i++) printf(" ");
 }
 
-void drawselect(char **list, int len, int x, int y, int w, int curr)
+void drawselect(char **list, char *marks, int len, int x, int y, int w, int curr)
 {
     int h, i;
 
@@ -275,7 +280,7 @@ void drawselect(char **list, int len, int x, int y, int w, int curr)
     drawboxtop(x,y,w,0,1,"0;37");
     for(i = 0; i < chkh; i++) {
         drawline(x,y+1+i,w,chkscr+i==curr,1,"37;44;1","0;37");
-        printf("%s",list?list[chkscr+i]:"?");
+        printf("%s%s",marks?(marks[chkscr+i]?"* ":"  "):"",list?list[chkscr+i]:"?");
     }
     drawboxbtm(x,y+h-1,w,1,"0;37");
     drawshd(x,y+h,w);
@@ -439,13 +444,22 @@ void main_onError(char *msg)
     }
 }
 
+/**
+ * Progress callback of stream_todisk(), writing can't be cancelled here
+ */
+static int writerProgress(void *data, stream_t *ctx)
+{
+    (void)data;
+    main_onProgress(ctx);
+    return 0;
+}
+
 /**
  * Function that reads from input and writes to disk
  */
 static void *writerRoutine(void)
 {
-    int dst, numberOfBytesRead;
-    int numberOfBytesWritten, numberOfBytesVerify, needWrite;
+    int dst, ret, readBack;
     static stream_t ctx;
 
     ctx.readSize = 0;
@@ -453,51 +467,11 @@ static void *writerRoutine(void)
     if(!dst) {
         dst = (int)((long int)disks_open(targetId, ctx.fileSize));
         if(dst > 0) {
-            while(1) {
-                if((numberOfBytesRead = stream_read(&ctx)) >= 0) {
-                    if(numberOfBytesRead == 0) {
-                        if(!ctx.fileSize) ctx.fileSize = ctx.readSize;
-                        break;
-                    } else {
-                        errno = 0; needWrite = 1; numberOfBytesVerify = 0;
-                        if(!force) {
-                            numberOfBytesVerify = read(dst, ctx.verifyBuf, numberOfBytesRead);
-                            if(numberOfBytesVerify == numberOfBytesRead &&
-                                !memcmp(ctx.buffer, ctx.verifyBuf, numberOfBytesRead)) {
-                                if(verbose > 1) printf("  numberOfBytesVerify %d matches disk, skipping write\n", numberOfBytesRead);
-                                needWrite = 0;
-                                main_onProgress(&ctx);
-                            } else
-                                lseek(dst, -((off_t)numberOfBytesVerify), SEEK_CUR);
-                        }
-                        if(needWrite) {
-                            numberOfBytesWritten = (int)write(dst, ctx.buffer, numberOfBytesRead);
-                            if(verbose > 1) printf("write(%d) numberOfBytesWritten %d errno=%d\n",
-                                numberOfBytesRead, numberOfBytesWritten, errno);
-                            if(numberOfBytesWritten == numberOfBytesRead) {
-                                if(needVerify) {
-                                    lseek(dst, -((off_t)numberOfBytesWritten), SEEK_CUR);
-                                    numberOfBytesVerify = read(dst, ctx.verifyBuf, numberOfBytesWritten);
-                                    if(verbose > 1) printf("  numberOfBytesVerify %d\n", numberOfBytesVerify);
-                                    if(numberOfBytesVerify != numberOfBytesWritten ||
-                                        memcmp(ctx.buffer, ctx.verifyBuf, numberOfBytesWritten)) {
-                                        main_onError(lang[L_VRFYERR]);
-                                        break;
-                                    }
-                                }
-                                main_onProgress(&ctx);
-                            } else {
-                                if(errno) main_errorMessage = strerror(errno);
-                                main_onError(lang[L_WRTRGERR]);
-                                break;
-                            }
-                        }
-                        stream_hash(&ctx, numberOfBytesVerify);
-                    }
-                } else {
-                    main_onError(lang[L_RDSRCERR]);
-                    break;
-                }
+            /* with read-back, chunks are only hashed here and checked all at once after the last write */
+            readBack = needVerify && disks_readback && !(targetId >= 0 && targetId < DISKS_MAX && disks_targets[targetId] >= 1024);
+            if((ret = stream_todisk(&ctx, (void*)((long int)dst), needVerify ? (readBack ? 2 : 1) : 0, writerProgress, NULL)) > 0) {
+                if(errno) main_errorMessage = strerror(errno);
+                main_onError(lang[ret]);
             }
             disks_close((void*)((long int)dst));
         } else {
@@ -514,6 +488,60 @@ static void *writerRoutine(void)
     return NULL;
 }
 
+/**
+ * Function that reads from input and writes to all the marked disks at once, decoding it only once
+ */
+static void *duplicatorRoutine(void)
+{
+    int i, num = 0, ret, ok, ids[DISKS_MAX], err[DISKS_MAX];
+    void *dst[DISKS_MAX];
+    static stream_t ctx;
+
+    ctx.readSize = 0;
+    ret = stream_open(&ctx, source, 0);
+    if(!ret) {
+        for(i = 0; i < numTargetList; i++)
+            if(targetMark[i] && disks_targets[i] < 1024) {
+                ret = (int)((long int)disks_open(i, ctx.fileSize));
+                if(ret > 0) {
+                    ids[num] = i;
+                    dst[num++] = (void*)((long int)ret);
+                } else {
+                    main_errorMessage = targetList[i];
+                    main_onError(lang[ret == -1 ? L_TRGERR : (ret == -2 ? L_UMOUNTERR : (ret == -4 ? L_COMMERR : L_OPENTRGERR))]);
+                }
+            }
+        if(num) {
+            if(!stream_dupstart(&ctx, dst, num, needVerify)) {
+                while((ret = stream_dup(&ctx)) > 0)
+                    main_onProgress(&ctx);
+                if(!ctx.fileSize) ctx.fileSize = ctx.readSize;
+                ok = stream_dupend(&ctx, err);
+                /* if the targets were fine, then it was the source */
+                if(ret < 0 && ok) main_onError(lang[L_RDSRCERR]);
+                for(i = 0; i < num; i++)
+                    if(err[i]) {
+                        main_errorMessage = targetList[ids[i]];
+                        main_onError(lang[err[i] == STREAM_DUPVERIFY ? L_VRFYERR : L_WRTRGERR]);
+                    }
+            } else {
+                if(errno) main_errorMessage = strerror(errno);
+                main_onError(lang[L_WRTRGERR]);
+            }
+            for(i = 0; i < num; i++)
+                disks_close(dst[i]);
+        }
+        stream_close(&ctx);
+    } else {
+        if(errno) main_errorMessage = strerror(errno);
+        main_onError(lang[ret == 2 ? L_ENCZIPERR : (ret == 3 ? L_CMPZIPERR : (ret == 4 ? L_CMPERR : L_SRCERR))]);
+    }
+    stream_status(&ctx, status, 1);
+    if(verbose) printf("Worker thread finished.\r\n");
+    col = 0; mainRedraw();
+    return NULL;
+}
+
 #if !defined(USE_WRONLY) || !USE_WRONLY
 
 /**
@@ -561,7 +589,7 @@ static void *readerRoutine(void)
             while(ctx.readSize < ctx.fileSize) {
                 errno = 0;
                 size = ctx.fileSize - ctx.readSize < (uint64_t)buffer_size ? (int)(ctx.fileSize - ctx.readSize) : buffer_size;
-                numberOfBytesRead = (int)read(src, ctx.buffer, size);
+                numberOfBytesRead = disks_read((void*)((long int)src), ctx.readSize, ctx.buffer, size);
                 if(verbose > 1) printf("read(%d) numberOfBytesRead %d errno=%d\n", size, numberOfBytesRead, errno);
                 if(numberOfBytesRead == size) {
                     if(stream_write(&ctx, ctx.buffer, size)) {
@@ -597,12 +625,81 @@ static void *readerRoutine(void)
 
 static void refreshTarget(void)
 {
+    int i, j, l, k = 0, n = 0;
+    char marked[DISKS_MAX][32], dev[32];
+
+    /* keep the marks and the selection on the same disks, the list might have changed. Entries start with the device's name */
+    for(i = 0; i < numTargetList; i++)
+        if(targetMark[i]) {
+            for(l = 0; l < 31 && targetList[i][l] && targetList[i][l] != ' '; l++) marked[n][l] = targetList[i][l];
+            marked[n++][l] = 0;
+        }
+    if(targetId >= 0 && targetId < numTargetList)
+        for(; k < 31 && targetList[targetId][k] && targetList[targetId][k] != ' '; k++) dev[k] = targetList[targetId][k];
     memset(targetList, 0, sizeof(targetList));
+    memset(targetMark, 0, sizeof(targetMark));
     numTargetList = 0;
     disks_refreshlist();
+    for(i = 0; i < numTargetList; i++)
+        for(j = 0; j < n; j++) {
+            l = strlen(marked[j]);
+            if(!memcmp(targetList[i], marked[j], l) && (!targetList[i][l] || targetList[i][l] == ' ')) targetMark[i] = 1;
+        }
+    if(k) {
+        /* if the selected device is gone, do not let the selection slide onto a different disk */
+        for(i = 0; i < numTargetList && (memcmp(targetList[i], dev, k) || (targetList[i][k] && targetList[i][k] != ' ')); i++);
+        targetId = i < numTargetList ? i : -1;
+    } else
     if(targetId >= numTargetList) targetId = numTargetList - 1;
 }
 
+/**
+ * Wait for a key, meanwhile refresh the target list when a device is plugged in or removed
+ */
+static void waitInput(void)
+{
+    fd_set fds;
+
+    while(hotplugfd >= 0) {
+        FD_ZERO(&fds); FD_SET(0, &fds); FD_SET(hotplugfd, &fds);
+        if(select((hotplugfd > 0 ? hotplugfd : 0) + 1, &fds, NULL, NULL, NULL) < 1) {
+            if(errno == EINTR) continue;
+            break;
+        }
+        if(FD_ISSET(hotplugfd, &fds) && disks_hotplug()) {
+            refreshTarget();
+            mainRedraw();
+        }
+        if(FD_ISSET(0, &fds)) break;
+    }
+}
+
+/**
+ * Returns the number of marked targets
+ */
+static int numMarked(void)
+{
+    int i, n = 0;
+
+    for(i = 0; i < numTargetList; i++)
+        if(targetMark[i]) n++;
+    return n;
+}
+
+/**
+ * What to display in the target field, the selected target, or all the marked ones
+ */
+static char *getTargetLabel(void)
+{
+    int i, l = 0;
+
+    if(numMarked() < 2) return targetId >= 0 && targetId < numTargetList ? targetList[targetId] : "";
+    l = snprintf(targetLabel, sizeof(targetLabel), "(%d)", numMarked());
+    for(i = 0; i < numTargetList && l < (int)sizeof(targetLabel) - 1; i++)
+        if(targetMark[i]) l += snprintf(targetLabel + l, sizeof(targetLabel) - l, " %s", targetList[i]);
+    return targetLabel;
+}
+
 void mainRedraw(void)
 {
     int r = 0, c = 0, x, y, i, w, h, ty;
@@ -646,7 +743,7 @@ void mainRedraw(void)
         !menu && mainsel==2?sel:iab,!menu && mainsel==2?"33;44;1":iab, btntext, !menu && mainsel==2?sel:iab);
     drawline(x,y+ 4,w,0,!menu,sel,ina);
     drawline(x,y+ 5,w,mainsel==3,!menu,sel,ina);
-    printf("%s\033[%d;%dH[%s]", targetId >= 0 && targetId < numTargetList ? targetList[targetId] : "", y+5, x+w-5,t==terms[2]?"v":"▼");
+    printf("%s\033[%d;%dH[%s]", getTargetLabel(), y+5, x+w-5,t==terms[2]?"v":"▼");
     ty = y+5;
     drawline(x,y+ 6,w,0,!menu,sel,ina);
     drawline(x,y+ 7,w,0,!menu,sel,ina);
@@ -659,7 +756,7 @@ void mainRedraw(void)
         blksizeList[blksizesel], t==terms[2]?"v":"▼");
 #else
     drawline(x,y+ 3,w,mainsel==1,!menu,sel,ina);
-    printf("%s\033[%d;%dH[%s]", targetId >= 0 && targetId < numTargetList ? targetList[targetId] : "", y+3, x+w-5,t==terms[2]?"v":"▼");
+    printf("%s\033[%d;%dH[%s]", getTargetLabel(), y+3, x+w-5,t==terms[2]?"v":"▼");
     ty = y+3;
     drawline(x,y+ 4,w,0,!menu,sel,ina);
     drawline(x,y+ 5,w,mainsel==2,!menu,sel,ina);
@@ -682,10 +779,10 @@ void mainRedraw(void)
         case 1: drawfilesel(); break;
         case 2:
             if(targetId < 0 || targetId >= numTargetList) targetId = 0;
-            drawselect(targetPtr, numTargetList, x+1, ty, w-2, targetId);
+            drawselect(targetPtr, targetMark, numTargetList, x+1, ty, w-2, targetId);
         break;
 #if !defined(USE_WRONLY) || !USE_WRONLY
-        case 3: drawselect(blksizeList, 10, x+w-10, y+7, 9, blksizesel); break;
+        case 3: drawselect(blksizeList, NULL, 10, x+w-10, y+7, 9, blksizesel); break;
 #endif
     }
     printf("\033[0m\033[%d;%dH\033[?25l",row,col);
@@ -703,7 +800,7 @@ int main(int argc, char **argv)
         " (build " USBIMAGER_BUILD ")"
 #endif
         " - MIT license, Copyright (C) 2020 bzt\r\n\r\n"
-        "./usbimager [-v|-vv|-a|-f|-s[baud]|-S[baud]|-1|-2|-3|-4|-5|-6|-7|-8|-9|-L(xx)|-m(x)] <backup path>\r\n\r\n"
+        "./usbimager [-v|-vv|-a|-f|-d|-w|-z|-r|-c(algo)|-K[GiB]|-s[baud]|-S[baud]|-1|-2|-3|-4|-5|-6|-7|-8|-9|-L(xx)|-m(x)] <backup path>\r\n\r\n"
         "https://gitlab.com/bztsrc/usbimager\r\n\r\n";
 
     for(j = 1; j < argc && argv[j]; j++) {
@@ -738,6 +835,15 @@ int main(int argc, char **argv)
                         }
                         break;
                     case 'a': disks_all = 1; break;
+                    case 'd': disks_mode = DISKS_DIRECT; break;
+                    case 'w': disks_mode = DISKS_WINDOW; break;
+                    case 'z': disks_skipzero = 1; break;
+                    case 'r': disks_readback = 1; break;
+                    case 'c': i += stream_checksum(argv[j] + i + 1); break;
+                    case 'K':
+                        stream_cache(NULL, atoi(argv[j] + i + 1));
+                        while(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') i++;
+                        break;
                     case '1': blksizesel = 1; buffer_size = 2*1024*1024; break;
                     case '2': blksizesel = 2; buffer_size = 4*1024*1024; break;
                     case '3': blksizesel = 3; buffer_size = 8*1024*1024; break;
@@ -764,8 +870,8 @@ int main(int argc, char **argv)
     if(!lang) lang = &dict[0][1];
 
     if(verbose) {
-        printf("LANG '%s', dict '%s', serial %d, buffer_size %d MiB, force %d\r\n",
-            lc, lang[-1], disks_serial, buffer_size/1024/1024, force);
+        printf("LANG '%s', dict '%s', serial %d, buffer_size %d MiB, force %d, mode %d\r\n",
+            lc, lang[-1], disks_serial, buffer_size/1024/1024, force, disks_mode);
         printf("disks_maxsize %d GiB\r\n", disks_maxsize);
         if(disks_serial) printf("Serial %d,8,n,1\r\n", baud);
 #if !defined(USE_WRONLY) || !USE_WRONLY
@@ -781,8 +887,11 @@ int main(int argc, char **argv)
     memset(path, 0, sizeof(path));
     getcwd(path, sizeof(path)-1);
     setupstdin();
+    /* new devices show up in the list as soon as they are plugged in */
+    hotplugfd = disks_hotplugstart();
     do {
         mainRedraw();
+        waitInput();
         c = getcsi(); if(c >= '1' && c <= '3') { t = terms[c-'1']; col = 0; continue; }
         if(!menu) {
             switch(c) {
@@ -792,7 +901,7 @@ int main(int argc, char **argv)
                     switch(mainsel) {
                         case 0: readdirectory(); menu = 1; break;
 #if !defined(USE_WRONLY) || !USE_WRONLY
-                        case 1: mainsel = 999; writerRoutine(); mainsel = 0; break;
+                        case 1: mainsel = 999; if(numMarked() > 1) duplicatorRoutine(); else writerRoutine(); mainsel = 0; break;
                         case 2: mainsel = 999; readerRoutine(); mainsel = 0; break;
                         case 3: refreshTarget(); menu = 2; break;
                         case 4: needVerify ^= 1; break;
@@ -800,7 +909,7 @@ int main(int argc, char **argv)
                         case 6: menu = 3; break;
 #else
                         case 1: refreshTarget(); menu = 2; break;
-                        case 2: mainsel = 999; writerRoutine(); mainsel = 0; break;
+                        case 2: mainsel = 999; if(numMarked() > 1) duplicatorRoutine(); else writerRoutine(); mainsel = 0; break;
 #endif
                     }
                 break;
@@ -811,7 +920,11 @@ int main(int argc, char **argv)
         } else
         switch(menu) {
             case 1: c = ctrlfilesel(c); break;
-            case 2: c = ctrlselect(c, &targetId, numTargetList); break;
+            case 2:
+                /* Space marks the target for writing several at once */
+                if(c == 32) { if(targetId >= 0 && targetId < numTargetList) targetMark[targetId] ^= 1; c = 0; }
+                else c = ctrlselect(c, &targetId, numTargetList);
+            break;
             case 3: c = ctrlselect(c, &blksizesel, 10); break;
         }
     } while(c!=0x1b);
@@ -39,6 +39,7 @@
 #include "resource.h"
 #include "stream.h"
 #include "disks.h"
+#include "kernels.h"
 
 #ifndef DBT_DEVICEARRIVAL
 #define DBT_DEVICEARRIVAL 0x8000
@@ -176,9 +177,14 @@ static DWORD WINAPI writerRoutine(LPVOID lpParam) {
                     } else {
                         DWORD numberOfBytesWritten, numberOfBytesVerify;
                         errno = 0; needWrite = 1; numberOfBytesVerify = 0;
+                        /* with a block map, unmapped areas are skipped */
+                        if((uint64_t)totalNumberOfBytesWritten.QuadPart != ctx.readSize - numberOfBytesRead) {
+                            totalNumberOfBytesWritten.QuadPart = ctx.readSize - numberOfBytesRead;
+                            SetFilePointerEx(hTargetDevice, totalNumberOfBytesWritten, NULL, FILE_BEGIN);
+                        }
                         if(!force) {
                             if(ReadFile(hTargetDevice, ctx.verifyBuf, numberOfBytesRead, &numberOfBytesVerify, NULL) &&
-                                numberOfBytesRead == (int)numberOfBytesVerify && !memcmp(ctx.buffer, ctx.verifyBuf, numberOfBytesRead)) {
+                                numberOfBytesRead == (int)numberOfBytesVerify && kernels_equal(ctx.buffer, ctx.verifyBuf, numberOfBytesRead)) {
                                 if(verbose > 1) printf("  numberOfBytesVerify %d matches disk, skipping write\n", numberOfBytesRead);
                                 needWrite = 0;
                                 totalNumberOfBytesWritten.QuadPart += numberOfBytesVerify;
@@ -200,7 +206,7 @@ static DWORD WINAPI writerRoutine(LPVOID lpParam) {
                                 if(needVerify) {
                                     SetFilePointerEx(hTargetDevice, totalNumberOfBytesWritten, NULL, FILE_BEGIN);
                                     if(!ReadFile(hTargetDevice, ctx.verifyBuf, numberOfBytesWritten, &numberOfBytesVerify, NULL) ||
-                                        numberOfBytesWritten != numberOfBytesVerify || memcmp(ctx.buffer, ctx.verifyBuf, numberOfBytesWritten)) {
+                                        numberOfBytesWritten != numberOfBytesVerify || !kernels_equal(ctx.buffer, ctx.verifyBuf, numberOfBytesWritten)) {
                                         MessageBoxW(hwndDlg, lang[L_VRFYERR], lang[L_ERROR], MB_ICONERROR);
                                         break;
                                     }
@@ -569,7 +575,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpszArgum
                                     " (build " USBIMAGER_BUILD ")"
 #endif
                                     " - MIT license, Copyright (C) 2020 bzt\r\n\r\n"
-                                    "usbimager.exe [-v|-vv|-a|-f|-s[baud]|-S[baud]|-1|-2|-3|-4|-5|-6|-7|-8|-9|-L(xx)|-m(x)] <backup path>\r\n\r\n"
+                                    "usbimager.exe [-v|-vv|-a|-f|-c(algo)|-s[baud]|-S[baud]|-1|-2|-3|-4|-5|-6|-7|-8|-9|-L(xx)|-m(x)] <backup path>\r\n\r\n"
                                     "https://gitlab.com/bztsrc/usbimager\r\n\r\n");
                             }
                         break;
@@ -587,6 +593,7 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpszArgum
                                 while(s[1] >= '0' && s[1] <= '9') s++;
                             }
                             break;
+                        case 'c': s += stream_checksum(s + 1); break;
                         case 'a': disks_all = 1; break;
                         case '1': blksizesel = 1; buffer_size = 2*1024*1024; break;
                         case '2': blksizesel = 2; buffer_size = 4*1024*1024; break;
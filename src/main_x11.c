@@ -38,9 +38,11 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/select.h>
 #include "lang.h"
 #include "stream.h"
 #include "disks.h"
+#include "kernels.h"
 #include "misc/icons.xbm"       /* get icons for the Open File dialog */
 #include "misc/wm_icon.h"       /* window manager icon */
 
@@ -87,7 +89,7 @@ static char *bkpdir = NULL;
 static char source[PATH_MAX], targetList[DISKS_MAX][128], status[128];
 static char blksizeList[10][128];
 static int fonth = 0, fonta = 0, inactive = 0, pressedBtn = 0, half;
-static int needVerify = 1, needCompress = 0, progress = 0, numTargetList = 0, targetId = -1;
+static int needVerify = 1, needCompress = 0, progress = 0, numTargetList = 0, targetId = -1, hotplugfd = -1;
 static int mainsel = -1, sorting = 0, shift = 0, blksizesel = 0;
 #ifndef USE_UNIFONT
 static XFontStruct *font = NULL;
@@ -766,13 +768,22 @@ static void onThreadError(void *data)
     XRaiseWindow(dpy, mainwin);
 }
 
+/**
+ * Progress callback of stream_todisk(), writing is cancelled when the window is closed
+ */
+static int writerProgress(void *data, stream_t *ctx)
+{
+    (void)data;
+    main_onProgress(ctx);
+    return !mainwin;
+}
+
 /**
  * Function that reads from input and writes to disk
  */
 static void *writerRoutine(void)
 {
-    int dst, numberOfBytesRead;
-    int numberOfBytesWritten, numberOfBytesVerify, needWrite;
+    int dst, ret, readBack;
     static stream_t ctx;
 
     ctx.readSize = 0;
@@ -780,51 +791,11 @@ static void *writerRoutine(void)
     if(!dst) {
         dst = (int)((long int)disks_open(targetId, ctx.fileSize));
         if(dst > 0) {
-            while(mainwin) {
-                if((numberOfBytesRead = stream_read(&ctx)) >= 0) {
-                    if(numberOfBytesRead == 0) {
-                        if(!ctx.fileSize) ctx.fileSize = ctx.readSize;
-                        break;
-                    } else {
-                        errno = 0; needWrite = 1; numberOfBytesVerify = 0;
-                        if(!force) {
-                            numberOfBytesVerify = read(dst, ctx.verifyBuf, numberOfBytesRead);
-                            if(numberOfBytesVerify == numberOfBytesRead &&
-                                !memcmp(ctx.buffer, ctx.verifyBuf, numberOfBytesRead)) {
-                                if(verbose > 1) printf("  numberOfBytesVerify %d matches disk, skipping write\n", numberOfBytesRead);
-                                needWrite = 0;
-                                main_onProgress(&ctx);
-                            } else
-                                lseek(dst, -((off_t)numberOfBytesVerify), SEEK_CUR);
-                        }
-                        if(needWrite) {
-                            numberOfBytesWritten = (int)write(dst, ctx.buffer, numberOfBytesRead);
-                            if(verbose > 1) printf("write(%d) numberOfBytesWritten %d errno=%d\n",
-                                numberOfBytesRead, numberOfBytesWritten, errno);
-                            if(numberOfBytesWritten == numberOfBytesRead) {
-                                if(needVerify) {
-                                    lseek(dst, -((off_t)numberOfBytesWritten), SEEK_CUR);
-                                    numberOfBytesVerify = read(dst, ctx.verifyBuf, numberOfBytesWritten);
-                                    if(verbose > 1) printf("  numberOfBytesVerify %d\n", numberOfBytesVerify);
-                                    if(numberOfBytesVerify != numberOfBytesWritten ||
-                                        memcmp(ctx.buffer, ctx.verifyBuf, numberOfBytesWritten)) {
-                                        onThreadError(lang[L_VRFYERR]);
-                                        break;
-                                    }
-                                }
-                                main_onProgress(&ctx);
-                            } else {
-                                if(errno) main_errorMessage = strerror(errno);
-                                onThreadError(lang[L_WRTRGERR]);
-                                break;
-                            }
-                        }
-                        stream_hash(&ctx, numberOfBytesVerify);
-                    }
-                } else {
-                    onThreadError(lang[L_RDSRCERR]);
-                    break;
-                }
+            /* with read-back, chunks are only hashed here and checked all at once after the last write */
+            readBack = needVerify && disks_readback && !(targetId >= 0 && targetId < DISKS_MAX && disks_targets[targetId] >= 1024);
+            if((ret = stream_todisk(&ctx, (void*)((long int)dst), needVerify ? (readBack ? 2 : 1) : 0, writerProgress, NULL)) > 0) {
+                if(errno) main_errorMessage = strerror(errno);
+                onThreadError(lang[ret]);
             }
             disks_close((void*)((long int)dst));
         } else {
@@ -903,7 +874,7 @@ static void *readerRoutine(void)
             while(mainwin && ctx.readSize < ctx.fileSize) {
                 errno = 0;
                 size = ctx.fileSize - ctx.readSize < (uint64_t)buffer_size ? (int)(ctx.fileSize - ctx.readSize) : buffer_size;
-                numberOfBytesRead = (int)read(src, ctx.buffer, size);
+                numberOfBytesRead = disks_read((void*)((long int)src), ctx.readSize, ctx.buffer, size);
                 if(verbose > 1) printf("read(%d) numberOfBytesRead %d errno=%d\n", size, numberOfBytesRead, errno);
                 if(numberOfBytesRead == size) {
                     if(stream_write(&ctx, ctx.buffer, size)) {
@@ -954,9 +925,42 @@ static void onReadButtonClicked(void)
 
 static void refreshTarget(void)
 {
+    char dev[32];
+    int i, l = 0;
+
+    /* keep the selection on the same device, the list might have changed. Entries start with the device's name */
+    if(targetId >= 0 && targetId < numTargetList)
+        for(; l < 31 && targetList[targetId][l] && targetList[targetId][l] != ' '; l++) dev[l] = targetList[targetId][l];
     memset(targetList, 0, sizeof(targetList));
     numTargetList = 0;
     disks_refreshlist();
+    if(l) {
+        for(i = 0; i < numTargetList && (memcmp(targetList[i], dev, l) || (targetList[i][l] && targetList[i][l] != ' ')); i++);
+        targetId = i < numTargetList ? i : -1;
+    }
+}
+
+/**
+ * Wait for the next X event, meanwhile refresh the target list when a device is plugged in or removed
+ */
+static void waitEvent(XEvent *e)
+{
+    fd_set fds;
+    int x = ConnectionNumber(dpy);
+
+    while(hotplugfd >= 0 && !XPending(dpy)) {
+        FD_ZERO(&fds); FD_SET(x, &fds); FD_SET(hotplugfd, &fds);
+        if(select((x > hotplugfd ? x : hotplugfd) + 1, &fds, NULL, NULL, NULL) < 1) {
+            if(errno == EINTR) continue;
+            break;
+        }
+        if(FD_ISSET(hotplugfd, &fds) && disks_hotplug()) {
+            refreshTarget();
+            mainRedraw();
+            XFlush(dpy);
+        }
+    }
+    XNextEvent(dpy, e);
 }
 
 static void onTargetClicked(void)
@@ -1546,7 +1550,7 @@ int main(int argc, char **argv)
         " (build " USBIMAGER_BUILD ")"
 #endif
         " - MIT license, Copyright (C) 2020 bzt\r\n\r\n"
-        "./usbimager [-v|-vv|-a|-f|-s[baud]|-S[baud]|-1|-2|-3|-4|-5|-6|-7|-8|-9|-L(xx)|-m(x)"
+        "./usbimager [-v|-vv|-a|-f|-d|-w|-z|-r|-c(algo)|-K[GiB]|-s[baud]|-S[baud]|-1|-2|-3|-4|-5|-6|-7|-8|-9|-L(xx)|-m(x)"
 #ifndef USE_UNIFONT
         "|-F(x)"
 #endif
@@ -1585,6 +1589,15 @@ int main(int argc, char **argv)
                         }
                         break;
                     case 'a': disks_all = 1; break;
+                    case 'd': disks_mode = DISKS_DIRECT; break;
+                    case 'w': disks_mode = DISKS_WINDOW; break;
+                    case 'z': disks_skipzero = 1; break;
+                    case 'r': disks_readback = 1; break;
+                    case 'c': i += stream_checksum(argv[j] + i + 1); break;
+                    case 'K':
+                        stream_cache(NULL, atoi(argv[j] + i + 1));
+                        while(argv[j][i+1] >= '0' && argv[j][i+1] <= '9') i++;
+                        break;
                     case '1': blksizesel = 1; buffer_size = 2*1024*1024; break;
                     case '2': blksizesel = 2; buffer_size = 4*1024*1024; break;
                     case '3': blksizesel = 3; buffer_size = 8*1024*1024; break;
@@ -1614,8 +1627,8 @@ int main(int argc, char **argv)
     if(!lang) lang = &dict[0][1];
 
     if(verbose) {
-        printf("LANG '%s', dict '%s', serial %d, buffer_size %d MiB, force %d\r\n",
-            lc, lang[-1], disks_serial, buffer_size/1024/1024, force);
+        printf("LANG '%s', dict '%s', serial %d, buffer_size %d MiB, force %d, mode %d\r\n",
+            lc, lang[-1], disks_serial, buffer_size/1024/1024, force, disks_mode);
         printf("disks_maxsize %d GiB\r\n", disks_maxsize);
         if(disks_serial) printf("Serial %d,8,n,1\r\n", baud);
 #if !defined(USE_WRONLY) || !USE_WRONLY
@@ -1766,9 +1779,11 @@ int main(int argc, char **argv)
     if(verbose) printf(" X11 frame: left %d top %d\n", frame_left, frame_top);
     if(extents) XFree(extents);
     mainRedraw();
+    /* new devices show up in the list as soon as they are plugged in */
+    hotplugfd = disks_hotplugstart();
 
     while(1) {
-        XNextEvent(dpy, &e);
+        waitEvent(&e);
         k = 0; ser = targetId >= 0 && targetId < DISKS_MAX && disks_targets[targetId] >= 1024 ? 1 : 0;
         if((e.type == ClientMessage && (Atom)(e.xclient.data.l[0]) == delAtom) ||
            (e.type == KeyPress && XLookupKeysym(&e.xkey,0) == XK_Escape))
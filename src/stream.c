@@ -27,48 +27,19 @@
  *
  */
 
+#define _GNU_SOURCE /* for madvise and SEEK_DATA */
 #include <time.h>
 #include <errno.h>
 #include <sys/types.h>
 #include "lang.h"
 #include "stream.h"
+#include "disks.h"
+#include "kernels.h"
 
 /**
  * SHA-256
  */
 #define SHA_ADD(a,b,c) if(a>0xffffffff-(c))b++;a+=c;
-#define SHA_ROTL(a,b) (((a)<<(b))|((a)>>(32-(b))))
-#define SHA_ROTR(a,b) (((a)>>(b))|((a)<<(32-(b))))
-#define SHA_CH(x,y,z) (((x)&(y))^(~(x)&(z)))
-#define SHA_MAJ(x,y,z) (((x)&(y))^((x)&(z))^((y)&(z)))
-#define SHA_EP0(x) (SHA_ROTR(x,2)^SHA_ROTR(x,13)^SHA_ROTR(x,22))
-#define SHA_EP1(x) (SHA_ROTR(x,6)^SHA_ROTR(x,11)^SHA_ROTR(x,25))
-#define SHA_SIG0(x) (SHA_ROTR(x,7)^SHA_ROTR(x,18)^((x)>>3))
-#define SHA_SIG1(x) (SHA_ROTR(x,17)^SHA_ROTR(x,19)^((x)>>10))
-static uint32_t sha256_k[64]={
-   0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
-   0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
-   0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
-   0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
-   0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
-   0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
-   0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
-   0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
-};
-static void sha256_t(sha256_ctx_t *ctx)
-{
-   uint32_t a,b,c,d,e,f,g,h,i,j,t1,t2,m[64];
-   for(i=0,j=0;i<16;i++,j+=4) m[i]=(ctx->d[j]<<24)|(ctx->d[j+1]<<16)|(ctx->d[j+2]<<8)|(ctx->d[j+3]);
-   for(;i<64;i++) m[i]=SHA_SIG1(m[i-2])+m[i-7]+SHA_SIG0(m[i-15])+m[i-16];
-   a=ctx->s[0];b=ctx->s[1];c=ctx->s[2];d=ctx->s[3];
-   e=ctx->s[4];f=ctx->s[5];g=ctx->s[6];h=ctx->s[7];
-   for(i=0;i<64;i++) {
-       t1=h+SHA_EP1(e)+SHA_CH(e,f,g)+sha256_k[i]+m[i];
-       t2=SHA_EP0(a)+SHA_MAJ(a,b,c);h=g;g=f;f=e;e=d+t1;d=c;c=b;b=a;a=t1+t2;
-    }
-   ctx->s[0]+=a;ctx->s[1]+=b;ctx->s[2]+=c;ctx->s[3]+=d;
-   ctx->s[4]+=e;ctx->s[5]+=f;ctx->s[6]+=g;ctx->s[7]+=h;
-}
 void sha256_i(sha256_ctx_t *ctx)
 {
     ctx->l=0;ctx->b[0]=ctx->b[1]=0;
@@ -77,22 +48,30 @@ void sha256_i(sha256_ctx_t *ctx)
 }
 void sha256_u(sha256_ctx_t *ctx, const void *data, int len)
 {
-    uint8_t *d=(uint8_t *)data;
-    for(;len--;d++) {
-        ctx->d[ctx->l++]=*d;
-        if(ctx->l==64) {sha256_t(ctx);SHA_ADD(ctx->b[0],ctx->b[1],512);ctx->l=0;}
+    const uint8_t *d=(const uint8_t *)data;
+    uint32_t n;
+    if(ctx->l) {
+        n=64-ctx->l<(uint32_t)len?64-ctx->l:(uint32_t)len;
+        memcpy(ctx->d+ctx->l,d,n);ctx->l+=n;d+=n;len-=n;
+        if(ctx->l==64) {kernels_sha256(ctx->s,ctx->d,1);SHA_ADD(ctx->b[0],ctx->b[1],512);ctx->l=0;}
+    }
+    /* whole blocks straight from the input */
+    for(;len>=64;len-=n*64,d+=n*64) {
+        n=len/64>8192?8192:len/64;
+        kernels_sha256(ctx->s,d,n);SHA_ADD(ctx->b[0],ctx->b[1],n*512);
     }
+    if(len>0) {memcpy(ctx->d,d,len);ctx->l=len;}
 }
 void sha256_f(sha256_ctx_t *ctx, uint8_t *h)
 {
     uint32_t i=ctx->l;
     ctx->d[i++]=0x80;
     if(ctx->l<56) {while(i<56) ctx->d[i++]=0x00;}
-    else {while(i<64) ctx->d[i++]=0x00;sha256_t(ctx);memset(ctx->d,0,56);}
+    else {while(i<64) ctx->d[i++]=0x00;kernels_sha256(ctx->s,ctx->d,1);memset(ctx->d,0,56);}
     SHA_ADD(ctx->b[0],ctx->b[1],ctx->l*8);
     ctx->d[63]=ctx->b[0];ctx->d[62]=ctx->b[0]>>8;ctx->d[61]=ctx->b[0]>>16;ctx->d[60]=ctx->b[0]>>24;
     ctx->d[59]=ctx->b[1];ctx->d[58]=ctx->b[1]>>8;ctx->d[57]=ctx->b[1]>>16;ctx->d[56]=ctx->b[1]>>24;
-    sha256_t(ctx);
+    kernels_sha256(ctx->s,ctx->d,1);
     for(i=0;i<4;i++) {
         h[i]   =(ctx->s[0]>>(24-i*8)); h[i+4] =(ctx->s[1]>>(24-i*8));
         h[i+8] =(ctx->s[2]>>(24-i*8)); h[i+12]=(ctx->s[3]>>(24-i*8));
@@ -103,6 +82,7 @@ void sha256_f(sha256_ctx_t *ctx, uint8_t *h)
 
 #ifdef WINVER
 #include <windows.h>
+#include <malloc.h>
 /*extern int _fileno(FILE *f);*/
 FILE *stream_fopen(char *fn, char *mode)
 {
@@ -125,7 +105,12 @@ FILE *stream_fopen(char *fn, char *mode)
 }
 #else
 #include <sys/statvfs.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <dirent.h>
 extern int fileno(FILE *f);
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
 #define stream_fopen fopen
 #endif
 #if !defined(WINVER) && !defined(MACOSX)
@@ -143,8 +128,13 @@ int myseek (FILE* stream, uint64_t offset)
 int verbose = 0;
 int buffer_size = 1024*1024;
 int baud = 115200;
+int checksum = STREAM_SHA256;
 int force = 0;
 int dstfd = 0;
+#ifndef WINVER
+static char *cache_dir = NULL;
+static uint64_t cache_max = 0;
+#endif
 
 /**
  * helper for xz to dynamically get the largest dictionary size possible
@@ -162,6 +152,31 @@ struct xz_dec *xzinit(void)
     return ret;
 }
 
+/**
+ * allocate a buffer_size sized buffer, page aligned so that it can be used for direct I/O
+ */
+static char *stream_alloc(void)
+{
+#ifdef WINVER
+    return (char*)_aligned_malloc(buffer_size, 4096);
+#else
+    void *ptr;
+    return posix_memalign(&ptr, 4096, buffer_size) ? NULL : (char*)ptr;
+#endif
+}
+
+/**
+ * free a buffer allocated by stream_alloc()
+ */
+static void stream_free(char *ptr)
+{
+#ifdef WINVER
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
 /**
  * convert ascii octal number to binary number
  */
@@ -191,6 +206,109 @@ uint64_t hex2bin(char *str, int size)
     return s;
 }
 
+/* on-disk data checksum algorithms, in the same order as the STREAM_* enum */
+static char *cksum_names[] = { "sha256", "xxh64", "crc32c" };
+static char *cksum_titles[] = { "SHA-256", "XXH64", "CRC32C" };
+
+/**
+ * Add a buffer to the on-disk data checksum with the selected algorithm
+ */
+static void stream_hashupdate(stream_t *ctx, const void *buf, int len)
+{
+    switch(ctx->cksum) {
+        case STREAM_XXH64: XXH64_update(&ctx->xxh, buf, len); break;
+        case STREAM_CRC32C: ctx->crc = kernels_crc32c(ctx->crc, buf, len); break;
+        default: sha256_u(&ctx->sha, buf, len); break;
+    }
+}
+
+#ifndef WINVER
+/**
+ * Hashing thread, consumes the buffers handed over by stream_hashpost() one at a time
+ */
+static void *stream_hasher(void *data)
+{
+    stream_t *ctx = (stream_t*)data;
+    stream_hasher_t *h = ctx->hasher;
+
+    pthread_mutex_lock(&h->mutex);
+    while(1) {
+        while(!h->stop && !h->buf) pthread_cond_wait(&h->cond, &h->mutex);
+        if(!h->buf) break;
+        pthread_mutex_unlock(&h->mutex);
+        stream_hashupdate(ctx, h->buf, h->len);
+        pthread_mutex_lock(&h->mutex);
+        h->buf = NULL;
+        pthread_cond_broadcast(&h->cond);
+    }
+    pthread_mutex_unlock(&h->mutex);
+    return NULL;
+}
+
+/**
+ * Wait until the hashing thread is done with the last buffer
+ */
+static void stream_hashwait(stream_t *ctx)
+{
+    stream_hasher_t *h = ctx->hasher;
+
+    if(!h) return;
+    pthread_mutex_lock(&h->mutex);
+    while(h->buf) pthread_cond_wait(&h->cond, &h->mutex);
+    pthread_mutex_unlock(&h->mutex);
+}
+
+/**
+ * Add a buffer to the checksum on the hashing thread, the buffer must not change until the next
+ * stream_hashwait(). If the thread can't be started, it's hashed right away
+ */
+static void stream_hashpost(stream_t *ctx, const void *buf, int len)
+{
+    stream_hasher_t *h = ctx->hasher;
+
+    if(!h && (h = (stream_hasher_t*)malloc(sizeof(stream_hasher_t)))) {
+        memset(h, 0, sizeof(stream_hasher_t));
+        pthread_mutex_init(&h->mutex, NULL);
+        pthread_cond_init(&h->cond, NULL);
+        ctx->hasher = h;
+        if(pthread_create(&h->thrd, NULL, stream_hasher, ctx)) {
+            ctx->hasher = NULL;
+            pthread_cond_destroy(&h->cond);
+            pthread_mutex_destroy(&h->mutex);
+            free(h);
+            h = NULL;
+        }
+    }
+    ctx->hasHash = 1;
+    if(!h) { stream_hashupdate(ctx, buf, len); return; }
+    stream_hashwait(ctx);
+    pthread_mutex_lock(&h->mutex);
+    h->buf = buf;
+    h->len = len;
+    pthread_cond_broadcast(&h->cond);
+    pthread_mutex_unlock(&h->mutex);
+}
+
+/**
+ * Finish hashing and stop the hashing thread
+ */
+static void stream_hashstop(stream_t *ctx)
+{
+    stream_hasher_t *h = ctx->hasher;
+
+    if(!h) return;
+    pthread_mutex_lock(&h->mutex);
+    h->stop = 1;
+    pthread_cond_broadcast(&h->cond);
+    pthread_mutex_unlock(&h->mutex);
+    pthread_join(h->thrd, NULL);
+    pthread_cond_destroy(&h->cond);
+    pthread_mutex_destroy(&h->mutex);
+    free(h);
+    ctx->hasher = NULL;
+}
+#endif
+
 /**
  * Returns progress percentage and the status string in str
  */
@@ -198,7 +316,8 @@ int stream_status(stream_t *ctx, char *str, int done)
 {
     time_t t = time(NULL);
     uint8_t hash[32];
-    uint64_t d = 0;
+    XXH64_canonical_t xh;
+    uint64_t d = 0, pos = ctx->readSize > ctx->pendSize ? ctx->readSize - ctx->pendSize : 0;
     int h,m,s;
 #ifdef WINVER
     wchar_t rem[64];
@@ -224,10 +343,24 @@ int stream_status(stream_t *ctx, char *str, int done)
 #endif
         }
         if(verbose) {
+#ifndef WINVER
+            stream_hashstop(ctx);
+#endif
             if(ctx->hasHash) {
-                sha256_f(&ctx->sha, hash);
-                printf("On-disk data checksum (SHA-256): ");
-                for(h = 0; h < 32; h++) printf("%02x", hash[h]);
+                /* digests are printed big-endian in hex, the same way sha256sum and xxhsum print them */
+                switch(ctx->cksum) {
+                    case STREAM_XXH64:
+                        XXH64_canonicalFromHash(&xh, XXH64_digest(&ctx->xxh));
+                        memcpy(hash, xh.digest, 8); m = 8;
+                    break;
+                    case STREAM_CRC32C:
+                        hash[0] = ctx->crc >> 24; hash[1] = ctx->crc >> 16; hash[2] = ctx->crc >> 8; hash[3] = ctx->crc;
+                        m = 4;
+                    break;
+                    default: sha256_f(&ctx->sha, hash); m = 32; break;
+                }
+                printf("On-disk data checksum (%s): ", cksum_titles[(int)ctx->cksum]);
+                for(h = 0; h < m; h++) printf("%02x", hash[h]);
                 printf("\r\n");
             }
             if(ctx->avgSpeedNum > 0) {
@@ -239,9 +372,9 @@ int stream_status(stream_t *ctx, char *str, int done)
     }
     rem[0] = 0;
     if(ctx->start < t) {
-        if(ctx->readSize) {
+        if(pos) {
             if(ctx->fileSize)
-                d = ctx->readSize / (t - ctx->start);
+                d = pos / (t - ctx->start);
             else
                 d = ctx->cmrdSize / (t - ctx->start);
             ctx->avgSpeedBytes += d;
@@ -250,7 +383,7 @@ int stream_status(stream_t *ctx, char *str, int done)
             if(verbose > 1) printf("  average speed %" PRIu64" bytes / sec\r\n", d);
         }
         if(ctx->avgSpeedNum > 2) {
-            d = d ? (ctx->fileSize ? ctx->fileSize - ctx->readSize : ctx->compSize - ctx->cmrdSize) / d : 0;
+            d = d ? (ctx->fileSize ? ctx->fileSize - pos : ctx->compSize - ctx->cmrdSize) / d : 0;
             h = d / 3600; d %= 3600; m = d / 60; if(h<0 || h>23) h = 0; if(m<0) m = 0;
 #ifdef WINVER
             if(h > 0) wsprintfW(rem, (wchar_t*)lang[h>1 && m>1 ? L_STATHSMS : (h>1 && m<2 ? L_STATHSM :
@@ -268,44 +401,1433 @@ int stream_status(stream_t *ctx, char *str, int done)
 #ifdef WINVER
     if(ctx->fileSize)
         wsprintfW((wchar_t*)str, L"%6u %s / %u %s%s%s",
-            (unsigned int)(ctx->readSize >> 20), lang[L_MIB],
+            (unsigned int)(pos >> 20), lang[L_MIB],
             (unsigned int)(ctx->fileSize >> 20), lang[L_MIB], rem[0] ? L", " : L"", rem);
     else
         wsprintfW((wchar_t*)str, L"%6u %s %s%s%s",
-            (unsigned int)(ctx->readSize >> 20), lang[L_MIB], lang[L_SOFAR], rem[0] ? L", " : L"", rem);
+            (unsigned int)(pos >> 20), lang[L_MIB], lang[L_SOFAR], rem[0] ? L", " : L"", rem);
 #else
     if(ctx->fileSize)
         sprintf(str, "%6" PRIu64 " %s / %" PRIu64 " %s%s%s",
-            (ctx->readSize >> 20), lang[L_MIB],
+            (pos >> 20), lang[L_MIB],
             (ctx->fileSize >> 20), lang[L_MIB], rem[0] ? ", " : "", rem);
     else
         sprintf(str, "%6" PRIu64 " %s %s%s%s",
-            (ctx->readSize >> 20), lang[L_MIB], lang[L_SOFAR], rem[0] ? ", " : "", rem);
+            (pos >> 20), lang[L_MIB], lang[L_SOFAR], rem[0] ? ", " : "", rem);
 #endif
-    d = ctx->fileSize ? (ctx->readSize * 1000) / (ctx->fileSize * 10) :
+    d = ctx->fileSize ? (pos * 1000) / (ctx->fileSize * 10) :
         (ctx->cmrdSize * 1000) / (ctx->compSize * 10 + 1);
     /* readSize can be greater than fileSize because it's rounded up to 512 bytes */
     return d > 100 ? 100 : d;
 }
 
+#define STREAM_GET32(p) ((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8) | ((uint32_t)(p)[2] << 16) | ((uint32_t)(p)[3] << 24))
+#define STREAM_GET32BE(p) (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+
+#define STREAM_GZRAW 0                  /* in a deflate stream started at a flush point, without a gzip header */
+#define STREAM_GZMEM 1                  /* in a gzip member */
+#define STREAM_GZNEXT 2                 /* between gzip members, above this the trailer is being skipped */
+
+/**
+ * Start decoding at a member's header (GZMEM) or in a deflate stream (GZRAW), whole is set if that's at
+ * the beginning of the member
+ */
+static void stream_gzstart(stream_gz_t *g, int st, int whole)
+{
+    memset(g, 0, sizeof(stream_gz_t));
+    g->st = st;
+    g->whole = whole;
+}
+
+/**
+ * Check a member's CRC32 and size against its trailer, returns -1 if they don't match
+ */
+static int stream_gzcheck(uint32_t crc, uint64_t len, uint8_t *trl)
+{
+    if(STREAM_GET32(trl) == crc && STREAM_GET32(trl + 4) == (uint32_t)len) return 0;
+    if(verbose) printf("  gzip member CRC32 mismatch %08x != %08x, size %u != %u\r\n", crc, STREAM_GET32(trl),
+        (uint32_t)len, STREAM_GET32(trl + 4));
+    return -1;
+}
+
+/**
+ * Inflate gzip members one after another, returns 1 if it stopped at a place where the input can be split,
+ * 0 if not, -1 on error. zlib checks the members it parses the header of, a raw deflate stream's CRC32 is
+ * calculated here and checked against the trailer if the decoder saw the whole member.
+ * Trailing garbage is ignored, like gzip does.
+ */
+static int stream_gzrun(z_stream *z, stream_gz_t *g)
+{
+    unsigned char *out;
+    int r, n;
+
+    while(z->avail_out) {
+        if(g->st > STREAM_GZNEXT) {
+            if(!z->avail_in) break;
+            n = g->st - STREAM_GZNEXT < (int)z->avail_in ? g->st - STREAM_GZNEXT : (int)z->avail_in;
+            memcpy(g->trl + 8 - (g->st - STREAM_GZNEXT), z->next_in, n);
+            z->next_in += n; z->avail_in -= n; g->st -= n;
+            if(g->st == STREAM_GZNEXT) {
+                if(g->whole) { if(stream_gzcheck(g->crc, g->len, g->trl)) return -1; }
+                else if(!g->hend) { g->hend = 1; g->hcrc = g->crc; g->hlen = g->len; memcpy(g->htrl, g->trl, 8); }
+                g->whole = 1; g->crc = 0; g->len = 0;
+                if(inflateReset2(z, 31) != Z_OK) return -1;
+            }
+            continue;
+        }
+        if(g->st == STREAM_GZNEXT) {
+            if(!z->avail_in) break;
+            if(z->next_in[0] != 0x1F) { z->next_in += z->avail_in; z->avail_in = 0; break; }
+            g->st = STREAM_GZMEM;
+        }
+        /* at a block boundary with no input, another call would lose the boundary in data_type */
+        if(!z->avail_in && (z->data_type & 0x80)) break;
+        out = z->next_out;
+        r = inflate(z, Z_NO_FLUSH);
+        if(g->st == STREAM_GZRAW && z->next_out > out) {
+            g->crc = kernels_crc32(g->crc, out, z->next_out - out);
+            g->len += z->next_out - out;
+        }
+        if(r == Z_STREAM_END) {
+            if(g->st == STREAM_GZRAW) g->st = STREAM_GZNEXT + 8;
+            else { g->st = STREAM_GZNEXT; if(inflateReset2(z, 31) != Z_OK) return -1; }
+            continue;
+        }
+        if(r == Z_BUF_ERROR) { if(z->avail_in) return -1; break; }
+        if(r != Z_OK) return -1;
+        if(!z->avail_in) break;
+    }
+    /* between members, or right after a block which ended on a byte boundary */
+    return g->st == STREAM_GZNEXT || (g->st < STREAM_GZNEXT && (z->data_type & 0xC7) == 0x80);
+}
+
+/**
+ * Map the rest of the compressed input into memory, so that the decoders can read it without copying.
+ * Pipes and anything else that can't be mapped are read with fread
+ */
+static void stream_map(stream_t *ctx)
+{
+#ifndef WINVER
+    struct stat st;
+    void *m;
+
+    if(ctx->map || fstat(fileno(ctx->f), &st) || !S_ISREG(st.st_mode) || st.st_size < 1 ||
+        (uint64_t)st.st_size != (uint64_t)(size_t)st.st_size) return;
+    m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(ctx->f), 0);
+    if(m == MAP_FAILED) {
+        if(verbose) printf(" mmap failed, reading with fread\r\n");
+        return;
+    }
+    madvise(m, (size_t)st.st_size, MADV_SEQUENTIAL);
+    ctx->map = (unsigned char*)m;
+    ctx->mapSize = (uint64_t)st.st_size;
+    ctx->mapPos = mytell(ctx->f);
+    ctx->mapFree = 0;
+    if(verbose) printf(" input mapped, %" PRIu64 " bytes\r\n", ctx->mapSize);
+#else
+    (void)ctx;
+#endif
+}
+
+#ifndef WINVER
+/**
+ * Give back the mapped input before offs, the decoders are done with it
+ */
+static void stream_release(stream_t *ctx, uint64_t offs)
+{
+    /* keep what the input checking thread hasn't hashed yet */
+    if(ctx->sum && ctx->sum->run) {
+        pthread_mutex_lock(&ctx->sum->mutex);
+        if(!ctx->sum->state && ctx->sum->pos < offs) offs = ctx->sum->pos;
+        pthread_mutex_unlock(&ctx->sum->mutex);
+    }
+    offs &= ~((uint64_t)STREAM_MAPFREE - 1);
+    if(ctx->map && offs > ctx->mapFree) {
+        madvise(ctx->map + ctx->mapFree, offs - ctx->mapFree, MADV_DONTNEED);
+        ctx->mapFree = offs;
+    }
+}
+#endif
+
+/**
+ * Return the next size bytes of compressed input, either from the mapping or read into ctx->compBuf.
+ * Returns NULL if there isn't that much input left
+ */
+static unsigned char *stream_in(stream_t *ctx, int64_t size)
+{
+#ifndef WINVER
+    if(ctx->map) {
+        if(size < 1 || ctx->mapPos > ctx->mapSize || (uint64_t)size > ctx->mapSize - ctx->mapPos) return NULL;
+        /* whatever was returned before has been consumed by now */
+        stream_release(ctx, ctx->mapPos);
+        ctx->mapPos += (uint64_t)size;
+        return ctx->map + ctx->mapPos - size;
+    }
+#endif
+    return fread(ctx->compBuf, size, 1, ctx->f) ? ctx->compBuf : NULL;
+}
+
+#ifndef WINVER
+/**
+ * Find the holes in a sparse raw image. Reading them would just return zeros, so they are skipped
+ * and zeroed on the target instead
+ */
+static void stream_holes(stream_t *ctx)
+{
+#ifdef SEEK_DATA
+    int fd = fileno(ctx->f);
+    uint64_t base = mytell(ctx->f), end = base + ctx->fileSize, s, e, *tmp;
+    off_t hole, data;
+
+    /* the image must start on a sector boundary in the file, so that the holes do too */
+    if(base & 511) return;
+    for(hole = lseek(fd, (off_t)base, SEEK_HOLE); hole >= 0 && (uint64_t)hole < end; hole = lseek(fd, data, SEEK_HOLE)) {
+        data = lseek(fd, hole, SEEK_DATA);
+        /* no more data, the file ends in a hole */
+        if(data < 0 || (uint64_t)data > end) data = (off_t)end;
+        s = ((uint64_t)hole - base + 511) & ~511ULL;
+        e = (uint64_t)data < end ? ((uint64_t)data - base) & ~511ULL : (ctx->fileSize + 511) & ~511ULL;
+        if(e > s && e - s >= STREAM_HOLEMIN) {
+            if(!(ctx->numHoles & 255)) {
+                if(!(tmp = (uint64_t*)realloc(ctx->holes, (ctx->numHoles + 256) * 2 * sizeof(uint64_t)))) break;
+                ctx->holes = tmp;
+            }
+            ctx->holes[ctx->numHoles * 2] = s;
+            ctx->holes[ctx->numHoles * 2 + 1] = e;
+            ctx->numHoles++;
+        }
+        if((uint64_t)data >= end) break;
+    }
+    /* lseek moved the descriptor under stdio */
+    myseek(ctx->f, base);
+    if(verbose && ctx->numHoles) {
+        for(s = 0, e = 0; (int)e < ctx->numHoles; e++) s += ctx->holes[e * 2 + 1] - ctx->holes[e * 2];
+        printf(" sparse image, %d holes, %" PRIu64 " bytes\r\n", ctx->numHoles, s);
+    }
+#else
+    (void)ctx;
+#endif
+}
+
+/**
+ * If the image continues with a hole, skip over it
+ */
+static void stream_skiphole(stream_t *ctx)
+{
+    uint64_t end;
+
+    while(ctx->curHole < ctx->numHoles && ctx->holes[ctx->curHole * 2 + 1] <= ctx->decSize) ctx->curHole++;
+    if(ctx->curHole < ctx->numHoles && ctx->holes[ctx->curHole * 2] <= ctx->decSize) {
+        end = ctx->holes[ctx->curHole * 2 + 1];
+        if(verbose > 1) printf("  skipping hole at %" PRIu64 ", %" PRIu64 " bytes\r\n", ctx->decSize, end - ctx->decSize);
+        myseek(ctx->f, mytell(ctx->f) + end - ctx->decSize);
+        ctx->decSize = end;
+        ctx->curHole++;
+    }
+}
+
+/**
+ * Read from the input at the given offset, can be called from any thread
+ */
+static int stream_pread(stream_t *ctx, uint64_t offs, void *buf, int size)
+{
+    int ret;
+
+    if(ctx->map) {
+        if(offs >= ctx->mapSize) return 0;
+        if((uint64_t)size > ctx->mapSize - offs) size = (int)(ctx->mapSize - offs);
+        memcpy(buf, ctx->map + offs, size);
+        return size;
+    }
+    if(ctx->par) pthread_mutex_lock(&ctx->par->io);
+    ret = myseek(ctx->f, offs) ? 0 : (int)fread(buf, 1, size, ctx->f);
+    if(ctx->par) pthread_mutex_unlock(&ctx->par->io);
+    return ret;
+}
+
+/**
+ * Return the input at the given offset, in the mapping if there's one, otherwise read into buf
+ */
+static unsigned char *stream_at(stream_t *ctx, uint64_t offs, unsigned char *buf, int size)
+{
+    if(ctx->map) return offs <= ctx->mapSize && (uint64_t)size <= ctx->mapSize - offs ? ctx->map + offs : NULL;
+    return stream_pread(ctx, offs, buf, size) == size ? buf : NULL;
+}
+
+/**
+ * Add a unit to the index
+ */
+static int stream_addunit(stream_unit_t **unit, int *num, uint64_t offs, uint64_t size, uint64_t dsize,
+    uint64_t bound)
+{
+    stream_unit_t *u;
+
+    if(!(*num & 255)) {
+        if(!(u = (stream_unit_t*)realloc(*unit, (*num + 256) * sizeof(stream_unit_t)))) return 0;
+        *unit = u;
+    }
+    (*unit)[*num].offs = offs;
+    (*unit)[*num].size = size;
+    (*unit)[*num].dsize = dsize;
+    (*unit)[*num].bound = bound;
+    (*unit)[*num].param = 0;
+    (*num)++;
+    return 1;
+}
+
+/**
+ * Find the frames in a zstd input, either in the seek table of the seekable format, or by walking
+ * the frame and block headers (pzstd puts the size of each frame in a skippable frame before it)
+ */
+static int stream_zstdindex(stream_t *ctx, uint64_t fs, stream_unit_t **unit)
+{
+    unsigned char hdr[18], *tbl;
+    uint64_t pos, offs, hint, nb;
+    unsigned long long dsize;
+    uint32_t magic, n, i, esize;
+    int num = 0, l, bh, chk;
+
+    *unit = NULL;
+    /* seekable format, the seek table is in a skippable frame at the end */
+    if(fs > 17 && stream_pread(ctx, fs - 9, hdr, 9) == 9 && STREAM_GET32(hdr + 5) == 0x8F92EAB1) {
+        n = STREAM_GET32(hdr);
+        esize = hdr[4] & 0x80 ? 12 : 8;
+        if(n && (uint64_t)n * esize + 17 < fs && (tbl = (unsigned char*)malloc(n * esize + 8))) {
+            pos = fs - 9 - (uint64_t)n * esize - 8;
+            if(stream_pread(ctx, pos, tbl, n * esize + 8) == (int)(n * esize + 8) &&
+              STREAM_GET32(tbl) == 0x184D2A5E && STREAM_GET32(tbl + 4) == n * esize + 9) {
+                for(i = 0, offs = 0; i < n && stream_addunit(unit, &num, offs, STREAM_GET32(tbl + 8 + i * esize),
+                    STREAM_GET32(tbl + 12 + i * esize), STREAM_GET32(tbl + 12 + i * esize)); i++)
+                        offs += STREAM_GET32(tbl + 8 + i * esize);
+                if(i == n && offs == pos) { free(tbl); return num; }
+            }
+            free(tbl);
+        }
+        if(verbose) printf("  bad zstd seek table\r\n");
+        free(*unit); *unit = NULL; num = 0;
+    }
+    for(pos = hint = 0; pos < fs;) {
+        if((l = stream_pread(ctx, pos, hdr, sizeof(hdr))) < 8) break;
+        magic = STREAM_GET32(hdr);
+        if((magic & 0xFFFFFFF0) == 0x184D2A50) {
+            n = STREAM_GET32(hdr + 4);
+            hint = magic == 0x184D2A50 && n == 4 && l >= 12 ? STREAM_GET32(hdr + 8) : 0;
+            pos += 8 + (uint64_t)n;
+            continue;
+        }
+        dsize = ZSTD_getFrameContentSize(hdr, l);
+        if(magic != 0xFD2FB528 || dsize == ZSTD_CONTENTSIZE_ERROR) break;
+        if(dsize == ZSTD_CONTENTSIZE_UNKNOWN) dsize = 0;
+        /* a first frame too big for parallel decoding isn't worth walking through */
+        if(!num && !hint && dsize > STREAM_PARUNIT) break;
+        if(hint && dsize)
+            offs = pos + hint;
+        else {
+            /* without the decompressed size, the number of blocks limits it */
+            chk = hdr[4] & 4;
+            offs = ZSTD_frameHeaderSize(hdr, l);
+            if(ZSTD_isError(offs)) break;
+            offs += pos;
+            nb = 0;
+            do {
+                if(stream_pread(ctx, offs, hdr, 3) != 3 || ((hdr[0] >> 1) & 3) == 3 ||
+                    (!num && !hint && !dsize && nb * ZSTD_BLOCKSIZE_MAX > STREAM_PARUNIT)) { offs = fs + 1; break; }
+                bh = hdr[0] | (hdr[1] << 8) | (hdr[2] << 16);
+                offs += 3 + (((bh >> 1) & 3) == 1 ? 1 : (bh >> 3));
+                nb++;
+            } while(!(bh & 1));
+            if(chk) offs += 4;
+        }
+        if(offs > fs || !stream_addunit(unit, &num, pos, offs - pos, dsize, dsize ? dsize : nb * ZSTD_BLOCKSIZE_MAX))
+            break;
+        pos = offs;
+        hint = 0;
+    }
+    if(pos != fs) { free(*unit); *unit = NULL; num = 0; }
+    return num;
+}
+
+/**
+ * Get a variable length integer from the xz index
+ */
+static int stream_xzvli(unsigned char *buf, uint32_t size, uint32_t *pos, uint64_t *val)
+{
+    int i;
+
+    for(*val = 0, i = 0; i < 9 && *pos < size; i++) {
+        *val |= (uint64_t)(buf[*pos] & 0x7F) << (i * 7);
+        if(!(buf[(*pos)++] & 0x80)) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Find the blocks in an xz input, using the index at the end of the stream
+ */
+static int stream_xzindex(stream_t *ctx, uint64_t fs, stream_unit_t **unit)
+{
+    unsigned char hdr[12], *idx;
+    uint64_t offs, usize, dsize, cnt;
+    uint32_t isize, pos;
+    int num = 0;
+
+    *unit = NULL;
+    /* skip stream padding, then check the stream footer */
+    while(fs >= 36 && stream_pread(ctx, fs - 4, hdr, 4) == 4 && !STREAM_GET32(hdr)) fs -= 4;
+    if(fs < 36 || stream_pread(ctx, fs - 12, hdr, 12) != 12 || hdr[10] != 'Y' || hdr[11] != 'Z' ||
+        xz_crc32(hdr + 4, 6, 0) != STREAM_GET32(hdr)) return 0;
+    isize = (STREAM_GET32(hdr + 4) + 1) * 4;
+    if(!isize || isize > STREAM_PARUNIT || (uint64_t)isize + 24 > fs || !(idx = (unsigned char*)malloc(isize)))
+        return 0;
+    pos = 1;
+    if(stream_pread(ctx, fs - 12 - isize, idx, isize) == (int)isize && !idx[0] &&
+      xz_crc32(idx, isize - 4, 0) == STREAM_GET32(idx + isize - 4) && stream_xzvli(idx, isize - 4, &pos, &cnt)) {
+        for(offs = 12; cnt && stream_xzvli(idx, isize - 4, &pos, &usize) &&
+          stream_xzvli(idx, isize - 4, &pos, &dsize) && usize && dsize; cnt--) {
+            /* the unpadded size includes the check, but not the block padding */
+            usize = (usize + 3) & ~3ULL;
+            if(offs + usize > fs - 12 - isize || !stream_addunit(unit, &num, offs, usize, dsize, dsize)) break;
+            offs += usize;
+        }
+        /* only a single stream, like the serial decoder */
+        if(cnt || offs != fs - 12 - isize) { free(*unit); *unit = NULL; num = 0; }
+    }
+    free(idx);
+    return num;
+}
+
+#define STREAM_BZBLOCK 0x314159265359ULL
+#define STREAM_BZEOS 0x177245385090ULL
+
+/**
+ * Find the blocks in a bzip2 input by looking for the block magics at any bit offset. The block CRCs are
+ * combined on the way and checked against each stream's CRC, this also catches magics appearing in the
+ * compressed data by chance. Concatenated streams (like pbzip2's output) are fine.
+ */
+static int stream_bzindex(stream_t *ctx, uint64_t fs, stream_unit_t **unit)
+{
+    unsigned char *buf;
+    uint64_t w = 0, c, offs, end, pos, blk = 0, crcAt = 0, next = 0;
+    uint32_t crc, comb = 0;
+    int num = 0, n, j, s, level = 0, eos = 0, ok = 1;
+
+    *unit = NULL;
+    if(!(buf = (unsigned char*)malloc(buffer_size))) return 0;
+    for(offs = 0; ok && offs < fs && (n = stream_pread(ctx, offs, buf, buffer_size)) > 0; offs += n)
+        for(j = 0; ok && j < n; j++) {
+            w = (w << 8) | buf[j];
+            end = (offs + j + 1) * 8;
+            if(crcAt && end >= crcAt + 32) {
+                crc = (uint32_t)(w >> (end - crcAt - 32));
+                crcAt = 0;
+                if(eos) {
+                    /* end of stream, padded to a byte boundary, another stream might follow */
+                    if(crc != comb) { if(verbose) printf("  bzip2 stream CRC mismatch\r\n"); ok = 0; }
+                    next = (blk + 80 + 7) / 8;
+                    level = eos = 0;
+                } else
+                    comb = ((comb << 1) | (comb >> 31)) ^ crc;
+            }
+            if(!level) {
+                /* stream header, BZh1 to BZh9 */
+                if(offs + j == next + 3) {
+                    if((w & 0xFFFFFF00) != 0x425A6800 || (w & 0xFF) < '1' || (w & 0xFF) > '9') ok = 0;
+                    level = (w & 0xFF) - '0';
+                    comb = 0;
+                    blk = 0;
+                }
+                continue;
+            }
+            if(eos || end < (next + 4) * 8 + 48) continue;
+            for(s = 7; s >= 0; s--) {
+                c = (w >> s) & 0xFFFFFFFFFFFFULL;
+                if(c != STREAM_BZBLOCK && c != STREAM_BZEOS) continue;
+                pos = end - s - 48;
+                if(blk) {
+                    if(!stream_addunit(unit, &num, blk >> 3, ((pos + 7) >> 3) - (blk >> 3), 0,
+                        (uint64_t)level * 100000 * 52)) { ok = 0; break; }
+                    (*unit)[num - 1].param = (blk & 7) | ((pos & 7) << 4) | (level << 8);
+                }
+                blk = pos;
+                crcAt = pos + 48;
+                if(c == STREAM_BZEOS) { eos = 1; break; }
+            }
+        }
+    free(buf);
+    if(!ok || level || eos || next != fs) { free(*unit); *unit = NULL; num = 0; }
+    return num;
+}
+
+/**
+ * Put bits into a bzip2 stream
+ */
+static void stream_bzput(unsigned char *buf, uint64_t *pos, uint64_t val, int bits)
+{
+    for(; bits--; (*pos)++)
+        if((val >> bits) & 1) buf[*pos >> 3] |= 0x80 >> (*pos & 7);
+        else buf[*pos >> 3] &= ~(0x80 >> (*pos & 7));
+}
+
+/**
+ * Find the places where a gzip input can be split: member headers, and the empty stored blocks that
+ * flushes leave behind (pigz --independent, bgzip). Units start at those, and they are only
+ * candidates, a worker that can't decode a unit leaves it to the serial decoder
+ */
+static int stream_gzindex(stream_t *ctx, uint64_t fs, stream_unit_t **unit)
+{
+    unsigned char *buf;
+    uint64_t offs, pos, last = 0, c;
+    uint32_t w = 0;
+    int num = 0, n, j, param = 1;
+
+    *unit = NULL;
+    if(!(buf = (unsigned char*)malloc(buffer_size))) return 0;
+    for(offs = 0; offs < fs && (n = stream_pread(ctx, offs, buf, buffer_size)) > 0; offs += n) {
+        for(j = 0; j < n; j++) {
+            w = (w << 8) | buf[j];
+            pos = offs + j + 1;
+            if(w == 0x0000FFFF) c = 0; else
+            if((w & 0xFFFFFF00) == 0x1F8B0800 && !(w & 0xE0) && pos > 4) { c = 1; pos -= 4; }
+            else continue;
+            if(pos >= last + STREAM_PARCHUNK && pos < fs) {
+                if(!stream_addunit(unit, &num, last, pos - last, 0, 0)) { free(buf); free(*unit); *unit = NULL; return 0; }
+                (*unit)[num - 1].param = param;
+                last = pos;
+                param = (int)c;
+            }
+        }
+        /* an ordinary gzip has no places to split at, don't read through all of it */
+        if(!num && offs + n >= 4 * STREAM_PARCHUNK) break;
+    }
+    free(buf);
+    if(!num || !stream_addunit(unit, &num, last, fs - last, 0, 0)) { free(*unit); *unit = NULL; return 0; }
+    (*unit)[num - 1].param = param;
+    return num;
+}
+
+/**
+ * Keep the last 32k of the output
+ */
+static void stream_gzwin(stream_par_t *p, char *buf, int size)
+{
+    int keep;
+
+    if(size >= (int)sizeof(p->win)) {
+        memcpy(p->win, buf + size - sizeof(p->win), sizeof(p->win));
+        p->winLen = sizeof(p->win);
+    } else {
+        keep = p->winLen < (int)sizeof(p->win) - size ? p->winLen : (int)sizeof(p->win) - size;
+        memmove(p->win, p->win + p->winLen - keep, keep);
+        memcpy(p->win + keep, buf, size);
+        p->winLen = keep + size;
+    }
+}
+
+/**
+ * Give the head unit's slot back to the workers, called with the mutex locked
+ */
+static void stream_parnext(stream_t *ctx)
+{
+    stream_par_t *p = ctx->par;
+    int i = p->head % p->numSlot;
+
+    /* a worker might be still on it */
+    while(p->head < p->next && !p->done[i]) pthread_cond_wait(&p->cond, &p->mutex);
+    p->pos = 0;
+    p->done[i] = 0;
+    ctx->cmrdSize = p->unit[p->head].offs + p->unit[p->head].size;
+    p->head++;
+    /* nobody reads the input before the head unit any more */
+    if(p->head < p->numUnit) stream_release(ctx, p->unit[p->head].offs);
+    pthread_cond_broadcast(&p->cond);
+}
+
+/**
+ * Take zlib's CRC of the member it's decoding, it checks the trailer of those itself
+ */
+static void stream_gzsync(z_stream *z, stream_gz_t *g)
+{
+    if(g->st == STREAM_GZMEM) { g->whole = 1; g->crc = (uint32_t)z->adler; g->len = z->total_out; }
+}
+
+/**
+ * Decode gzip units serially with the output so far as dictionary, until a unit ends where the next one
+ * can start. Used when the head unit couldn't be decoded by a worker
+ */
+static int stream_gzserial(stream_t *ctx, char *buf, int size)
+{
+    stream_par_t *p = ctx->par;
+    stream_unit_t *u = &p->unit[p->head];
+    z_stream *z = &ctx->zstrm;
+    unsigned char *in;
+    int r, n;
+
+    if(!p->serial) {
+        p->serial = 1;
+        p->zoffs = u->offs;
+        p->zend = u->offs + u->size;
+        /* continue the member of the previous unit */
+        stream_gzstart(&p->gz, u->param ? STREAM_GZMEM : STREAM_GZRAW, u->param || p->run.whole);
+        if(!u->param) { p->gz.crc = p->run.crc; p->gz.len = p->run.len; }
+        if(inflateReset2(z, u->param ? 31 : -MAX_WBITS) != Z_OK ||
+            (!u->param && p->winLen && inflateSetDictionary(z, p->win, p->winLen) != Z_OK)) return -1;
+        z->avail_in = 0;
+    }
+    z->next_out = (unsigned char*)buf;
+    z->avail_out = size;
+    while(z->avail_out) {
+        if(!z->avail_in && p->zoffs < p->zend) {
+            n = p->zend - p->zoffs < (uint64_t)buffer_size ? (int)(p->zend - p->zoffs) : buffer_size;
+            if(!(in = stream_at(ctx, p->zoffs, ctx->compBuf, n))) return -1;
+            z->next_in = in;
+            z->avail_in = n;
+            p->zoffs += n;
+        }
+        if((r = stream_gzrun(z, &p->gz)) < 0) { if(verbose) printf("  zlib inflate error\r\n"); return -1; }
+        if(z->avail_in || !z->avail_out || p->zoffs < p->zend) continue;
+        /* end of unit, see if the next one can be taken from the workers */
+        pthread_mutex_lock(&p->mutex);
+        stream_parnext(ctx);
+        if(p->head >= p->numUnit || (r && !p->stop)) {
+            p->serial = 0;
+            stream_gzsync(z, &p->gz);
+            p->run = p->gz;
+            pthread_mutex_unlock(&p->mutex);
+            if(!r) return -1;
+            break;
+        }
+        p->zend = p->unit[p->head].offs + p->unit[p->head].size;
+        pthread_mutex_unlock(&p->mutex);
+    }
+    return size - z->avail_out;
+}
+
+/**
+ * Add a unit decoded by a worker to the member it continues, and check the trailer if that member ended in it.
+ * Returns -1 if the CRC32 or the size doesn't match
+ */
+static int stream_gzunit(stream_par_t *p, stream_gz_t *g, int param)
+{
+    uint32_t crc;
+
+    if(!param) {
+        crc = (uint32_t)crc32_combine(p->run.crc, g->hend ? g->hcrc : g->crc, (z_off_t)(g->hend ? g->hlen : g->len));
+        if(!g->hend) { p->run.crc = crc; p->run.len += g->len; return 0; }
+        if(p->run.whole && stream_gzcheck(crc, p->run.len + g->hlen, g->htrl)) return -1;
+    }
+    /* the member at the end of this unit is the one the next unit continues */
+    p->run.whole = g->whole; p->run.crc = g->crc; p->run.len = g->len;
+    return 0;
+}
+
+/**
+ * Parallel decoder worker thread
+ */
+static void *stream_parworker(void *data)
+{
+    stream_t *ctx = (stream_t*)data;
+    stream_par_t *p = ctx->par;
+    stream_unit_t *u;
+    unsigned char *in = NULL, *src, *tmp;
+    uint64_t inSize = 0;
+    ZSTD_DCtx *zstd = NULL;
+    struct xz_dec *xz = NULL;
+    struct xz_buf xb;
+    unsigned char xh[12];
+    enum xz_ret xr;
+    unsigned char *bz = NULL;
+    uint64_t bzSize = 0, bits;
+    bz_stream bs;
+    z_stream zs;
+    stream_gz_t zg;
+    uint64_t grow;
+    int n, i, j, sh, ok, zr, zinit = 0;
+
+    while(1) {
+        pthread_mutex_lock(&p->mutex);
+        while(!p->stop && !p->err && p->next < p->numUnit && p->next >= p->head + p->numSlot)
+            pthread_cond_wait(&p->cond, &p->mutex);
+        if(p->stop || p->err || p->next >= p->numUnit) { pthread_mutex_unlock(&p->mutex); break; }
+        n = p->next++;
+        pthread_mutex_unlock(&p->mutex);
+        u = &p->unit[n];
+        i = n % p->numSlot;
+        ok = 0;
+        if(!ctx->map && u->size > inSize && (tmp = (unsigned char*)realloc(in, u->size))) { in = tmp; inSize = u->size; }
+        if((ctx->map || u->size <= inSize) && (src = stream_at(ctx, u->offs, in, (int)u->size)))
+            switch(ctx->type) {
+                case TYPE_ZSTD:
+                    if(!zstd) zstd = ZSTD_createDCtx();
+                    if(zstd) {
+                        p->len[i] = ZSTD_decompressDCtx(zstd, p->slot[i], u->bound, src, u->size);
+                        ok = !ZSTD_isError(p->len[i]) && (!u->dsize || p->len[i] == u->dsize);
+                    }
+                break;
+                case TYPE_XZ:
+                    /* feed the stream header first, then the block. The dictionary is only allocated as big as
+                     * the block needs it */
+                    if(!xz) xz = xz_dec_init(XZ_DYNALLOC, 1UL << 30);
+                    if(!xz || stream_pread(ctx, 0, xh, 12) != 12) break;
+                    xz_dec_reset(xz);
+                    xb.in = xh; xb.in_pos = 0; xb.in_size = 12;
+                    xb.out = (unsigned char*)p->slot[i]; xb.out_pos = 0; xb.out_size = u->dsize;
+                    do { xr = xz_dec_run(xz, &xb); } while(xr == XZ_UNSUPPORTED_CHECK);
+                    if(xr != XZ_OK) break;
+                    xb.in = src; xb.in_pos = 0; xb.in_size = u->size;
+                    do { xr = xz_dec_run(xz, &xb); } while(xr == XZ_OK && xb.in_pos < xb.in_size);
+                    p->len[i] = xb.out_pos;
+                    ok = xr == XZ_OK && xb.in_pos == xb.in_size && xb.out_pos == u->dsize;
+                break;
+                case TYPE_BZIP2:
+                    /* make a stream of this single block, shifted to a byte boundary. Its combined CRC is
+                     * the block's CRC, so that's checked by libbz2 too */
+                    if(u->size + 16 > bzSize && (tmp = (unsigned char*)realloc(bz, u->size + 16))) {
+                        bz = tmp; bzSize = u->size + 16;
+                    }
+                    if(u->size + 16 > bzSize) break;
+                    sh = u->param & 7;
+                    bits = u->size * 8 - sh - (u->param & 0x70 ? 8 - ((u->param >> 4) & 7) : 0);
+                    bz[0] = 'B'; bz[1] = 'Z'; bz[2] = 'h'; bz[3] = '0' + (u->param >> 8);
+                    for(j = 0; j < (int)u->size; j++)
+                        bz[4 + j] = (src[j] << sh) | (sh && j + 1 < (int)u->size ? src[j + 1] >> (8 - sh) : 0);
+                    bits += 32;
+                    stream_bzput(bz, &bits, STREAM_BZEOS, 48);
+                    stream_bzput(bz, &bits, STREAM_GET32BE(bz + 10), 32);
+                    stream_bzput(bz, &bits, 0, (8 - (bits & 7)) & 7);
+                    memset(&bs, 0, sizeof(bs));
+                    if(BZ2_bzDecompressInit(&bs, 0, 0) != BZ_OK) break;
+                    bs.next_in = (char*)bz; bs.avail_in = bits >> 3;
+                    bs.next_out = p->slot[i]; bs.avail_out = u->bound;
+                    do { j = BZ2_bzDecompress(&bs); } while(j == BZ_OK && bs.avail_in && bs.avail_out);
+                    p->len[i] = u->bound - bs.avail_out;
+                    ok = j == BZ_STREAM_END;
+                    BZ2_bzDecompressEnd(&bs);
+                break;
+                case TYPE_DEFLATE:
+                    /* no dictionary, if the unit refers to data before it, that's an error */
+                    if(!zinit) { memset(&zs, 0, sizeof(zs)); if(inflateInit2(&zs, -MAX_WBITS) != Z_OK) break; }
+                    zinit = 1;
+                    if(inflateReset2(&zs, u->param ? 31 : -MAX_WBITS) != Z_OK) break;
+                    stream_gzstart(&zg, u->param ? STREAM_GZMEM : STREAM_GZRAW, u->param);
+                    zs.next_in = src; zs.avail_in = u->size;
+                    p->len[i] = 0;
+                    zr = -1;
+                    do {
+                        if(p->len[i] == p->size[i]) {
+                            /* we don't know the decoded size, so grow the slot as needed */
+                            grow = p->size[i] ? 2 * p->size[i] : 1024 * 1024;
+                            if(grow > p->cap) grow = p->cap;
+                            if(grow <= p->size[i] || !(tmp = (unsigned char*)realloc(p->slot[i], grow))) break;
+                            p->slot[i] = (char*)tmp;
+                            p->size[i] = grow;
+                        }
+                        zs.next_out = (unsigned char*)p->slot[i] + p->len[i];
+                        zs.avail_out = p->size[i] - p->len[i];
+                        zr = stream_gzrun(&zs, &zg);
+                        p->len[i] = p->size[i] - zs.avail_out;
+                    } while(zr >= 0 && (zs.avail_in || !zs.avail_out));
+                    ok = zr == 1 && !zs.avail_in && zs.avail_out;
+                    stream_gzsync(&zs, &zg);
+                    p->ugz[i] = zg;
+                break;
+            }
+        if(!ok && verbose > (ctx->type == TYPE_DEFLATE))
+            printf("  unable to decode unit %d at %" PRIu64 "\r\n", n, u->offs);
+        pthread_mutex_lock(&p->mutex);
+        if(ok) p->done[i] = n + 1; else
+        if(ctx->type == TYPE_DEFLATE) p->done[i] = -(n + 1); else p->err = 1;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->mutex);
+    }
+    if(in) free(in);
+    if(zstd) ZSTD_freeDCtx(zstd);
+    if(xz) xz_dec_end(xz);
+    if(bz) free(bz);
+    if(zinit) inflateEnd(&zs);
+    return NULL;
+}
+
+/**
+ * Take the next buffer_size bytes from the decoded units, in order
+ */
+static int stream_pardecode(stream_t *ctx, char *buf)
+{
+    stream_par_t *p = ctx->par;
+    int i, l, size = 0;
+
+    pthread_mutex_lock(&p->mutex);
+    while(size < buffer_size && p->head < p->numUnit) {
+        i = p->head % p->numSlot;
+        if(!p->serial) {
+            while(!p->stop && !p->err && p->done[i] != p->head + 1 && p->done[i] != -(p->head + 1))
+                pthread_cond_wait(&p->cond, &p->mutex);
+            if(p->stop || p->err) { size = -1; break; }
+        }
+        if(p->serial || p->done[i] < 0) {
+            if(!p->serial && ++p->fails >= 8 && 2 * p->fails > p->head) {
+                /* units depend on each other (like pigz without --independent), no use for the workers */
+                if(verbose) printf("  units aren't independent, decoding serially\r\n");
+                p->stop = 1;
+                pthread_cond_broadcast(&p->cond);
+            }
+            pthread_mutex_unlock(&p->mutex);
+            l = stream_gzserial(ctx, buf + size, buffer_size - size);
+            if(l > 0) stream_gzwin(p, buf + size, l);
+            pthread_mutex_lock(&p->mutex);
+            if(l < 0) { size = -1; break; }
+            size += l;
+            continue;
+        }
+        l = p->len[i] - p->pos < (uint64_t)(buffer_size - size) ? (int)(p->len[i] - p->pos) : buffer_size - size;
+        pthread_mutex_unlock(&p->mutex);
+        memcpy(buf + size, p->slot[i] + p->pos, l);
+        if(ctx->type == TYPE_DEFLATE) stream_gzwin(p, buf + size, l);
+        pthread_mutex_lock(&p->mutex);
+        size += l;
+        p->pos += l;
+        /* unit done, give its slot to the workers */
+        if(p->pos == p->len[i]) {
+            if(ctx->type == TYPE_DEFLATE && stream_gzunit(p, &p->ugz[i], p->unit[p->head].param)) { size = -1; break; }
+            stream_parnext(ctx);
+        }
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return size;
+}
+
+/**
+ * Index the input, and if it consists of several independent units, start decoding those in parallel
+ */
+static void stream_parstart(stream_t *ctx)
+{
+    stream_par_t *p;
+    stream_unit_t *unit = NULL;
+    uint64_t total = 0, max = 0, pos = mytell(ctx->f);
+    int known = 1;
+    int i, num = 0, thrds = stream_ncpu();
+
+    switch(ctx->type) {
+        case TYPE_ZSTD: num = stream_zstdindex(ctx, ctx->compSize, &unit); break;
+        case TYPE_XZ: num = stream_xzindex(ctx, ctx->compSize, &unit); break;
+        /* these have to read the whole input, only worth it if there are workers to decode it */
+        case TYPE_BZIP2: if(thrds > 1) num = stream_bzindex(ctx, ctx->compSize, &unit); break;
+        case TYPE_DEFLATE: if(thrds > 1) num = stream_gzindex(ctx, ctx->compSize, &unit); break;
+    }
+    /* the serial decoder continues where stream_open() left off */
+    myseek(ctx->f, pos);
+    if(num < 1) return;
+    for(i = 0; i < num; i++) {
+        if(!unit[i].dsize) known = 0;
+        total += unit[i].dsize;
+        if(unit[i].bound > max) max = unit[i].bound;
+    }
+    /* the headers only know about their own unit, if at all */
+    ctx->fileSize = known ? total : 0;
+    if(verbose) printf(" %d units, largest %" PRIu64 " fileSize %" PRIu64 "\r\n", num, max, ctx->fileSize);
+    if(num < 2 || thrds < 2 || max > STREAM_PARUNIT || !(p = (stream_par_t*)malloc(sizeof(stream_par_t)))) {
+        free(unit);
+        return;
+    }
+    memset(p, 0, sizeof(stream_par_t));
+    p->unit = unit;
+    p->numUnit = num;
+    if(thrds > STREAM_PARMAX) thrds = STREAM_PARMAX;
+    p->numSlot = max ? STREAM_PARMEM / max : (uint64_t)(2 * thrds);
+    if(p->numSlot > 2 * thrds) p->numSlot = 2 * thrds;
+    if(max) {
+        for(i = 0; i < p->numSlot && (p->slot[i] = (char*)malloc(max)); i++) p->size[i] = max;
+        p->numSlot = i;
+        p->cap = max;
+    } else
+        /* unknown decoded sizes, the workers allocate the slots, up to an equal share of the memory */
+        p->cap = STREAM_PARMEM / p->numSlot;
+    if(thrds > p->numSlot) thrds = p->numSlot;
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_mutex_init(&p->io, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    ctx->par = p;
+    for(p->numThrd = 0; p->numThrd < thrds && !pthread_create(&p->thrd[p->numThrd], NULL, stream_parworker, ctx);
+        p->numThrd++);
+    if(!p->numThrd) {
+        ctx->par = NULL;
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->io);
+        pthread_mutex_destroy(&p->mutex);
+        for(i = 0; i < p->numSlot; i++) free(p->slot[i]);
+        free(p->unit);
+        free(p);
+        return;
+    }
+    /* start over, the first unit is decoded again by the workers */
+    ctx->avail = 0;
+    if(verbose) printf(" parallel decoding with %d threads, %d slots\r\n", p->numThrd, p->numSlot);
+}
+
+/**
+ * Stop the parallel decoder's workers
+ */
+static void stream_parstop(stream_t *ctx)
+{
+    stream_par_t *p = ctx->par;
+    int i;
+
+    if(!p) return;
+    pthread_mutex_lock(&p->mutex);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+    for(i = 0; i < p->numThrd; i++) pthread_join(p->thrd[i], NULL);
+    p->numThrd = 0;
+}
+
+/**
+ * Free the parallel decoder
+ */
+static void stream_parfree(stream_t *ctx)
+{
+    stream_par_t *p = ctx->par;
+    int i;
+
+    if(!p) return;
+    stream_parstop(ctx);
+    ctx->par = NULL;
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->io);
+    pthread_mutex_destroy(&p->mutex);
+    for(i = 0; i < p->numSlot; i++) free(p->slot[i]);
+    free(p->unit);
+    free(p);
+}
+#endif
+
+/**
+ * Get a number from an XML tag's content in a block map
+ */
+static uint64_t stream_bmaptag(char *data, char *tag)
+{
+    char *s = strstr(data, tag);
+    return s ? strtoull(s + strlen(tag), NULL, 10) : 0;
+}
+
+/**
+ * Parse a bmaptool compatible block map
+ */
+static int stream_bmapparse(stream_t *ctx, char *data, int len)
+{
+    sha256_ctx_t sha;
+    uint8_t hash[32], calc[32];
+    uint64_t bs, first, last;
+    char *s, *e;
+    int i, n;
+
+    if(!strstr(data, "<bmap")) return 0;
+    /* checksum of the file itself, calculated with the checksum replaced by zeros */
+    if((s = strstr(data, "<BmapFileChecksum>"))) {
+        for(s += 18; *s == ' '; s++);
+        for(e = s; (*e >= '0' && *e <= '9') || (*e >= 'a' && *e <= 'f'); e++);
+        if(e - s == 64) {
+            for(i = 0; i < 32; i++) hash[i] = (uint8_t)hex2bin(s + i * 2, 2);
+            memset(s, '0', 64);
+            sha256_i(&sha); sha256_u(&sha, data, len); sha256_f(&sha, calc);
+            if(memcmp(calc, hash, 32)) {
+                if(verbose) printf("  bmap file checksum mismatch\r\n");
+                return 0;
+            }
+        }
+    }
+    ctx->bmapSize = stream_bmaptag(data, "<ImageSize>");
+    bs = stream_bmaptag(data, "<BlockSize>");
+    s = strstr(data, "<ChecksumType>");
+    ctx->bmapHash = s && !memcmp(s + 14 + strspn(s + 14, " "), "sha256", 6);
+    for(n = 0, s = data; (s = strstr(s, "<Range")); s++, n++);
+    if(!ctx->bmapSize || !bs || !n) return 0;
+    /* the unmapped areas aren't written, so without checksums (or with sha1 and md5 ones from bmaptool 1.x)
+     * a map which isn't for this image could silently leave out data */
+    if(!ctx->bmapHash) {
+        if(verbose) printf("  bmap has no sha256 checksums, ignoring it\r\n");
+        return 0;
+    }
+    ctx->bmap = (stream_range_t*)malloc(n * sizeof(stream_range_t));
+    if(!ctx->bmap) return 0;
+    memset(ctx->bmap, 0, n * sizeof(stream_range_t));
+    for(ctx->numBmap = 0, s = data; (s = strstr(s, "<Range")); ctx->numBmap++) {
+        e = strchr(s, '>');
+        if(!e) break;
+        if(ctx->bmapHash) {
+            s = strstr(s, "chksum=\"");
+            if(!s || s > e) break;
+            for(i = 0, s += 8; i < 32; i++) ctx->bmap[ctx->numBmap].chksum[i] = (uint8_t)hex2bin(s + i * 2, 2);
+        }
+        first = last = strtoull(e + 1, &s, 10);
+        while(*s == ' ') s++;
+        if(*s == '-') last = strtoull(s + 1, &s, 10);
+        ctx->bmap[ctx->numBmap].start = first * bs;
+        ctx->bmap[ctx->numBmap].end = (last + 1) * bs;
+        if(ctx->bmap[ctx->numBmap].end > ctx->bmapSize) ctx->bmap[ctx->numBmap].end = ctx->bmapSize;
+        /* ranges must be in order and not overlapping */
+        if(last < first || ctx->bmap[ctx->numBmap].start >= ctx->bmapSize || (ctx->numBmap &&
+            ctx->bmap[ctx->numBmap].start < ctx->bmap[ctx->numBmap - 1].end)) break;
+    }
+    if(ctx->numBmap != n) {
+        if(verbose) printf("  bad bmap range %d\r\n", ctx->numBmap);
+        free(ctx->bmap); ctx->bmap = NULL; ctx->numBmap = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Look for a block map next to the image, like "image.img.xz.bmap", "image.img.bmap" or "image.bmap"
+ */
+static void stream_bmap(stream_t *ctx, char *fn)
+{
+    FILE *f;
+    char *name, *data, *s;
+    int len, l;
+
+    name = (char*)malloc(strlen(fn) + 6);
+    if(!name) return;
+    strcpy(name, fn);
+    for(f = NULL; !f;) {
+        l = strlen(name);
+        strcpy(name + l, ".bmap");
+        f = stream_fopen(name, "rb");
+        name[l] = 0;
+        for(s = name + l - 1; s > name && *s != '.' && *s != '/' && *s != '\\'; s--);
+        if(s <= name || *s != '.') break;
+        *s = 0;
+    }
+    free(name);
+    if(!f) return;
+    fseek(f, 0, SEEK_END);
+    len = (int)ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if(len > 0 && (data = (char*)malloc(len + 1))) {
+        if(fread(data, 1, len, f) == (size_t)len) {
+            data[len] = 0;
+            stream_bmapparse(ctx, data, len);
+        }
+        free(data);
+    }
+    fclose(f);
+}
+
+#ifndef WINVER
+/**
+ * Look for a sha256sum compatible checksum of the input next to it, like "image.img.xz.sha256" or
+ * "image.img.xz.sha256sum". Lines without a file name or with the input's name are accepted
+ */
+static void stream_sumfile(stream_t *ctx, char *fn)
+{
+    FILE *f = NULL;
+    char *name, *data, *s, *e, *n, *base;
+    int len, i, l;
+
+    name = (char*)malloc(strlen(fn) + 11);
+    if(!name) return;
+    strcpy(name, fn); l = strlen(name);
+    strcpy(name + l, ".sha256");
+    if(!(f = stream_fopen(name, "rb"))) {
+        strcpy(name + l, ".sha256sum");
+        f = stream_fopen(name, "rb");
+    }
+    if(!f) { free(name); return; }
+    for(base = fn + strlen(fn); base > fn && base[-1] != '/' && base[-1] != '\\'; base--);
+    fseek(f, 0, SEEK_END);
+    len = (int)ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if(len > 0 && len < 1024*1024 && (data = (char*)malloc(len + 1))) {
+        if(fread(data, 1, len, f) == (size_t)len) {
+            data[len] = 0;
+            for(s = data; *s && !ctx->sum; s = *e ? e + 1 : e) {
+                for(e = s; *e && *e != '\n'; e++);
+                for(i = 0; i < 64 && ((s[i] >= '0' && s[i] <= '9') || ((s[i] | 0x20) >= 'a' && (s[i] | 0x20) <= 'f')); i++);
+                if(i < 64 || (s + 64 < e && s[64] != ' ' && s[64] != '\t' && s[64] != '\r')) continue;
+                /* file name after the hash, "*" marks binary mode */
+                for(n = s + 64; n < e && (*n == ' ' || *n == '\t'); n++);
+                if(n < e && *n == '*') n++;
+                for(l = (int)(e - n); l > 0 && (n[l - 1] == '\r' || n[l - 1] == ' '); l--);
+                if(l > 0 && (l != (int)strlen(base) || memcmp(n, base, l))) continue;
+                if(!(ctx->sum = (stream_sum_t*)malloc(sizeof(stream_sum_t)))) break;
+                memset(ctx->sum, 0, sizeof(stream_sum_t));
+                for(i = 0; i < 32; i++) ctx->sum->want[i] = (uint8_t)hex2bin(s + i * 2, 2);
+                ctx->sum->name = name; name = NULL;
+            }
+            if(verbose) printf(" checksum file %s%s\r\n", ctx->sum ? ctx->sum->name : name,
+                ctx->sum ? "" : " has no checksum for the input, ignoring it");
+        }
+        free(data);
+    }
+    if(name) free(name);
+    fclose(f);
+}
+
+/**
+ * Hash the whole input file for stream_sumcheck(), from the mapping if there's one, otherwise with pread,
+ * which doesn't move the file position the decoder reads from. Either way the pages are shared with
+ * the decoder in the page cache, so the input isn't read from the disk twice
+ */
+static void *stream_sumthread(void *data)
+{
+    stream_t *ctx = (stream_t*)data;
+    stream_sum_t *s = ctx->sum;
+    sha256_ctx_t sha;
+    uint8_t hash[32];
+    unsigned char *buf = NULL, *in;
+    uint64_t pos = 0;
+    int n;
+
+    sha256_i(&sha);
+    if(!ctx->map) buf = (unsigned char*)malloc(STREAM_SUMBLK);
+    pthread_mutex_lock(&s->mutex);
+    while(!s->stop && pos < s->size) {
+        pthread_mutex_unlock(&s->mutex);
+        n = s->size - pos < STREAM_SUMBLK ? (int)(s->size - pos) : STREAM_SUMBLK;
+        if(ctx->map) in = ctx->map + pos;
+        else in = buf && pread(s->fd, buf, n, (off_t)pos) == n ? buf : NULL;
+        if(in) sha256_u(&sha, in, n);
+        pthread_mutex_lock(&s->mutex);
+        if(!in) break;
+        s->pos = pos += (uint64_t)n;
+    }
+    if(pos == s->size) {
+        sha256_f(&sha, hash);
+        s->state = memcmp(hash, s->want, 32) ? -1 : 1;
+        if(verbose) printf("stream_sumthread() input checksum %s %s\r\n", s->state > 0 ? "matches" : "MISMATCH", s->name);
+    } else {
+        s->state = 2;
+        if(verbose && !s->stop) printf("stream_sumthread() unable to read the input, not checked\r\n");
+    }
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->mutex);
+    if(buf) free(buf);
+    return NULL;
+}
+
+/**
+ * Start checking the input against the sidecar checksum found by stream_sumfile()
+ */
+static void stream_sumstart(stream_t *ctx)
+{
+    stream_sum_t *s = ctx->sum;
+    struct stat st;
+
+    if(!s) return;
+    if(!fstat(fileno(ctx->f), &st) && S_ISREG(st.st_mode)) {
+        s->fd = fileno(ctx->f);
+        s->size = (uint64_t)st.st_size;
+        pthread_mutex_init(&s->mutex, NULL);
+        pthread_cond_init(&s->cond, NULL);
+        if(!pthread_create(&s->thrd, NULL, stream_sumthread, ctx)) { s->run = 1; return; }
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->mutex);
+    }
+    if(verbose) printf(" unable to check the input against %s\r\n", s->name);
+    free(s->name); free(s);
+    ctx->sum = NULL;
+}
+
+/**
+ * Returns -1 if the input doesn't match its sidecar checksum. Unless wait is set, it doesn't wait
+ * for the hashing to finish, just checks if it has already found a mismatch
+ */
+static int stream_sumcheck(stream_t *ctx, int wait)
+{
+    stream_sum_t *s = ctx->sum;
+    int ret;
+
+    if(!s || !s->run) return 0;
+    pthread_mutex_lock(&s->mutex);
+    while(wait && !s->state) pthread_cond_wait(&s->cond, &s->mutex);
+    ret = s->state;
+    pthread_mutex_unlock(&s->mutex);
+    return ret < 0 ? -1 : 0;
+}
+
+/**
+ * Stop the input checking thread
+ */
+static void stream_sumstop(stream_t *ctx)
+{
+    stream_sum_t *s = ctx->sum;
+
+    if(!s) return;
+    if(s->run) {
+        pthread_mutex_lock(&s->mutex);
+        s->stop = 1;
+        pthread_mutex_unlock(&s->mutex);
+        pthread_join(s->thrd, NULL);
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->mutex);
+    }
+    free(s->name); free(s);
+    ctx->sum = NULL;
+}
+/**
+ * Key of the input in the cache, from its size, modification time and its first and last bytes. Compressed
+ * formats end in the checksum and size of their content, so the content is covered too
+ */
+static uint64_t stream_cachekey(int fd, struct stat *st)
+{
+    XXH64_state_t xxh;
+    uint64_t meta[2];
+    char *buf;
+    int n;
+
+    if(!(buf = (char*)malloc(STREAM_CACHEKEY))) return 0;
+    XXH64_reset(&xxh, 0);
+    meta[0] = (uint64_t)st->st_size; meta[1] = (uint64_t)st->st_mtime;
+    XXH64_update(&xxh, meta, sizeof(meta));
+    if((n = pread(fd, buf, STREAM_CACHEKEY, 0)) > 0) XXH64_update(&xxh, buf, n);
+    if(st->st_size > STREAM_CACHEKEY) {
+        n = pread(fd, buf, STREAM_CACHEKEY, st->st_size > 2 * STREAM_CACHEKEY ? st->st_size - STREAM_CACHEKEY :
+            STREAM_CACHEKEY);
+        if(n > 0) XXH64_update(&xxh, buf, n);
+    }
+    free(buf);
+    return XXH64_digest(&xxh);
+}
+
+/**
+ * Turn the gaps in the block map of a cache entry into holes, like stream_holes() finds them in a sparse file
+ */
+static void stream_cacheholes(stream_t *ctx, char *fn, uint64_t size)
+{
+    FILE *f;
+    char *data;
+    uint64_t s, e;
+    int len, i;
+
+    if(ctx->bmap || !(f = stream_fopen(fn, "rb"))) return;
+    fseek(f, 0, SEEK_END);
+    len = (int)ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if(len > 0 && (data = (char*)malloc(len + 1))) {
+        if(fread(data, 1, len, f) == (size_t)len) {
+            data[len] = 0;
+            if(stream_bmapparse(ctx, data, len) && ctx->bmapSize == size &&
+              (ctx->holes = (uint64_t*)malloc((ctx->numBmap + 1) * 2 * sizeof(uint64_t)))) {
+                /* the gaps before the ranges and after the last one */
+                for(i = 0, s = 0; i <= ctx->numBmap; i++) {
+                    s = (s + 511) & ~511ULL;
+                    e = i < ctx->numBmap ? ctx->bmap[i].start & ~511ULL : (size + 511) & ~511ULL;
+                    if(e > s && e - s >= STREAM_HOLEMIN) {
+                        ctx->holes[ctx->numHoles * 2] = s;
+                        ctx->holes[ctx->numHoles * 2 + 1] = e;
+                        ctx->numHoles++;
+                    }
+                    if(i < ctx->numBmap) s = ctx->bmap[i].end;
+                }
+            }
+        }
+        free(data);
+    }
+    fclose(f);
+    /* the block map was only needed for the holes, the whole entry is read */
+    if(ctx->bmap) { free(ctx->bmap); ctx->bmap = NULL; }
+    ctx->numBmap = 0; ctx->bmapSize = 0; ctx->bmapHash = 0;
+    if(ctx->holes && !ctx->numHoles) { free(ctx->holes); ctx->holes = NULL; }
+    if(verbose && ctx->numHoles) {
+        for(s = 0, i = 0; i < ctx->numHoles; i++) s += ctx->holes[i * 2 + 1] - ctx->holes[i * 2];
+        printf(" cache block map, %d holes, %" PRIu64 " bytes\r\n", ctx->numHoles, s);
+    }
+}
+
+/**
+ * If the input has been decoded before, continue with the decoded copy from the cache. Otherwise just
+ * remember its key, so that stream_cachestart() can add it
+ */
+static int stream_cachefind(stream_t *ctx, struct stat *st)
+{
+    FILE *f;
+    char *name;
+    uint64_t key;
+    int l;
+
+    if(!cache_dir || !S_ISREG(st->st_mode) || !(key = stream_cachekey(fileno(ctx->f), st))) return 0;
+    if(!(name = (char*)malloc(strlen(cache_dir) + 32))) return 0;
+    l = sprintf(name, "%s/%016" PRIx64, cache_dir, key);
+    strcpy(name + l, ".img");
+    if(!(f = stream_fopen(name, "rb")) || fstat(fileno(f), st)) {
+        if(f) fclose(f);
+        free(name);
+        ctx->teeKey = key;
+        return 0;
+    }
+    if(verbose) printf(" decoded copy in the cache %s\r\n", name);
+    /* it's the most recently used entry now */
+    futimens(fileno(f), NULL);
+    fclose(ctx->f);
+    ctx->f = f;
+    strcpy(name + l, ".bmap");
+    stream_cacheholes(ctx, name, (uint64_t)st->st_size);
+    free(name);
+    return 1;
+}
+
+/**
+ * Start writing the decoded input into the cache, just like a raw backup, with a block map of the non-zero
+ * blocks. If another instance is already writing the same entry, this one leaves it to that
+ */
+static void stream_cachestart(stream_t *ctx)
+{
+    stream_t *tee;
+    char *tmp;
+    int fd;
+
+    if(!ctx->teeKey || ctx->type == TYPE_PLAIN || ctx->bmap) return;
+    if((ctx->teeName = (char*)malloc(strlen(cache_dir) + 32))) {
+        sprintf(ctx->teeName, "%s/%016" PRIx64, cache_dir, ctx->teeKey);
+        tmp = (char*)malloc(strlen(ctx->teeName) + 5);
+        if(tmp) sprintf(tmp, "%s.tmp", ctx->teeName);
+        if(tmp && (fd = open(tmp, O_WRONLY | O_CREAT, 0644)) >= 0) {
+            if(!flock(fd, LOCK_EX | LOCK_NB) && (tee = (stream_t*)malloc(sizeof(stream_t)))) {
+                /* the size isn't known in advance for all formats, it's set at the end */
+                if(!stream_create(tee, tmp, 0, ctx->fileSize ? ctx->fileSize : (uint64_t)-1)) {
+                    /* the data is written straight from the decoder's buffer */
+                    free(tee->compBuf); tee->compBuf = NULL;
+                    stream_free(tee->buffer); tee->buffer = NULL;
+                    ctx->tee = tee;
+                    ctx->teeLock = fd;
+                    free(tmp);
+                    return;
+                }
+                free(tee);
+            }
+            close(fd);
+        }
+        if(tmp) free(tmp);
+        free(ctx->teeName); ctx->teeName = NULL;
+    }
+}
+
+/**
+ * Remove the least recently used entries until the cache is below its size limit. Entries are touched when
+ * they are used, so the oldest modification time is the one which wasn't needed for the longest time
+ */
+static void stream_cacheevict(void)
+{
+    DIR *dir;
+    struct dirent *de;
+    struct stat st;
+    char *name, *old;
+    uint64_t total;
+    time_t oldest = 0;
+    int l = strlen(cache_dir), fd;
+
+    name = (char*)malloc(l + 32);
+    old = (char*)malloc(l + 32);
+    while(name && old && (dir = opendir(cache_dir))) {
+        total = 0; old[0] = 0;
+        while((de = readdir(dir))) {
+            if(strlen(de->d_name) != 20 || strspn(de->d_name, "0123456789abcdef") != 16) continue;
+            sprintf(name, "%s/%s", cache_dir, de->d_name);
+            /* an entry which isn't locked any more was left behind by an instance that didn't finish it */
+            if(!strcmp(de->d_name + 16, ".tmp") && (fd = open(name, O_RDONLY)) >= 0) {
+                if(!flock(fd, LOCK_EX | LOCK_NB)) unlink(name);
+                close(fd);
+            }
+            if(strcmp(de->d_name + 16, ".img")) continue;
+            if(stat(name, &st) || !S_ISREG(st.st_mode)) continue;
+            /* the entries are sparse, count what they actually use */
+            total += (uint64_t)st.st_blocks * 512;
+            if(!old[0] || st.st_mtime < oldest) { oldest = st.st_mtime; strcpy(old, name); }
+        }
+        closedir(dir);
+        if(total <= cache_max || !old[0]) break;
+        if(verbose) printf("stream_close() cache %" PRIu64 " bytes, removing %s\r\n", total, old);
+        unlink(old);
+        strcpy(old + strlen(old) - 4, ".bmap");
+        unlink(old);
+    }
+    if(name) free(name);
+    if(old) free(old);
+}
+
+/**
+ * Finish writing the cache entry. If ok is set, then the whole input was decoded without errors, and the
+ * entry is added to the cache, otherwise it's thrown away
+ */
+static void stream_cachestop(stream_t *ctx, int ok)
+{
+    stream_t *tee = (stream_t*)ctx->tee;
+    char *tmp, *name;
+    int l;
+
+    if(!tee) return;
+    ctx->tee = NULL;
+    l = strlen(ctx->teeName);
+    tmp = (char*)malloc(l + 16);
+    name = (char*)malloc(l + 16);
+    if(!tmp || !name) ok = 0;
+    if(ok) {
+        /* the size of some formats' content is only known by now, and the image might end in zeros */
+        tee->fileSize = tee->readSize;
+        ok = !fflush(tee->f) && !ftruncate(fileno(tee->f), (off_t)tee->fileSize);
+    }
+    if(!ok) { free(tee->bmapName); tee->bmapName = NULL; }
+    stream_close(tee);
+    free(tee);
+    if(tmp && name) {
+        sprintf(tmp, "%s.tmp.bmap", ctx->teeName);
+        sprintf(name, "%s.bmap", ctx->teeName);
+        if(ok) rename(tmp, name); else unlink(tmp);
+        sprintf(tmp, "%s.tmp", ctx->teeName);
+        sprintf(name, "%s.img", ctx->teeName);
+        if(ok && rename(tmp, name)) ok = 0;
+        if(!ok) unlink(tmp);
+    }
+    close(ctx->teeLock);
+    if(ok) {
+        if(verbose) printf("stream_close() decoded image added to the cache %s\r\n", name);
+        stream_cacheevict();
+    }
+    if(tmp) free(tmp);
+    if(name) free(name);
+    free(ctx->teeName); ctx->teeName = NULL;
+}
+
+/**
+ * Add the data decoded at offs to the cache entry, at the end of the input the entry is finished
+ */
+static void stream_cachewrite(stream_t *ctx, uint64_t offs, int size)
+{
+    stream_t *tee = (stream_t*)ctx->tee;
+
+    if(size < 1) { stream_cachestop(ctx, 1); return; }
+    /* not the padding of the last sector, that would be in the block map's last checksum */
+    if(ctx->fileSize && offs < ctx->fileSize && offs + (uint64_t)size > ctx->fileSize) size = (int)(ctx->fileSize - offs);
+    if(offs == tee->readSize && stream_write(tee, ctx->buffer, size) == size) return;
+    if(verbose) printf("stream_read() unable to write the cache entry %s\r\n", errno ? strerror(errno) : "");
+    stream_cachestop(ctx, 0);
+}
+#endif
+
 /**
  * Open file and determine the source's format
  */
 #define HEADER_SIZE 65536
 int stream_open(stream_t *ctx, char *fn, int uncompr)
 {
-    unsigned char *buff;
+    unsigned char *buff, *in;
     char *url = NULL, *s, *d;
     uint64_t fs = 0, hs = 0, zr;
     int64_t insiz;
-    int x = 0, y;
+    int x = 0, y, par = 0;
 #ifndef WINVER
     struct stat st;
 #endif
 
     errno = 0;
     memset(ctx, 0, sizeof(stream_t));
-    sha256_i(&ctx->sha);
+    /* select the kernels before any decoder thread could race for it */
+    kernels_init();
+    ctx->cksum = checksum;
+    switch(ctx->cksum) {
+        case STREAM_XXH64: XXH64_reset(&ctx->xxh, 0); break;
+        case STREAM_CRC32C: break;
+        default: sha256_i(&ctx->sha); break;
+    }
     if(!fn || !*fn) return 1;
     /* some DE uses URL on file drag'n'drop instead of a path */
     if(!memcmp(fn, "file://", 7)) {
@@ -336,7 +1858,7 @@ int stream_open(stream_t *ctx, char *fn, int uncompr)
         return 1;
     }
     memset(ctx->compBuf, 0, buffer_size);
-    ctx->verifyBuf = (char*)malloc(buffer_size);
+    ctx->verifyBuf = stream_alloc();
     if(!ctx->verifyBuf) {
         main_getErrorMessage();
         if(url) free(url);
@@ -344,24 +1866,35 @@ int stream_open(stream_t *ctx, char *fn, int uncompr)
         return 1;
     }
     memset(ctx->verifyBuf, 0, buffer_size);
-    ctx->buffer = (char*)malloc(buffer_size);
+    ctx->buffer = stream_alloc();
     if(!ctx->buffer) {
         main_getErrorMessage();
         if(url) free(url);
         free(ctx->compBuf); ctx->compBuf = NULL;
-        free(ctx->verifyBuf); ctx->verifyBuf = NULL;
+        stream_free(ctx->verifyBuf); ctx->verifyBuf = NULL;
         return 1;
     }
     memset(ctx->buffer, 0, buffer_size);
 
+    if(!uncompr) stream_bmap(ctx, fn);
+#ifndef WINVER
+    stream_sumfile(ctx, fn);
+#endif
     ctx->f = stream_fopen(fn, "rb");
     if(url) free(url);
     if(!ctx->f) return 1;
 #ifdef WINVER
     fs = (uint64_t)_filelengthi64(_fileno(ctx->f));
 #else
-    if(!fstat(fileno(ctx->f), &st))
+    if(!fstat(fileno(ctx->f), &st)) {
         fs = (uint64_t)st.st_size;
+        /* the decoded copy is a raw image, and the sidecar checksum isn't for that */
+        if(!uncompr && stream_cachefind(ctx, &st)) {
+            fs = (uint64_t)st.st_size;
+            uncompr = 1;
+            stream_sumstop(ctx);
+        }
+    }
 #endif
     ctx->avail = 0;
     if(!uncompr) {
@@ -374,6 +1907,7 @@ int stream_open(stream_t *ctx, char *fn, int uncompr)
     if(ctx->compBuf[0] == 0x1f && ctx->compBuf[1] == 0x8b) {
         /* gzip */
         if(verbose) printf(" gzip\r\n");
+        par = 1;
         /* see issue #109, this might cause errors if uncompressed size is actually bigger than 4G,
          * therefore don't mind the trailer, assume we don't know the uncompressed size */
 /*
@@ -382,7 +1916,8 @@ int stream_open(stream_t *ctx, char *fn, int uncompr)
             ctx->fileSize = 0;
         myseek(ctx->f, hs);
 */
-        ctx->compSize = fs - 8;
+        /* the trailer is read too, so that the last member's CRC32 can be checked */
+        ctx->compSize = fs;
         ctx->cmrdSize = hs;
         buff = ctx->compBuf + 3;
         x = *buff++; buff += 6;
@@ -391,22 +1926,25 @@ int stream_open(stream_t *ctx, char *fn, int uncompr)
         if(x & 16) { while(*buff++ != 0); }
         if(x & 2) buff += 2;
         ctx->type = TYPE_DEFLATE;
+        stream_gzstart(&ctx->gz, STREAM_GZRAW, 1);
         if((inflateInit2(&ctx->zstrm, -MAX_WBITS)) != Z_OK) { fclose(ctx->f); return 4; }
         ctx->zstrm.next_out = (unsigned char*)ctx->buffer;
         ctx->zstrm.avail_out = HEADER_SIZE;
         ctx->zstrm.next_in = buff;
         ctx->zstrm.avail_in = hs - (uint64_t)(buff - ctx->compBuf);
+        x = Z_OK;
         do {
             if(!ctx->zstrm.avail_in) {
                 insiz = ctx->compSize - ctx->cmrdSize;
                 if(insiz < 1) { x = Z_STREAM_END; break; }
                 if(insiz > buffer_size) insiz = buffer_size;
-                ctx->zstrm.next_in = ctx->compBuf;
+                if(!(in = stream_in(ctx, insiz))) break;
+                ctx->zstrm.next_in = in;
                 ctx->zstrm.avail_in = insiz;
-                if(!fread(ctx->compBuf, insiz, 1, ctx->f)) break;
                 ctx->cmrdSize += (uint64_t)insiz;
             }
-            x = inflate(&ctx->zstrm, Z_NO_FLUSH);
+            /* there might be more members, bgzip has lots of small ones */
+            if(stream_gzrun(&ctx->zstrm, &ctx->gz) < 0) x = Z_DATA_ERROR;
         } while(x == Z_OK && ctx->zstrm.avail_out > 0);
         if(x != Z_OK) {
             if(verbose) printf("  zlib inflate error %d\r\n", x);
@@ -417,6 +1955,7 @@ int stream_open(stream_t *ctx, char *fn, int uncompr)
     if(ctx->compBuf[0] == 'B' && ctx->compBuf[1] == 'Z' && ctx->compBuf[2] == 'h') {
         /* bzip2 */
         if(verbose) printf(" bzip2\r\n");
+        par = 1;
         ctx->compSize = fs;
         ctx->cmrdSize = hs;
         ctx->type = TYPE_BZIP2;
@@ -430,9 +1969,9 @@ int stream_open(stream_t *ctx, char *fn, int uncompr)
                 insiz = ctx->compSize - ctx->cmrdSize;
                 if(insiz < 1) { x = BZ_STREAM_END; break; }
                 if(insiz > buffer_size) insiz = buffer_size;
-                ctx->bstrm.next_in = (char*)ctx->compBuf;
+                if(!(in = stream_in(ctx, insiz))) break;
+                ctx->bstrm.next_in = (char*)in;
                 ctx->bstrm.avail_in = insiz;
-                if(!fread(ctx->compBuf, insiz, 1, ctx->f)) break;
                 ctx->cmrdSize += insiz;
             }
             x = BZ2_bzDecompress(&ctx->bstrm);
@@ -447,6 +1986,7 @@ int stream_open(stream_t *ctx, char *fn, int uncompr)
         ctx->compBuf[4] == 'Z') {
         /* xz */
         if(verbose) printf(" xz\r\n");
+        par = 1;
         ctx->compSize = fs;
         ctx->cmrdSize = hs;
         ctx->type = TYPE_XZ;
@@ -464,10 +2004,10 @@ int stream_open(stream_t *ctx, char *fn, int uncompr)
                 insiz = ctx->compSize - ctx->cmrdSize;
                 if(insiz < 1) { x = XZ_STREAM_END; break; }
                 if(insiz > buffer_size) insiz = buffer_size;
-                ctx->xstrm.in = (unsigned char*)ctx->compBuf;
+                if(!(in = stream_in(ctx, insiz))) break;
+                ctx->xstrm.in = in;
                 ctx->xstrm.in_pos = 0;
                 ctx->xstrm.in_size = insiz;
-                if(!fread(ctx->compBuf, insiz, 1, ctx->f)) break;
                 ctx->cmrdSize += (uint64_t)insiz;
             }
             x = xz_dec_run(ctx->xz, &ctx->xstrm);
@@ -484,9 +2024,12 @@ int stream_open(stream_t *ctx, char *fn, int uncompr)
         }
         ctx->avail = ctx->xstrm.out_pos;
     } else
-    if(ctx->compBuf[0] == 0x28 && ctx->compBuf[1] == 0xB5 && ctx->compBuf[2] == 0x2F && ctx->compBuf[3] == 0xFD) {
+    if((ctx->compBuf[0] == 0x28 && ctx->compBuf[1] == 0xB5 && ctx->compBuf[2] == 0x2F && ctx->compBuf[3] == 0xFD) ||
+        /* or starts with a skippable frame, like pzstd's output */
+        ((ctx->compBuf[0] & 0xF0) == 0x50 && ctx->compBuf[1] == 0x2A && ctx->compBuf[2] == 0x4D && ctx->compBuf[3] == 0x18)) {
         /* zstandard */
         if(verbose) printf(" zstd\r\n");
+        par = 1;
         ctx->compSize = fs;
         ctx->cmrdSize = hs;
         zr = (uint64_t)ZSTD_getFrameContentSize(ctx->compBuf, buffer_size);
@@ -508,10 +2051,10 @@ int stream_open(stream_t *ctx, char *fn, int uncompr)
                 insiz = ctx->compSize - ctx->cmrdSize;
                 if(insiz < 1) { x = 0; break; }
                 if(insiz > buffer_size) insiz = buffer_size;
-                ctx->zi.src = ctx->compBuf;
+                if(!(in = stream_in(ctx, insiz))) break;
+                ctx->zi.src = in;
                 ctx->zi.pos = 0;
                 ctx->zi.size = insiz;
-                if(!fread(ctx->compBuf, insiz, 1, ctx->f)) break;
                 ctx->cmrdSize += (uint64_t)insiz;
             }
             x = (int) ZSTD_decompressStream(ctx->zstd, &ctx->zo, &ctx->zi);
@@ -565,6 +2108,9 @@ int stream_open(stream_t *ctx, char *fn, int uncompr)
                     }
             if(!ctx->compSize || !ctx->fileSize) { fclose(ctx->f); return 2; }
         }
+        /* with a data descriptor the CRC32 is after the data, not here */
+        ctx->zipCheck = !(ctx->compBuf[6] & 8);
+        ctx->zipWant = STREAM_GET32(ctx->compBuf + 14);
         myseek(ctx->f, (uint64_t)(30 + ctx->compBuf[26] + (ctx->compBuf[27]<<8) + ctx->compBuf[28] + (ctx->compBuf[29]<<8)));
     } else
     if(ctx->compBuf[0] == 'Z' && ctx->compBuf[1] == 'Z' && ctx->compBuf[2] == 'z' && ctx->compBuf[3] == 0x1A) {
@@ -650,6 +2196,8 @@ int stream_open(stream_t *ctx, char *fn, int uncompr)
             if(x < 2 || ctx->buffer[15]) { fclose(ctx->f); return 2; }
             memcpy(&ctx->fileSize, ctx->buffer + 16, 8);
         }
+        /* images in archives aren't split into units at their boundaries */
+        if(fs) par = 0;
         if(ctx->type == TYPE_PLAIN) {
             myseek(ctx->f, fs);
             ctx->avail = 0;
@@ -661,40 +2209,70 @@ int stream_open(stream_t *ctx, char *fn, int uncompr)
             memcpy(ctx->buffer, ctx->buffer + fs, ctx->avail - fs);
             ctx->avail -= fs;
         }
-        ctx->readSize = ctx->avail;
     }
     if(verbose) printf(" type %d compSize %" PRIu64 " fileSize %" PRIu64
         " avail %" PRIu64 " data offset %" PRIu64 "\r\n",
         ctx->type, ctx->compSize, ctx->fileSize, ctx->avail, mytell(ctx->f));
     if(!ctx->compSize && !ctx->fileSize) { fclose(ctx->f); return 1; }
+    /* raw images are read straight into the buffer anyway, or copied by the kernel */
+    if(ctx->type != TYPE_PLAIN) stream_map(ctx);
+#ifndef WINVER
+    stream_sumstart(ctx);
+    if(par) stream_parstart(ctx);
+#else
+    (void)par;
+#endif
+    if(ctx->bmap) {
+        if(ctx->fileSize && ctx->fileSize != ctx->bmapSize) {
+            if(verbose) printf(" bmap image size %" PRIu64 " doesn't match, ignoring it\r\n", ctx->bmapSize);
+            free(ctx->bmap); ctx->bmap = NULL;
+        } else {
+            if(verbose) printf(" bmap %d ranges, image size %" PRIu64 "%s\r\n", ctx->numBmap, ctx->bmapSize,
+                ctx->bmapHash ? ", sha256 checksums" : "");
+            /* if the size isn't known in advance, it's checked once everything is decoded */
+            ctx->bmapCheck = !ctx->fileSize;
+            ctx->fileSize = ctx->bmapSize;
+            sha256_i(&ctx->bsha);
+        }
+    }
+#ifndef WINVER
+    if(ctx->type == TYPE_PLAIN && !ctx->bmap && !ctx->holes) stream_holes(ctx);
+    stream_cachestart(ctx);
+#endif
 
     ctx->start = time(NULL);
     return 0;
 }
 
 /**
- * Read no more than buffer_size uncompressed bytes of source data
+ * Decode no more than buffer_size uncompressed bytes of source data into buf
  */
-int stream_read(stream_t *ctx)
+static int stream_decode(stream_t *ctx, char *buf)
 {
+    unsigned char *in;
     int ret = 0;
     int64_t size = 0, insiz;
 
     errno = 0;
-    size = ctx->fileSize - ctx->readSize;
+    size = ctx->fileSize - ctx->decSize;
     if(size < 1) { if(ctx->fileSize) return 0; size = 0; }
     if(size > buffer_size) size = buffer_size;
     if(verbose > 1)
-        printf("stream_read() readSize %" PRIu64 " / fileSize %" PRIu64 " (input size %"
+        printf("stream_decode() decSize %" PRIu64 " / fileSize %" PRIu64 " (input size %"
             PRId64 "), cmrdSize %" PRIu64 " / compSize %" PRIu64 "u\r\n",
-            ctx->readSize, ctx->fileSize, size, ctx->cmrdSize, ctx->compSize);
+            ctx->decSize, ctx->fileSize, size, ctx->cmrdSize, ctx->compSize);
 
+#ifndef WINVER
+    if(ctx->par) {
+        if((size = stream_pardecode(ctx, buf)) < 0) return -1;
+    } else
+#endif
     switch(ctx->type) {
         case TYPE_PLAIN:
-            if(!(size = fread(ctx->buffer + ctx->avail, 1, size, ctx->f))) {}
+            if(!(size = fread(buf + ctx->avail, 1, size, ctx->f))) {}
         break;
         case TYPE_DEFLATE:
-            ctx->zstrm.next_out = (unsigned char*)ctx->buffer + ctx->avail;
+            ctx->zstrm.next_out = (unsigned char*)buf + ctx->avail;
             ctx->zstrm.avail_out = buffer_size - ctx->avail;
             do {
                 if(!ctx->zstrm.avail_in) {
@@ -703,12 +2281,12 @@ int stream_read(stream_t *ctx)
                     if(insiz > buffer_size) insiz = buffer_size;
                     if(verbose > 1) printf("  deflate cmrdSize %" PRIu64
                         " insiz %" PRId64 "\r\n", ctx->cmrdSize, insiz);
-                    ctx->zstrm.next_in = ctx->compBuf;
+                    if(!(in = stream_in(ctx, insiz))) break;
+                    ctx->zstrm.next_in = in;
                     ctx->zstrm.avail_in = insiz;
-                    if(!fread(ctx->compBuf, insiz, 1, ctx->f)) break;
                     ctx->cmrdSize += (uint64_t)insiz;
                 }
-                ret = inflate(&ctx->zstrm, Z_NO_FLUSH);
+                if(stream_gzrun(&ctx->zstrm, &ctx->gz) < 0) ret = Z_DATA_ERROR;
             } while(ret == Z_OK && ctx->zstrm.avail_out > 0);
             if(ret != Z_OK && ret != Z_STREAM_END) {
                 if(verbose) printf("  zlib inflate error %d\r\n", ret);
@@ -717,7 +2295,7 @@ int stream_read(stream_t *ctx)
             size = buffer_size - ctx->zstrm.avail_out;
         break;
         case TYPE_BZIP2:
-            ctx->bstrm.next_out = ctx->buffer + ctx->avail;
+            ctx->bstrm.next_out = buf + ctx->avail;
             ctx->bstrm.avail_out = buffer_size - ctx->avail;
             do {
                 if(!ctx->bstrm.avail_in) {
@@ -726,12 +2304,23 @@ int stream_read(stream_t *ctx)
                     if(insiz > buffer_size) insiz = buffer_size;
                     if(verbose > 1) printf("  bzip2 cmrdSize %" PRIu64
                         " insiz %" PRId64 "\r\n", ctx->cmrdSize, insiz);
-                    ctx->bstrm.next_in = (char*)ctx->compBuf;
+                    if(!(in = stream_in(ctx, insiz))) break;
+                    ctx->bstrm.next_in = (char*)in;
                     ctx->bstrm.avail_in = insiz;
-                    if(!fread(ctx->compBuf, insiz, 1, ctx->f)) break;
                     ctx->cmrdSize += (uint64_t)insiz;
                 }
                 ret = BZ2_bzDecompress(&ctx->bstrm);
+                if(ret == BZ_STREAM_END && (ctx->bstrm.avail_in || ctx->cmrdSize < ctx->compSize) &&
+                  (!ctx->bstrm.avail_in || ctx->bstrm.next_in[0] == 'B')) {
+                    /* concatenated streams, like pbzip2's output (this keeps the buffer pointers) */
+                    BZ2_bzDecompressEnd(&ctx->bstrm);
+                    ret = BZ2_bzDecompressInit(&ctx->bstrm, 0, 0);
+                } else
+                if(ret == BZ_STREAM_END) {
+                    /* ignore trailing garbage, and don't call the ended decoder again */
+                    ctx->bstrm.avail_in = 0;
+                    ctx->cmrdSize = ctx->compSize;
+                }
             } while(ret == BZ_OK && ctx->bstrm.avail_out > 0);
             if(ret != BZ_OK && ret != BZ_STREAM_END) {
                 if(verbose) printf("  bzip2 decompress error %d\r\n", ret);
@@ -740,7 +2329,7 @@ int stream_read(stream_t *ctx)
             size = buffer_size - ctx->bstrm.avail_out;
         break;
         case TYPE_XZ:
-            ctx->xstrm.out = (unsigned char*)ctx->buffer;
+            ctx->xstrm.out = (unsigned char*)buf;
             ctx->xstrm.out_pos = ctx->avail;
             ctx->xstrm.out_size = buffer_size;
             do {
@@ -750,10 +2339,10 @@ int stream_read(stream_t *ctx)
                     if(insiz > buffer_size) insiz = buffer_size;
                     if(verbose > 1) printf("  xz cmrdSize %" PRIu64
                         " insiz %" PRId64 "\r\n", ctx->cmrdSize, insiz);
-                    ctx->xstrm.in = (unsigned char*)ctx->compBuf;
+                    if(!(in = stream_in(ctx, insiz))) break;
+                    ctx->xstrm.in = in;
                     ctx->xstrm.in_pos = 0;
                     ctx->xstrm.in_size = insiz;
-                    if(!fread(ctx->compBuf, insiz, 1, ctx->f)) break;
                     ctx->cmrdSize += (uint64_t)insiz;
                 }
                 ret = xz_dec_run(ctx->xz, &ctx->xstrm);
@@ -766,7 +2355,7 @@ int stream_read(stream_t *ctx)
             size = ctx->xstrm.out_pos;
         break;
         case TYPE_ZSTD:
-            ctx->zo.dst = ctx->buffer;
+            ctx->zo.dst = buf;
             ctx->zo.pos = ctx->avail;
             ctx->zo.size = buffer_size;
             do {
@@ -776,10 +2365,10 @@ int stream_read(stream_t *ctx)
                     if(insiz > buffer_size) insiz = buffer_size;
                     if(verbose > 1) printf("  zstd cmrdSize %" PRIu64
                         " insiz %" PRId64 "\r\n", ctx->cmrdSize, insiz);
-                    ctx->zi.src = ctx->compBuf;
+                    if(!(in = stream_in(ctx, insiz))) break;
+                    ctx->zi.src = in;
                     ctx->zi.pos = 0;
                     ctx->zi.size = insiz;
-                    if(!fread(ctx->compBuf, insiz, 1, ctx->f)) break;
                     ctx->cmrdSize += (uint64_t)insiz;
                 }
                 ret = (int) ZSTD_decompressStream(ctx->zstd, &ctx->zo, &ctx->zi);
@@ -791,13 +2380,679 @@ int stream_read(stream_t *ctx)
             size = ctx->zo.pos;
         break;
     }
-    while(size & 511) ctx->buffer[size++] = 0;
-    if(verbose > 1) printf("stream_read() output size %" PRId64 "\r\n", size);
-    ctx->readSize += (uint64_t)size;
+    /* a zip entry's CRC32 can only be checked if all of it went through here */
+    if(ctx->zipCheck && size > 0) {
+        ctx->zipCrc = kernels_crc32(ctx->zipCrc, buf, (size_t)size);
+        if((ctx->zipLen += (uint64_t)size) == ctx->fileSize && ctx->zipCrc != ctx->zipWant) {
+            if(verbose) printf("  zip CRC32 mismatch %08x != %08x\r\n", ctx->zipCrc, ctx->zipWant);
+            return -1;
+        }
+    }
+    if(size & 511) { memset(buf + size, 0, 512 - (size & 511)); size = (size + 511) & ~511; }
+    if(verbose > 1) printf("stream_decode() output size %" PRId64 "\r\n", size);
+    ctx->decSize += (uint64_t)size;
     ctx->avail = 0;
     return size;
 }
 
+/**
+ * Decode the next chunk that has mapped data in it. Without a block map that's every chunk, with
+ * one only the mapped part is returned in buf, and ctx->decOffs tells where it belongs
+ */
+static int stream_bmapdecode(stream_t *ctx, char *buf)
+{
+    stream_range_t *r;
+    uint64_t offs, end, s, e, fs;
+    uint8_t hash[32];
+    int size = 0, lo, hi;
+
+    if(!ctx->bmap) {
+#ifndef WINVER
+        if(ctx->holes) stream_skiphole(ctx);
+#endif
+        ctx->decOffs = ctx->decSize;
+        return stream_decode(ctx, buf);
+    }
+    while(1) {
+        if(ctx->curBmap >= ctx->numBmap) {
+            /* all mapped data done, no need to decode the rest, unless the map's image size has to be checked.
+             * The decoder stops at fileSize, which is the map's image size by now, so that's cleared meanwhile */
+            if(ctx->bmapCheck) {
+                fs = ctx->fileSize; ctx->fileSize = 0;
+                while((size = stream_decode(ctx, buf)) > 0);
+                ctx->fileSize = fs;
+            }
+            if(ctx->bmapCheck && (size < 0 || ctx->decSize != ((ctx->bmapSize + 511) & ~511ULL))) {
+                if(verbose && !size) printf("  bmap image size %" PRIu64 " doesn't match decoded size %" PRIu64 "\r\n",
+                    ctx->bmapSize, ctx->decSize);
+                return -1;
+            }
+            ctx->bmapCheck = 0;
+            ctx->decOffs = ctx->bmapSize;
+            return 0;
+        }
+        r = &ctx->bmap[ctx->curBmap];
+        /* raw images can simply skip over unmapped areas, compressed ones have to be decoded anyway */
+        if(ctx->type == TYPE_PLAIN && ctx->decSize < r->start) {
+            myseek(ctx->f, mytell(ctx->f) + r->start - ctx->decSize);
+            ctx->decSize = r->start;
+        }
+        offs = ctx->decSize;
+        size = stream_decode(ctx, buf);
+        if(size <= 0) {
+            if(!size && verbose) printf("  bmap range %d beyond end of image\r\n", ctx->curBmap);
+            return -1;
+        }
+        end = offs + size;
+        for(lo = hi = -1; ctx->curBmap < ctx->numBmap && ctx->bmap[ctx->curBmap].start < end; ctx->curBmap++) {
+            r = &ctx->bmap[ctx->curBmap];
+            s = r->start > offs ? r->start : offs;
+            e = r->end < end ? r->end : end;
+            if(lo == -1) lo = (int)(s - offs);
+            hi = (int)(e - offs);
+            if(ctx->bmapHash) sha256_u(&ctx->bsha, buf + (s - offs), (int)(e - s));
+            /* range continues in the next chunk */
+            if(e < r->end) break;
+            if(ctx->bmapHash) {
+                sha256_f(&ctx->bsha, hash);
+                sha256_i(&ctx->bsha);
+                if(memcmp(hash, r->chksum, 32)) {
+                    if(verbose) printf("  bmap range %d checksum mismatch\r\n", ctx->curBmap);
+                    return -1;
+                }
+            }
+        }
+        if(lo != -1) {
+            hi = (hi + 511) & ~511;
+            if(lo) memmove(buf, buf + lo, hi - lo);
+            if(verbose > 1) printf("stream_bmapdecode() mapped %d bytes at %" PRIu64 "\r\n", hi - lo, offs + lo);
+            ctx->decOffs = offs + lo;
+            return hi - lo;
+        }
+    }
+}
+
+#ifndef WINVER
+/**
+ * Decoder thread, keeps the ring filled so that decompression runs in parallel with writing
+ */
+static void *stream_decoder(void *data)
+{
+    stream_t *ctx = (stream_t*)data;
+    stream_ring_t *r = ctx->ring;
+    int i, size;
+
+    do {
+        pthread_mutex_lock(&r->mutex);
+        while(!r->stop && r->cnt == r->num) pthread_cond_wait(&r->cond, &r->mutex);
+        i = r->tail;
+        pthread_mutex_unlock(&r->mutex);
+        if(r->stop) break;
+        size = stream_bmapdecode(ctx, r->slot[i]);
+        pthread_mutex_lock(&r->mutex);
+        r->size[i] = size;
+        r->offs[i] = ctx->decOffs;
+        r->tail = (i + 1) % r->num;
+        r->cnt++;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->mutex);
+    } while(size > 0);
+    return NULL;
+}
+
+/**
+ * Allocate the ring and start the decoder thread. The first slot is ctx->buffer, because that
+ * might already hold data decoded by stream_open()
+ */
+static int stream_ringstart(stream_t *ctx)
+{
+    stream_ring_t *r;
+    int i, num = STREAM_RINGMEM / buffer_size;
+
+    if(num < 2) num = 2;
+    if(num > STREAM_RINGMAX) num = STREAM_RINGMAX;
+    r = (stream_ring_t*)malloc(sizeof(stream_ring_t));
+    if(!r) return 0;
+    memset(r, 0, sizeof(stream_ring_t));
+    r->slot[0] = ctx->buffer;
+    for(r->num = 1; r->num < num && (r->slot[r->num] = stream_alloc()); r->num++);
+    if(r->num < 2) { free(r); return 0; }
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    ctx->ring = r;
+    if(pthread_create(&r->thrd, NULL, stream_decoder, ctx)) {
+        ctx->ring = NULL;
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->mutex);
+        for(i = 1; i < r->num; i++) stream_free(r->slot[i]);
+        free(r);
+        return 0;
+    }
+    if(verbose) printf("stream_read() decoder ring %d x %d bytes\r\n", r->num, buffer_size);
+    return 1;
+}
+
+/**
+ * Stop the decoder thread and free the ring
+ */
+static void stream_ringstop(stream_t *ctx)
+{
+    stream_ring_t *r = ctx->ring;
+    int i;
+
+    if(!r) return;
+    pthread_mutex_lock(&r->mutex);
+    r->stop = 1;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->mutex);
+    pthread_join(r->thrd, NULL);
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->mutex);
+    ctx->buffer = r->slot[0];
+    for(i = 1; i < r->num; i++) stream_free(r->slot[i]);
+    free(r);
+    ctx->ring = NULL;
+}
+#endif
+
+/**
+ * Get the next chunk of decoded data, from the decoder ring if there's one
+ */
+static int stream_next(stream_t *ctx, uint64_t *offs)
+{
+    int size;
+#ifndef WINVER
+    stream_ring_t *r = ctx->ring;
+
+    if(r || (ctx->buffer && stream_ringstart(ctx) && (r = ctx->ring))) {
+        pthread_mutex_lock(&r->mutex);
+        /* once the decoder has finished, keep returning its last result */
+        if(!r->last) {
+            /* give back the slot returned by the previous call */
+            if(r->busy) {
+                r->head = (r->head + 1) % r->num;
+                r->cnt--;
+                r->busy = 0;
+                pthread_cond_broadcast(&r->cond);
+            }
+            while(!r->cnt) pthread_cond_wait(&r->cond, &r->mutex);
+            r->busy = 1;
+            if(r->size[r->head] <= 0) r->last = 1;
+        }
+        size = r->size[r->head];
+        *offs = r->offs[r->head];
+        ctx->buffer = r->slot[r->head];
+        pthread_mutex_unlock(&r->mutex);
+        errno = 0;
+    } else
+#endif
+    {
+        size = stream_bmapdecode(ctx, ctx->buffer);
+        *offs = ctx->decOffs;
+    }
+    return size;
+}
+
+/**
+ * Read no more than buffer_size uncompressed bytes of source data
+ */
+int stream_read(stream_t *ctx)
+{
+    uint64_t offs;
+    int size;
+
+#ifndef WINVER
+    ctx->zeroSize = 0;
+#endif
+    while(1) {
+        if((size = stream_next(ctx, &offs)) < 0) return size;
+#ifndef WINVER
+        /* a mismatch with the sidecar checksum aborts as soon as it's known, but at the latest at the end */
+        if(stream_sumcheck(ctx, !size)) { errno = 0; return -1; }
+#endif
+#ifndef WINVER
+        /* without a block map, a gap before the data can only be a hole, that has to be zeroed */
+        if(ctx->holes && offs > ctx->readSize) {
+            if(!ctx->zeroSize) ctx->zeroOffs = ctx->readSize;
+            ctx->zeroSize = offs - ctx->zeroOffs;
+        }
+#endif
+        ctx->readSize = offs + (uint64_t)size;
+#ifndef WINVER
+        if(ctx->tee) stream_cachewrite(ctx, offs, size);
+        /* collect runs of zeros, those are zeroed out on the target at once instead of being written */
+        if(size > 0 && (!ctx->zeroSize || ctx->zeroOffs + ctx->zeroSize == offs) && kernels_iszero(ctx->buffer, size)) {
+            if(!ctx->zeroSize) ctx->zeroOffs = offs;
+            ctx->zeroSize = ctx->readSize - ctx->zeroOffs;
+            if(ctx->zeroSize < STREAM_ZEROMAX) continue;
+        }
+#endif
+        return size;
+    }
+}
+
+#ifndef WINVER
+/**
+ * Copy the next chunk of a raw image straight to the target, without reading it into a buffer
+ */
+int stream_copy(stream_t *ctx, void *dst)
+{
+    uint64_t pos;
+    int64_t size;
+    int ret;
+
+    if(ctx->type != TYPE_PLAIN || ctx->bmap || ctx->ring || ctx->avail || !ctx->f) return 0;
+    if(ctx->holes) {
+        stream_skiphole(ctx);
+        if(ctx->decSize > ctx->readSize) {
+            ctx->zeroOffs = ctx->readSize;
+            ctx->zeroSize = ctx->decSize - ctx->readSize;
+            ctx->readSize = ctx->decSize;
+            if(stream_zero(ctx, dst, 0) < 0) return -1;
+        }
+    }
+    size = ctx->fileSize - ctx->decSize;
+    if(size > buffer_size) size = buffer_size;
+    /* the last partial sector has to be padded, leave that to stream_read() */
+    if(size < 1 || (size & 511)) return 0;
+    pos = mytell(ctx->f);
+    ret = disks_copy(dst, ctx->decSize, fileno(ctx->f), pos, (int)size);
+    if(ret > 0) {
+        if(verbose > 1) printf("stream_copy() decSize %" PRIu64 " copied %d\r\n", ctx->decSize, ret);
+        myseek(ctx->f, pos + (uint64_t)ret);
+        ctx->decSize += (uint64_t)ret;
+        ctx->readSize = ctx->decSize;
+    }
+    return ret;
+}
+
+/**
+ * Zero out the target from offs to end. If the disk can't do that by itself, write zeros from buf, but
+ * unless forced, only where it isn't zero already
+ */
+static int stream_zeroat(void *dst, uint64_t offs, uint64_t end, char *buf)
+{
+    int n, ret;
+
+    if(verbose > 1) printf("stream_zero() offs %" PRIu64 " size %" PRIu64 "\r\n", offs, end - offs);
+    if((ret = disks_zero(dst, offs, end - offs)) < 0) return -1;
+    for(; !ret && offs < end; offs += (uint64_t)n) {
+        n = end - offs < (uint64_t)buffer_size ? (int)(end - offs) : buffer_size;
+        if(!force && disks_read(dst, offs, buf, n) == n && kernels_iszero(buf, n)) continue;
+        memset(buf, 0, n);
+        if(disks_write(dst, offs, buf, n) != n) return -1;
+    }
+    return 0;
+}
+
+/**
+ * Add a chunk to the ones checked by the read-back pass
+ */
+static int stream_addchunk(stream_t *ctx, uint64_t offs, int size, uint64_t hash, int zero)
+{
+    stream_chunk_t *tmp;
+
+    if(!(ctx->numChunks & 1023)) {
+        if(!(tmp = (stream_chunk_t*)realloc(ctx->chunks, (ctx->numChunks + 1024) * sizeof(stream_chunk_t)))) {
+            errno = ENOMEM;
+            return -1;
+        }
+        ctx->chunks = tmp;
+    }
+    ctx->chunks[ctx->numChunks].offs = offs;
+    ctx->chunks[ctx->numChunks].size = size;
+    ctx->chunks[ctx->numChunks].hash = hash;
+    ctx->chunks[ctx->numChunks].zero = zero;
+    ctx->numChunks++;
+    return 0;
+}
+
+/**
+ * Zero out the hole or run of zeros collected by the last stream_read() on the target. The zeros are part of
+ * the image, so they are verified like the data, and they are added to the on-disk checksum whenever the data
+ * is (unlike unmapped areas with a block map)
+ */
+int stream_zero(stream_t *ctx, void *dst, int verify)
+{
+    uint64_t offs = ctx->zeroOffs, end = ctx->zeroOffs + ctx->zeroSize, o;
+    int n;
+
+    ctx->zeroSize = 0;
+    if(offs >= end) return 0;
+    if(stream_zeroat(dst, offs, end, ctx->verifyBuf) < 0) return -1;
+    if(verify || !force) {
+        /* the hashing thread might still be on the previous data, keep the order */
+        stream_hashwait(ctx);
+        if(!verify) memset(ctx->verifyBuf, 0, buffer_size);
+        for(o = offs; o < end; o += (uint64_t)n) {
+            n = end - o < (uint64_t)buffer_size ? (int)(end - o) : buffer_size;
+            if(verify == 2) {
+                if(stream_addchunk(ctx, o, n, 0, 1)) return -1;
+                continue;
+            }
+            if(verify) {
+                if(disks_read(dst, o, ctx->verifyBuf, n) != n) return -1;
+                if(!kernels_iszero(ctx->verifyBuf, n)) {
+                    if(verbose) printf("stream_zero() mismatch at %" PRIu64 " size %d\r\n", o, n);
+                    errno = 0;
+                    return -2;
+                }
+            }
+            ctx->hasHash = 1;
+            stream_hashupdate(ctx, ctx->verifyBuf, n);
+        }
+    }
+    /* the data returned by stream_read() was zeros too, nothing left to write */
+    return end >= ctx->readSize;
+}
+
+/**
+ * Remember where the data returned by stream_read() goes and its hash, so that it can be checked
+ * by reading the whole target back at once instead of reading back each chunk right after writing it
+ */
+int stream_record(stream_t *ctx, int size)
+{
+    if(size < 1) return 0;
+    return stream_addchunk(ctx, ctx->readSize - size, size, XXH64(ctx->buffer, size, 0), 0);
+}
+
+/**
+ * Read back the recorded chunks, keeping as many reads in flight as the target disk's queue allows.
+ * During this pass pendSize is what hasn't been read back yet, and the on-disk checksum is
+ * calculated from the data read here
+ */
+int stream_verify(stream_t *ctx, void *dst)
+{
+    stream_chunk_t *c;
+    char *buf;
+    int i, n = 0;
+
+    /* the previous buffer goes away with the next read */
+    stream_hashwait(ctx);
+    if(ctx->curChunk >= ctx->numChunks) return 0;
+    if(!ctx->curChunk && !ctx->queChunk) {
+        for(i = 0, ctx->pendSize = 0; i < ctx->numChunks; i++) ctx->pendSize += (uint64_t)ctx->chunks[i].size;
+        if(verbose) printf("stream_verify() %d chunks, %" PRIu64 " bytes\r\n", ctx->numChunks, ctx->pendSize);
+    }
+    while(ctx->queChunk < ctx->numChunks &&
+        (n = disks_readq(dst, ctx->chunks[ctx->queChunk].offs, ctx->chunks[ctx->queChunk].size)) > 0) ctx->queChunk++;
+    if(n < 0) return -1;
+    c = &ctx->chunks[ctx->curChunk++];
+    if((n = disks_readwait(dst, &buf)) < 0) return -1;
+    if(n != c->size || (c->zero ? !kernels_iszero(buf, n) : XXH64(buf, n, 0) != c->hash)) {
+        if(verbose) printf("stream_verify() mismatch at %" PRIu64 " size %d\r\n", c->offs, c->size);
+        errno = 0;
+        return -1;
+    }
+    stream_hashpost(ctx, buf, n);
+    ctx->pendSize -= (uint64_t)n;
+    return n;
+}
+
+/**
+ * Write the whole image to the target disk, the loop shared by the frontends. Unless forced, a chunk is only written
+ * if it differs from what's on the disk already. With verify 1 every chunk is read back right after it's written, with
+ * 2 it's checked by stream_verify() after the last write. progress is called before every chunk and during the
+ * read-back, if it returns non-zero, writing is cancelled
+ */
+int stream_todisk(stream_t *ctx, void *dst, int verify, int (*progress)(void *data, stream_t *ctx), void *data)
+{
+    int numberOfBytesRead, numberOfBytesWritten, numberOfBytesVerify, needWrite;
+
+    while(1) {
+        if(progress && (*progress)(data, ctx)) return -1;
+        /* nothing needs to see the data, let the kernel copy raw images */
+        if(force && !verify && (numberOfBytesRead = stream_copy(ctx, dst)) != 0) {
+            if(numberOfBytesRead < 0) return L_WRTRGERR;
+            ctx->pendSize = disks_pending(dst);
+            continue;
+        }
+        if((numberOfBytesRead = stream_read(ctx)) < 0) { errno = 0; return L_RDSRCERR; }
+        /* holes and runs of zeros aren't written as data, they are zeroed out on the target instead */
+        if(ctx->zeroSize && (numberOfBytesWritten = stream_zero(ctx, dst, verify)) != 0) {
+            if(numberOfBytesWritten < 0) return numberOfBytesWritten == -2 ? L_VRFYERR : L_WRTRGERR;
+            ctx->pendSize = disks_pending(dst);
+            continue;
+        }
+        if(!numberOfBytesRead) break;
+        errno = 0; needWrite = 1; numberOfBytesVerify = 0;
+        if(!force) {
+            numberOfBytesVerify = disks_read(dst, ctx->readSize - numberOfBytesRead, ctx->verifyBuf, numberOfBytesRead);
+            if(numberOfBytesVerify == numberOfBytesRead && kernels_equal(ctx->buffer, ctx->verifyBuf, numberOfBytesRead)) {
+                if(verbose > 1) printf("  numberOfBytesVerify %d matches disk, skipping write\n", numberOfBytesRead);
+                needWrite = 0;
+            }
+        }
+        if(needWrite) {
+            numberOfBytesWritten = disks_write(dst, ctx->readSize - numberOfBytesRead, ctx->buffer, numberOfBytesRead);
+            if(verbose > 1) printf("write(%d) numberOfBytesWritten %d errno=%d\n",
+                numberOfBytesRead, numberOfBytesWritten, errno);
+            if(numberOfBytesWritten != numberOfBytesRead) return L_WRTRGERR;
+            if(verify == 1) {
+                numberOfBytesVerify = disks_read(dst, ctx->readSize - numberOfBytesRead, ctx->verifyBuf, numberOfBytesWritten);
+                if(verbose > 1) printf("  numberOfBytesVerify %d\n", numberOfBytesVerify);
+                if(numberOfBytesVerify != numberOfBytesWritten) return L_VRFYERR;
+                if(!kernels_equal(ctx->buffer, ctx->verifyBuf, numberOfBytesWritten)) { errno = 0; return L_VRFYERR; }
+            }
+            ctx->pendSize = disks_pending(dst);
+        }
+        if(verify != 2)
+            stream_hash(ctx, numberOfBytesVerify);
+        else if(stream_record(ctx, numberOfBytesRead))
+            return L_WRTRGERR;
+    }
+    if(!ctx->fileSize) ctx->fileSize = ctx->readSize;
+    if(disks_flush(dst)) return L_WRTRGERR;
+    if(verify == 2) {
+        while((numberOfBytesVerify = stream_verify(ctx, dst)) > 0)
+            if(progress && (*progress)(data, ctx)) return -1;
+        if(numberOfBytesVerify < 0) return L_VRFYERR;
+    }
+    ctx->pendSize = 0;
+    return 0;
+}
+
+/**
+ * Write a duplicator slot to one target, the same way as a single target is written: zeros are cleared,
+ * unless forced the data is only written where it differs, and read back right away if verify is set
+ */
+static int stream_dupwrite(stream_dup_t *d, stream_dupdst_t *t, int i)
+{
+    uint64_t offs = d->offs[i], s;
+    int n = d->size[i], l;
+
+    if(d->zsize[i]) {
+        if(stream_zeroat(t->dst, d->zoffs[i], d->zoffs[i] + d->zsize[i], t->verifyBuf) < 0) return STREAM_DUPWRITE;
+        for(s = d->zoffs[i]; d->verify && s < d->zoffs[i] + d->zsize[i]; s += (uint64_t)l) {
+            l = d->zoffs[i] + d->zsize[i] - s < (uint64_t)buffer_size ? (int)(d->zoffs[i] + d->zsize[i] - s) : buffer_size;
+            if(disks_read(t->dst, s, t->verifyBuf, l) != l) return STREAM_DUPWRITE;
+            if(!kernels_iszero(t->verifyBuf, l)) { errno = 0; return STREAM_DUPVERIFY; }
+        }
+        /* the data was zeros too */
+        if(d->zoffs[i] + d->zsize[i] >= offs + (uint64_t)n) return STREAM_DUPOK;
+    }
+    if(n < 1 || (!force && disks_read(t->dst, offs, t->verifyBuf, n) == n && kernels_equal(d->slot[i], t->verifyBuf, n)))
+        return STREAM_DUPOK;
+    if(disks_write(t->dst, offs, d->slot[i], n) != n) return STREAM_DUPWRITE;
+    if(d->verify && (disks_read(t->dst, offs, t->verifyBuf, n) != n || !kernels_equal(d->slot[i], t->verifyBuf, n))) {
+        errno = 0;
+        return STREAM_DUPVERIFY;
+    }
+    return STREAM_DUPOK;
+}
+
+/**
+ * Duplicator writer thread, one for each target
+ */
+static void *stream_dupthread(void *data)
+{
+    stream_dupdst_t *t = (stream_dupdst_t*)data;
+    stream_dup_t *d = ((stream_t*)t->ctx)->dup;
+    uint64_t s;
+    int i, err;
+
+    while(1) {
+        pthread_mutex_lock(&d->mutex);
+        while(t->seq == d->seq && !d->eof && !d->stop) pthread_cond_wait(&d->cond, &d->mutex);
+        if(d->stop || t->seq == d->seq) { pthread_mutex_unlock(&d->mutex); break; }
+        i = t->seq % d->num;
+        pthread_mutex_unlock(&d->mutex);
+        errno = 0;
+        err = stream_dupwrite(d, t, i);
+        pthread_mutex_lock(&d->mutex);
+        d->refs[i]--;
+        t->seq++;
+        if(err) {
+            /* this target is out, don't let the others wait for it */
+            t->err = err; t->errnum = errno;
+            for(s = t->seq; s < d->seq; s++) d->refs[s % d->num]--;
+            t->seq = d->seq;
+            d->alive--;
+            if(verbose) printf("stream_dupthread() target %d failed at %" PRIu64 ": %s\r\n", (int)(t - d->dst),
+                d->offs[i], err == STREAM_DUPVERIFY ? "verify error" : strerror(t->errnum));
+        } else
+            t->done = d->offs[i] + (uint64_t)d->size[i];
+        pthread_cond_broadcast(&d->cond);
+        pthread_mutex_unlock(&d->mutex);
+        if(err) break;
+    }
+    if(!t->err && !d->stop && disks_flush(t->dst)) { t->err = STREAM_DUPWRITE; t->errnum = errno; }
+    return NULL;
+}
+
+/**
+ * Start the duplicator
+ */
+int stream_dupstart(stream_t *ctx, void **dst, int num, int verify)
+{
+    stream_dup_t *d;
+    int i;
+
+    if(ctx->dup || num < 1 || !(d = (stream_dup_t*)malloc(sizeof(stream_dup_t)))) return -1;
+    memset(d, 0, sizeof(stream_dup_t));
+    if(!(d->dst = (stream_dupdst_t*)calloc(num, sizeof(stream_dupdst_t)))) { free(d); return -1; }
+    /* a ring deep enough to smooth out the differences between the targets, but in a reasonable amount of memory */
+    d->num = STREAM_RINGMEM / buffer_size;
+    if(d->num > STREAM_RINGMAX) d->num = STREAM_RINGMAX;
+    if(d->num < 2) d->num = 2;
+    for(i = 0; i < d->num && (d->slot[i] = stream_alloc()); i++);
+    if(i < 2) {
+        while(i--) stream_free(d->slot[i]);
+        free(d->dst); free(d);
+        return -1;
+    }
+    d->num = i;
+    d->verify = verify;
+    pthread_mutex_init(&d->mutex, NULL);
+    pthread_cond_init(&d->cond, NULL);
+    d->numDst = d->alive = num;
+    ctx->dup = d;
+    for(i = 0; i < num; i++) {
+        d->dst[i].dst = dst[i];
+        d->dst[i].ctx = ctx;
+        if(!(d->dst[i].verifyBuf = stream_alloc()) || pthread_create(&d->dst[i].thrd, NULL, stream_dupthread, &d->dst[i])) {
+            if(d->dst[i].verifyBuf) { stream_free(d->dst[i].verifyBuf); d->dst[i].verifyBuf = NULL; }
+            d->dst[i].err = STREAM_DUPWRITE; d->dst[i].errnum = ENOMEM;
+            pthread_mutex_lock(&d->mutex);
+            d->alive--;
+            pthread_mutex_unlock(&d->mutex);
+        }
+    }
+    if(verbose) printf("stream_dupstart() %d targets, %d slots\r\n", d->alive, d->num);
+    return 0;
+}
+
+/**
+ * Decode the next chunk and put it into the ring
+ */
+int stream_dup(stream_t *ctx)
+{
+    stream_dup_t *d = ctx->dup;
+    uint64_t min = ctx->readSize;
+    int i, n;
+
+    if(!d) return -1;
+    if((n = stream_read(ctx)) < 0) {
+        /* the writers mustn't finish an incomplete image */
+        pthread_mutex_lock(&d->mutex);
+        d->stop = 1;
+        pthread_cond_broadcast(&d->cond);
+        pthread_mutex_unlock(&d->mutex);
+        return -1;
+    }
+    if(!n && !ctx->zeroSize) return 0;
+    pthread_mutex_lock(&d->mutex);
+    i = d->seq % d->num;
+    while(d->alive && d->refs[i]) pthread_cond_wait(&d->cond, &d->mutex);
+    if(!d->alive) { pthread_mutex_unlock(&d->mutex); errno = 0; return -1; }
+    pthread_mutex_unlock(&d->mutex);
+    /* nobody uses this slot now */
+    if(n > 0) memcpy(d->slot[i], ctx->buffer, n);
+    d->size[i] = n;
+    d->offs[i] = ctx->readSize - (uint64_t)n;
+    d->zoffs[i] = ctx->zeroOffs;
+    d->zsize[i] = ctx->zeroSize;
+    ctx->zeroSize = 0;
+    /* the on-disk checksum is calculated from the data written to every target */
+    if(n > 0) {
+        memcpy(ctx->verifyBuf, ctx->buffer, n);
+        stream_hash(ctx, n);
+    }
+    pthread_mutex_lock(&d->mutex);
+    d->refs[i] = d->alive;
+    d->seq++;
+    for(n = 0; n < d->numDst; n++)
+        if(!d->dst[n].err && d->dst[n].done < min) min = d->dst[n].done;
+    /* how far behind the slowest target is */
+    ctx->pendSize = ctx->readSize - min;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->mutex);
+    return 1;
+}
+
+/**
+ * Stop the duplicator, with abort set the writers don't finish what's in the ring
+ */
+static int stream_dupstop(stream_t *ctx, int *err, int abort)
+{
+    stream_dup_t *d = ctx->dup;
+    int i, ok = 0;
+
+    if(!d) return 0;
+    pthread_mutex_lock(&d->mutex);
+    d->eof = 1;
+    if(abort) d->stop = 1;
+    pthread_cond_broadcast(&d->cond);
+    pthread_mutex_unlock(&d->mutex);
+    for(i = 0; i < d->numDst; i++) {
+        if(d->dst[i].verifyBuf) {
+            pthread_join(d->dst[i].thrd, NULL);
+            stream_free(d->dst[i].verifyBuf);
+        }
+        if(abort && !d->dst[i].err) d->dst[i].err = STREAM_DUPWRITE;
+        if(err) err[i] = d->dst[i].err;
+        if(!d->dst[i].err) ok++;
+        else if(verbose) printf("stream_dupend() target %d failed\r\n", i);
+    }
+    for(i = 0; i < d->num; i++) stream_free(d->slot[i]);
+    pthread_mutex_destroy(&d->mutex);
+    pthread_cond_destroy(&d->cond);
+    free(d->dst);
+    free(d);
+    ctx->dup = NULL;
+    ctx->pendSize = 0;
+    return ok;
+}
+
+/**
+ * Wait for the duplicator's writer threads to finish
+ */
+int stream_dupend(stream_t *ctx, int *err)
+{
+    return stream_dupstop(ctx, err, 0);
+}
+#endif
+
 /**
  * Get a reference to the destination file system
  */
@@ -834,11 +3089,116 @@ uint64_t stream_avail(int fd)
     return (uint64_t)-1UL;
 }
 
+/**
+ * Return the number of online processors
+ */
+int stream_ncpu(void)
+{
+    int ret;
+#ifdef WINVER
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    ret = (int)si.dwNumberOfProcessors;
+#else
+    ret = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return ret < 1 ? 1 : ret;
+}
+
+/**
+ * Add a chunk written to a backup to the block map, all-zero blocks are left unmapped
+ */
+static void stream_bmapadd(stream_t *ctx, char *buffer, int size)
+{
+    stream_range_t *r;
+    uint64_t offs = ctx->readSize - size;
+    int i, l;
+
+    for(i = 0; i < size; i += l) {
+        l = size - i < STREAM_BMAPBLK ? size - i : STREAM_BMAPBLK;
+        if(kernels_iszero(buffer + i, l)) {
+            if(ctx->curBmap) {
+                sha256_f(&ctx->bsha, ctx->bmap[ctx->numBmap - 1].chksum);
+                ctx->curBmap = 0;
+            }
+            continue;
+        }
+        if(!ctx->curBmap) {
+            if(!(ctx->numBmap & 1023)) {
+                r = (stream_range_t*)realloc(ctx->bmap, (ctx->numBmap + 1024) * sizeof(stream_range_t));
+                if(!r) {
+                    if(verbose) printf("stream_write() unable to allocate block map\r\n");
+                    free(ctx->bmap); ctx->bmap = NULL;
+                    free(ctx->bmapName); ctx->bmapName = NULL;
+                    return;
+                }
+                ctx->bmap = r;
+            }
+            ctx->bmap[ctx->numBmap++].start = offs + i;
+            sha256_i(&ctx->bsha);
+            ctx->curBmap = 1;
+        }
+        sha256_u(&ctx->bsha, buffer + i, l);
+        ctx->bmap[ctx->numBmap - 1].end = offs + i + l;
+    }
+}
+
+/**
+ * Save the block map of a finished backup in bmaptool format
+ */
+static void stream_bmapwrite(stream_t *ctx)
+{
+    FILE *f;
+    sha256_ctx_t sha;
+    uint64_t mapped = 0;
+    uint8_t hash[32];
+    char *data, *s, *c, hex[3];
+    int i, j;
+
+    if(ctx->curBmap) {
+        sha256_f(&ctx->bsha, ctx->bmap[ctx->numBmap - 1].chksum);
+        ctx->curBmap = 0;
+    }
+    for(i = 0; i < ctx->numBmap; i++)
+        mapped += (ctx->bmap[i].end - ctx->bmap[i].start + STREAM_BMAPBLK - 1) / STREAM_BMAPBLK;
+    data = (char*)malloc(1024 + ctx->numBmap * 128);
+    if(!data) return;
+    s = data + sprintf(data, "<?xml version=\"1.0\" ?>\n<bmap version=\"2.0\">\n"
+        "    <ImageSize> %" PRIu64 " </ImageSize>\n    <BlockSize> %u </BlockSize>\n"
+        "    <BlocksCount> %" PRIu64 " </BlocksCount>\n    <MappedBlocksCount> %" PRIu64 " </MappedBlocksCount>\n"
+        "    <ChecksumType> sha256 </ChecksumType>\n    <BmapFileChecksum> ",
+        ctx->fileSize, STREAM_BMAPBLK, (ctx->fileSize + STREAM_BMAPBLK - 1) / STREAM_BMAPBLK, mapped);
+    /* the file's checksum is calculated with zeros in place of the checksum */
+    c = s;
+    memset(s, '0', 64); s += 64;
+    s += sprintf(s, " </BmapFileChecksum>\n    <BlockMap>\n");
+    for(i = 0; i < ctx->numBmap; i++) {
+        s += sprintf(s, "        <Range chksum=\"");
+        for(j = 0; j < 32; j++) s += sprintf(s, "%02x", ctx->bmap[i].chksum[j]);
+        s += sprintf(s, "\"> %" PRIu64, ctx->bmap[i].start / STREAM_BMAPBLK);
+        if((ctx->bmap[i].end - 1) / STREAM_BMAPBLK != ctx->bmap[i].start / STREAM_BMAPBLK)
+            s += sprintf(s, "-%" PRIu64, (ctx->bmap[i].end - 1) / STREAM_BMAPBLK);
+        s += sprintf(s, " </Range>\n");
+    }
+    s += sprintf(s, "    </BlockMap>\n</bmap>\n");
+    sha256_i(&sha); sha256_u(&sha, data, (int)(s - data)); sha256_f(&sha, hash);
+    for(j = 0; j < 32; j++) { sprintf(hex, "%02x", hash[j]); memcpy(c + j * 2, hex, 2); }
+    if((f = stream_fopen(ctx->bmapName, "wb"))) {
+        if(!fwrite(data, s - data, 1, f)) {}
+        fclose(f);
+    }
+    if(verbose) printf("stream_close() block map %s, %d ranges, %" PRIu64 " of %" PRIu64 " blocks mapped\r\n",
+        ctx->bmapName, ctx->numBmap, mapped, (ctx->fileSize + STREAM_BMAPBLK - 1) / STREAM_BMAPBLK);
+    free(data);
+}
+
 /**
  * Open file for writing
  */
 int stream_create(stream_t *ctx, char *fn, int comp, uint64_t size)
 {
+    int workers;
+
     errno = 0;
     memset(ctx, 0, sizeof(stream_t));
 
@@ -852,7 +3212,7 @@ int stream_create(stream_t *ctx, char *fn, int comp, uint64_t size)
         main_getErrorMessage();
         return 1;
     }
-    ctx->buffer = (char*)malloc(buffer_size);
+    ctx->buffer = stream_alloc();
     if(!ctx->buffer) {
         main_getErrorMessage();
         free(ctx->compBuf); ctx->compBuf = NULL;
@@ -869,26 +3229,34 @@ int stream_create(stream_t *ctx, char *fn, int comp, uint64_t size)
             ctx->g = NULL;
             if(ctx->zcmp) ZSTD_freeCCtx(ctx->zcmp);
             ctx->zcmp = NULL;
-            free(ctx->buffer); ctx->buffer = NULL;
+            stream_free(ctx->buffer); ctx->buffer = NULL;
             free(ctx->compBuf); ctx->compBuf = NULL;
             return 1;
         }
         dstfd = stream_dst(fn, ctx->g);
         ZSTD_CCtx_setParameter(ctx->zcmp, ZSTD_c_compressionLevel, 1);
-        ZSTD_CCtx_setParameter(ctx->zcmp, ZSTD_c_nbWorkers, 4);
+        /* one worker per core, the compression runs in the background while we read the disk */
+        if(ZSTD_isError(ZSTD_CCtx_setParameter(ctx->zcmp, ZSTD_c_nbWorkers, stream_ncpu())) ||
+          ZSTD_isError(ZSTD_CCtx_getParameter(ctx->zcmp, ZSTD_c_nbWorkers, &workers)))
+            workers = 0;
+        if(verbose) printf("  zstd level 1, %d worker%s\r\n", workers, workers == 1 ? "" : "s");
         ZSTD_CCtx_setPledgedSrcSize(ctx->zcmp, size);
     } else {
         ctx->type = TYPE_PLAIN;
         ctx->f = stream_fopen(fn, "wb");
         if(!ctx->f) {
             main_getErrorMessage();
-            free(ctx->buffer); ctx->buffer = NULL;
+            stream_free(ctx->buffer); ctx->buffer = NULL;
             free(ctx->compBuf); ctx->compBuf = NULL;
             return 1;
         }
         dstfd = stream_dst(fn, ctx->f);
     }
 
+    /* block map for restoring, "(backup).bmap" */
+    if((ctx->bmapName = (char*)malloc(strlen(fn) + 6)))
+        sprintf(ctx->bmapName, "%s.bmap", fn);
+
     ctx->fileSize = size;
     ctx->start = time(NULL);
     return 0;
@@ -922,7 +3290,7 @@ int stream_write(stream_t *ctx, char *buffer, int size)
     switch(ctx->type) {
         case TYPE_PLAIN:
             /* check if the data contains only zeros nothing else */
-            for(i = 0; i < size && !buffer[i]; i++) {}
+            i = kernels_iszero(buffer, size) ? size : 0;
             /* there's a bug in the newest Windows 10 kernel, see issue #53, so do not use sparse file under Win */
 #if !defined(WINVER) || defined(WINKRNL_NOT_BUGGY_ANY_MORE)
             if(i == size) {
@@ -942,13 +3310,21 @@ int stream_write(stream_t *ctx, char *buffer, int size)
             do {
                 remaining = ZSTD_compressStream2(ctx->zcmp, &ctx->zo , &ctx->zi,
                     ctx->readSize >= ctx->fileSize ? ZSTD_e_end : ZSTD_e_continue);
-                if(!fwrite(ctx->compBuf, ctx->zo.pos, 1, ctx->g)) {
+                if(ZSTD_isError(remaining)) {
+                    if(verbose) printf("  zstd compress error %d\r\n", (int)remaining);
+                    size = 0;
+                    break;
+                }
+                /* with workers, a call might not produce any output yet */
+                if(ctx->zo.pos && !fwrite(ctx->compBuf, ctx->zo.pos, 1, ctx->g)) {
                     size = 0;
                     break;
                 }
+                ctx->zo.pos = 0;
             } while(ctx->readSize >= ctx->fileSize ? (remaining != 0) : (ctx->zi.pos != (size_t)size));
         break;
     }
+    if(size > 0 && ctx->bmapName) stream_bmapadd(ctx, buffer, size);
     if(verbose > 1) printf("stream_write() output size %d\r\n", size);
     return size;
 }
@@ -959,9 +3335,29 @@ int stream_write(stream_t *ctx, char *buffer, int size)
 void stream_close(stream_t *ctx)
 {
     if(verbose) printf("stream_close()\r\n");
+#ifndef WINVER
+    /* the decoder thread might be waiting for the workers */
+    stream_parstop(ctx);
+    stream_ringstop(ctx);
+    stream_parfree(ctx);
+    stream_dupstop(ctx, NULL, 1);
+    stream_hashstop(ctx);
+    stream_sumstop(ctx);
+    /* unless the whole input was read, the cache entry is incomplete */
+    stream_cachestop(ctx, 0);
+    if(ctx->hashBuf) { stream_free(ctx->hashBuf); ctx->hashBuf = NULL; }
+    if(ctx->map) { munmap(ctx->map, ctx->mapSize); ctx->map = NULL; }
+    if(ctx->holes) { free(ctx->holes); ctx->holes = NULL; }
+    if(ctx->chunks) { free(ctx->chunks); ctx->chunks = NULL; }
+#endif
     if(ctx->compBuf) free(ctx->compBuf);
-    if(ctx->verifyBuf) free(ctx->verifyBuf);
-    if(ctx->buffer) free(ctx->buffer);
+    if(ctx->verifyBuf) stream_free(ctx->verifyBuf);
+    if(ctx->buffer) stream_free(ctx->buffer);
+    if(ctx->bmapName) {
+        if(ctx->fileSize && ctx->readSize >= ctx->fileSize) stream_bmapwrite(ctx);
+        free(ctx->bmapName); ctx->bmapName = NULL;
+    }
+    if(ctx->bmap) { free(ctx->bmap); ctx->bmap = NULL; }
     if(ctx->f) fclose(ctx->f);
     if(ctx->g) fclose(ctx->g);
     switch(ctx->type) {
@@ -988,13 +3384,67 @@ void stream_baud(int rate)
         baud = bauds[i];
 }
 
+/**
+ * Select the on-disk data checksum algorithm, returns the number of characters consumed from name
+ */
+int stream_checksum(char *name)
+{
+    int i, l;
+    if(!name) return 0;
+    for(i = 0; i < (int)(sizeof(cksum_names)/sizeof(cksum_names[0])); i++) {
+        l = strlen(cksum_names[i]);
+        if(!strncmp(name, cksum_names[i], l)) { checksum = i; return l; }
+    }
+    /* unknown algorithm, eat up the whole word so that it won't be parsed as further flags */
+    l = strlen(name);
+    fprintf(stderr, "usbimager: unknown checksum '%s', using %s\r\n", name, cksum_titles[0]);
+    checksum = 0;
+    return l;
+}
+
+#ifndef WINVER
+/**
+ * Set up the decoded image cache
+ */
+void stream_cache(char *dir, int max)
+{
+    char *home = getenv("XDG_CACHE_HOME");
+
+    if(cache_dir) { free(cache_dir); cache_dir = NULL; }
+    if(dir) {
+        cache_dir = strdup(dir);
+    } else if(home || (home = getenv("HOME"))) {
+        if((cache_dir = (char*)malloc(strlen(home) + 24))) {
+            sprintf(cache_dir, getenv("XDG_CACHE_HOME") ? "%s" : "%s/.cache", home);
+            mkdir(cache_dir, 0755);
+            strcat(cache_dir, "/usbimager");
+        }
+    }
+    if(!cache_dir) return;
+    mkdir(cache_dir, 0755);
+    cache_max = (uint64_t)(max > 0 ? max : STREAM_CACHEMAX) << 30;
+    if(verbose) printf("stream_cache(%s) %" PRIu64 " GiB\r\n", cache_dir, cache_max >> 30);
+}
+#endif
+
 /**
  * Calculate on-disk data hash
  */
 void stream_hash(stream_t *ctx, int len)
 {
+#ifndef WINVER
+    char *tmp;
+#endif
     if(ctx && ctx->verifyBuf && len > 0) {
+#ifndef WINVER
+        /* hash it on the hashing thread, and meanwhile let the writer use the other verify buffer */
+        if(ctx->hashBuf || (ctx->hashBuf = stream_alloc())) {
+            stream_hashpost(ctx, ctx->verifyBuf, len);
+            tmp = ctx->verifyBuf; ctx->verifyBuf = ctx->hashBuf; ctx->hashBuf = tmp;
+            return;
+        }
+#endif
         ctx->hasHash = 1;
-        sha256_u(&ctx->sha, ctx->verifyBuf, len);
+        stream_hashupdate(ctx, ctx->verifyBuf, len);
     }
 }
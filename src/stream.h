@@ -41,7 +41,14 @@
 #define XZ_USE_CRC64
 #define XZ_DEC_ANY_CHECK
 #include "xz.h"
+#define ZSTD_STATIC_LINKING_ONLY
 #include "zstd.h"
+#define XXH_NAMESPACE ZSTD_             /* use the XXH64 built into libzstd */
+#define XXH_STATIC_LINKING_ONLY
+#include "common/xxhash.h"
+#ifndef WINVER
+#include <pthread.h>
+#endif
 
 #ifndef PRIu64
 #if __WORDSIZE == 64
@@ -53,18 +60,148 @@
 #endif
 #endif
 
+#define STREAM_RINGMAX 8                /* maximum number of decoded buffers in the ring */
+#define STREAM_RINGMEM (64*1024*1024)   /* try to keep the ring under this much memory */
+#define STREAM_BMAPBLK 4096             /* block size of the block maps created with backups */
+#define STREAM_PARMAX 16                /* maximum number of parallel decoder threads */
+#define STREAM_PARMEM (256*1024*1024)   /* try to keep the parallel decoder's buffers under this much memory */
+#define STREAM_PARUNIT (64*1024*1024)   /* largest unit worth decoding in parallel */
+#define STREAM_PARCHUNK (4*1024*1024)   /* compressed size of a unit where the input can be split at many places */
+#define STREAM_MAPFREE (16*1024*1024)   /* give back the mapped input behind the decoders in steps this big */
+#define STREAM_HOLEMIN (1024*1024)      /* smallest hole in a sparse raw image worth skipping */
+#define STREAM_ZEROMAX (64*1024*1024)   /* longest run of zeros collected before it's zeroed out on the target */
+#define STREAM_SUMBLK (1024*1024)       /* the input is checked against its sidecar checksum in blocks this big */
+#define STREAM_CACHEKEY (64*1024)       /* first and last bytes of the input hashed into its key in the cache */
+#define STREAM_CACHEMAX 16              /* default size limit of the decoded image cache in GiB */
+
+/* result of a duplicator target */
+enum { STREAM_DUPOK, STREAM_DUPWRITE, STREAM_DUPVERIFY };
+
+/* on-disk data checksum algorithms */
+enum { STREAM_SHA256, STREAM_XXH64, STREAM_CRC32C };
+
 /* SHA-256 context */
 typedef struct {
    uint8_t d[64];
    uint32_t l, b[2], s[8];
 } sha256_ctx_t;
 
+/* mapped range from a bmaptool compatible block map, in bytes, end is exclusive */
+typedef struct {
+    uint64_t start, end;
+    uint8_t chksum[32];
+} stream_range_t;
+
+/* where a deflate decoder is in a gzip member, and the CRC32 and size of what it decoded from the member.
+ * A decoder which started in the middle of a member can't check that member's trailer, it keeps it in head */
+typedef struct {
+    int st;                             /* STREAM_GZ*, above STREAM_GZNEXT the trailer is being read */
+    int whole;                          /* crc and len cover the member from its start */
+    uint32_t crc, hcrc;
+    uint64_t len, hlen;
+    uint8_t trl[8], htrl[8];            /* CRC32 and ISIZE from the trailer */
+    int hend;                           /* set if the first member ended, hcrc, hlen and htrl are its part */
+} stream_gz_t;
+
+#ifndef WINVER
+/* ring of decoded buffers, filled by the decoder thread and drained by stream_read() */
+typedef struct {
+    char *slot[STREAM_RINGMAX];
+    int size[STREAM_RINGMAX];
+    uint64_t offs[STREAM_RINGMAX];
+    int num, cnt, head, tail, busy, stop, last;
+    pthread_t thrd;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} stream_ring_t;
+
+/* hashing thread, adds the on-disk data to the checksum while the writer goes on */
+typedef struct {
+    const void *buf;                    /* data being hashed, NULL when idle */
+    int len, stop;
+    pthread_t thrd;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} stream_hasher_t;
+
+/* checksum of the input file from a sidecar like "image.img.xz.sha256", checked on a separate thread */
+typedef struct {
+    char *name;                         /* the sidecar file */
+    uint8_t want[32];
+    uint64_t pos, size;                 /* bytes hashed so far and the input file size */
+    int fd, run, stop, state;           /* state is 0 while hashing, 1 if it matched, -1 if it didn't */
+    pthread_t thrd;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} stream_sum_t;
+
+/* chunk written to the target, checked again by the read-back pass */
+typedef struct {
+    uint64_t offs, hash;                /* offset on the target and XXH64 of the data */
+    int size, zero;                     /* zero is set for a run of zeros, that must read back as zeros */
+} stream_chunk_t;
+
+/* target of the duplicator, with its own writer thread */
+typedef struct {
+    void *dst;                          /* what disks_open() returned */
+    uint64_t seq, done;                 /* next slot to write, and where the data written so far ends */
+    int err, errnum;                    /* STREAM_DUP* result and errno if it failed */
+    char *verifyBuf;
+    pthread_t thrd;
+    void *ctx;                          /* the stream_t, for the writer thread */
+} stream_dupdst_t;
+
+/* duplicator, one decoder and a ring of slots shared by the writer threads, each slot is referenced by
+ * the targets which haven't written it yet. Before the data, a slot might have a run of zeros to clear */
+typedef struct {
+    char *slot[STREAM_RINGMAX];
+    int size[STREAM_RINGMAX], refs[STREAM_RINGMAX];
+    uint64_t offs[STREAM_RINGMAX], zoffs[STREAM_RINGMAX], zsize[STREAM_RINGMAX];
+    uint64_t seq;                       /* number of slots filled so far */
+    int num, numDst, alive, verify, eof, stop;
+    stream_dupdst_t *dst;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} stream_dup_t;
+
+/* independently decodable unit of the input, like a zstd frame */
+typedef struct {
+    uint64_t offs, size;                /* compressed offset and size in the file */
+    uint64_t dsize, bound;              /* decompressed size (0 if unknown) and its upper limit */
+    uint32_t param;                     /* format specific, bit offsets and level for bzip2, gzip header */
+} stream_unit_t;
+
+/* parallel decoder, workers decode units into slots, which are drained in order by the decoder */
+typedef struct {
+    stream_unit_t *unit;
+    int numUnit, next, head, numSlot, numThrd, stop, err;
+    uint64_t pos;                       /* bytes already taken from the head unit */
+    char *slot[STREAM_PARMAX * 2];
+    int done[STREAM_PARMAX * 2];        /* unit number + 1 if the slot holds a decoded unit, negative if failed */
+    uint64_t len[STREAM_PARMAX * 2];    /* decoded size in the slot */
+    uint64_t size[STREAM_PARMAX * 2];   /* allocated size of the slot */
+    uint64_t cap;                       /* largest allowed slot size */
+    int serial, fails;                  /* gzip units that workers couldn't decode are decoded serially */
+    stream_gz_t gz, run;                /* the serial decoder's state, and the member so far for the next unit */
+    stream_gz_t ugz[STREAM_PARMAX * 2]; /* state of the gzip decoder at the end of the unit in the slot */
+    uint64_t zoffs, zend;
+    unsigned char win[32768];           /* last 32k of the output, the dictionary for the serial decoder */
+    int winLen;
+    pthread_t thrd[STREAM_PARMAX];
+    pthread_mutex_t mutex, io;
+    pthread_cond_t cond;
+} stream_par_t;
+#endif
+
 /* stream context */
 typedef struct {
     FILE *f, *g;
     uint64_t fileSize;
     uint64_t compSize;
     uint64_t readSize;
+    uint64_t decSize;
+    uint64_t decOffs;
+    uint64_t pendSize;
     uint64_t cmrdSize;
     uint64_t avail;
     uint64_t avgSpeedBytes;
@@ -72,9 +209,15 @@ typedef struct {
     unsigned char *compBuf;
     char *buffer;
     char *verifyBuf;
-    char hasHash;
+    char hasHash, cksum;                /* cksum is the algorithm, selected when the stream is opened */
     sha256_ctx_t sha;
+    XXH64_state_t xxh;
+    uint32_t crc;
     z_stream zstrm;
+    stream_gz_t gz;                     /* where the deflate decoder is in a gzip member */
+    uint32_t zipCrc, zipWant;           /* CRC32 of the decoded zip entry so far and from the local header */
+    uint64_t zipLen;
+    char zipCheck;
     bz_stream bstrm;
     struct xz_buf xstrm;
     struct xz_dec *xz;
@@ -84,6 +227,31 @@ typedef struct {
     ZSTD_outBuffer zo;
     char type;
     time_t start;
+    stream_range_t *bmap;
+    int numBmap, curBmap, bmapHash;     /* when creating, curBmap is set while the last range is open */
+    int bmapCheck;                      /* the decoded size must match the map's at the end */
+    uint64_t bmapSize;
+    sha256_ctx_t bsha;
+    char *bmapName;
+#ifndef WINVER
+    stream_ring_t *ring;
+    stream_par_t *par;
+    unsigned char *map;                 /* compressed input mapped in memory, NULL if it's read with fread */
+    uint64_t mapSize, mapPos, mapFree;  /* size of the mapping, next byte to decode and how much was given back */
+    uint64_t *holes;                    /* start and end of each hole in a sparse raw image */
+    int numHoles, curHole;
+    uint64_t zeroOffs, zeroSize;        /* hole or zeros skipped by stream_read(), up to or including its data */
+    stream_hasher_t *hasher;
+    char *hashBuf;                      /* the other verify buffer, swapped with verifyBuf when it's handed to the hasher */
+    stream_chunk_t *chunks;             /* recorded by stream_record() for stream_verify() */
+    int numChunks, curChunk, queChunk;
+    stream_sum_t *sum;
+    stream_dup_t *dup;
+    void *tee;                          /* the stream_t writing the decoded image into the cache */
+    char *teeName;                      /* the input's entry in the cache, without the extension */
+    uint64_t teeKey;
+    int teeLock;
+#endif
 } stream_t;
 
 /**
@@ -99,9 +267,68 @@ int stream_open(stream_t *ctx, char *fn, int uncompr);
 
 /**
  * Read no more than buffer_size uncompressed bytes of source data
+ * the data is returned in ctx->buffer, which remains valid until the next call
+ * the data belongs at ctx->readSize - returned size, with a block map this skips unmapped areas
  */
 int stream_read(stream_t *ctx);
 
+#ifndef WINVER
+/**
+ * Copy the next chunk of a raw image directly to the target disk, bypassing ctx->buffer
+ * returns the number of bytes copied, 0 if stream_read() must be used instead or -1 on error
+ */
+int stream_copy(stream_t *ctx, void *dst);
+
+/**
+ * Zero out the hole or run of zeros that stream_read() has skipped (if any) on the target disk. With verify 1 it's
+ * read back right away, with 2 it's recorded for stream_verify(). Returns 1 if the data returned by stream_read()
+ * was zeros too, 0 if it still has to be written, -1 on write error and -2 if it didn't read back as zeros
+ */
+int stream_zero(stream_t *ctx, void *dst, int verify);
+
+/**
+ * Record the hash of the data returned by stream_read() for the read-back pass, returns 0 on success
+ */
+int stream_record(stream_t *ctx, int size);
+
+/**
+ * Read back and check the next recorded chunk on the target disk, once everything was written
+ * returns the number of bytes checked, 0 if there's nothing left or -1 on read error (errno set) or mismatch
+ */
+int stream_verify(stream_t *ctx, void *dst);
+
+/**
+ * Write the whole image to the target disk, verify is 0, 1 (right away) or 2 (read-back after the last write) like
+ * with stream_zero(). progress is called regularly, and writing is cancelled if it returns non-zero
+ * returns 0 on success, -1 if cancelled, otherwise the L_* error code (with errno set if there's a reason)
+ */
+int stream_todisk(stream_t *ctx, void *dst, int verify, int (*progress)(void *data, stream_t *ctx), void *data);
+
+/**
+ * Start the duplicator, a writer thread for each of the num target disks in dst (what disks_open() returned).
+ * The data is decoded only once and written to all of them, verified right after writing if verify is set.
+ * Returns 0 on success
+ */
+int stream_dupstart(stream_t *ctx, void **dst, int num, int verify);
+
+/**
+ * Decode the next chunk and hand it to the writer threads, this only waits if the slowest target is a whole
+ * ring behind. Returns 1 if there's more, 0 at the end of the source, -1 on read error or if all targets failed
+ */
+int stream_dup(stream_t *ctx);
+
+/**
+ * Wait for the writer threads to finish and flush, err receives the STREAM_DUP* result of each target
+ * returns the number of targets that were written successfully
+ */
+int stream_dupend(stream_t *ctx, int *err);
+#endif
+
+/**
+ * Return the number of online processors
+ */
+int stream_ncpu(void);
+
 /**
  * Open file for writing
  */
@@ -123,6 +350,19 @@ void stream_close(stream_t *ctx);
  */
 void stream_baud(int rate);
 
+/**
+ * Select the on-disk data checksum algorithm, returns the length of the name or 0 if it's unknown
+ */
+int stream_checksum(char *name);
+
+#ifndef WINVER
+/**
+ * Keep the decoded compressed images in dir (the user's cache directory if it's NULL), so that writing the same
+ * image again doesn't have to decode it. The least recently used ones are removed above max GiB
+ */
+void stream_cache(char *dir, int max);
+#endif
+
 /**
  * Calculate on-disk data hash
  */
@@ -14,7 +14,8 @@
 /* #define XZ_DEC_CONCATENATED */
 
 /* Uncomment to enable CRC64 support. */
-/* #define XZ_USE_CRC64 */
+/* USBImager: enabled, the CRC64 comes from ../kernels.c */
+#define XZ_USE_CRC64
 
 /* Uncomment as needed to enable BCJ filter decoders. */
 /* #define XZ_DEC_X86 */
@@ -9,51 +9,33 @@
  */
 
 /*
- * This is not the fastest implementation, but it is pretty compact.
- * The fastest versions of xz_crc32() on modern CPUs without hardware
- * accelerated CRC instruction are 3-5 times as fast as this version,
- * but they are bigger and use more memory for the lookup table.
+ * USBImager: the lookup table version that was here is replaced by the runtime
+ * selected kernels (carry-less multiply or CRC instructions where available),
+ * which also provide CRC64. The tables are built by kernels_init(), which
+ * stream_open() calls before any decoder thread starts.
  */
 
 #include "xz_private.h"
-
-/*
- * STATIC_RW_DATA is used in the pre-boot environment on some architectures.
- * See <linux/decompress/mm.h> for details.
- */
-#ifndef STATIC_RW_DATA
-#	define STATIC_RW_DATA static
-#endif
-
-STATIC_RW_DATA uint32_t xz_crc32_table[256];
+#include "../kernels.h"
 
 XZ_EXTERN void xz_crc32_init(void)
 {
-	const uint32_t poly = 0xEDB88320;
-
-	uint32_t i;
-	uint32_t j;
-	uint32_t r;
-
-	for (i = 0; i < 256; ++i) {
-		r = i;
-		for (j = 0; j < 8; ++j)
-			r = (r >> 1) ^ (poly & ~((r & 1) - 1));
-
-		xz_crc32_table[i] = r;
-	}
-
 	return;
 }
 
 XZ_EXTERN uint32_t xz_crc32(const uint8_t *buf, size_t size, uint32_t crc)
 {
-	crc = ~crc;
+	return kernels_crc32(crc, buf, size);
+}
 
-	while (size != 0) {
-		crc = xz_crc32_table[*buf++ ^ (crc & 0xFF)] ^ (crc >> 8);
-		--size;
-	}
+#ifdef XZ_USE_CRC64
+XZ_EXTERN void xz_crc64_init(void)
+{
+	return;
+}
 
-	return ~crc;
+XZ_EXTERN uint64_t xz_crc64(const uint8_t *buf, size_t size, uint64_t crc)
+{
+	return kernels_crc64(crc, buf, size);
 }
+#endif